@@ -25,178 +25,82 @@ namespace LZMA
 	}
 	static ISzAlloc g_Alloc = { SzAlloc, SzFree };
 
-	SRes LzmaEncode( const Byte* inBuffer, size_t inSize, Byte* outBuffer, size_t outSize, size_t* outSizeProcessed )
+	// Compresses the blocks of one thread. The encoder with its match finder and the output
+	// buffer are set up once and reused for every block, the input is read in place.
+	class CEncoder
 	{
-		class CInStreamRam : public ISeqInStream
+	public:
+		explicit CEncoder( const CLzmaEncProps& props ) : m_numThreads( props.numThreads )
 		{
-			const Byte* Data;
-			size_t Size;
-			size_t Pos;
-
-			SRes DoRead( void* buf, size_t* size )
-			{
-				size_t inSize = *size;
-				size_t remain = Size - Pos;
-				if ( inSize > remain )
-					inSize = remain;
-
-				for ( size_t i = 0; i < inSize; ++i )
-					reinterpret_cast<Byte*>( buf )[i] = Data[Pos + i];
-
-				Pos += inSize;
-				*size = inSize;
-				return SZ_OK;
-			}
-
-			static SRes StaticRead( void* p, void* buf, size_t* size )
+			m_enc = LzmaEnc_Create( &g_Alloc );
+			if ( m_enc && !SetProps( props ) )
 			{
-				return reinterpret_cast<CInStreamRam*>( p )->DoRead( buf, size );
+				LzmaEnc_Destroy( m_enc, &g_Alloc, &g_Alloc );
+				m_enc = nullptr;
 			}
+		}
 
-		public:
-			CInStreamRam( const Byte* data, size_t size )
-			{
-				Data = data;
-				Size = size;
-				Pos = 0;
-				Read = StaticRead;
-			}
-		};
-
-		class COutStreamRam : public ISeqOutStream
-		{
-			size_t Size;
-
-			static size_t StaticWrite( void* p, const void* buf, size_t size )
-			{
-				return reinterpret_cast<COutStreamRam*>( p )->DoWrite( buf, size );
-			}
-
-		public:
-			Byte* Data;
-			size_t Pos;
-			bool Overflow;
-
-			COutStreamRam( Byte* data, size_t size )
-			{
-				Data = data;
-				Size = size;
-				Pos = 0;
-				Overflow = false;
-				Write = StaticWrite;
-			}
-
-			size_t DoWrite( const void* buf, size_t size )
-			{
-				size_t i;
-				for ( i = 0; i < size && Pos < Size; ++i )
-					Data[Pos++] = reinterpret_cast<const Byte*>( buf )[i];
-				if ( i != size )
-					Overflow = true;
-				return i;
-			}
-		};
-
-		// Based on Encode helper in SDK/LzmaUtil
-		*outSizeProcessed = 0;
-
-		const size_t kMinDestSize = 13;
-		if ( outSize < kMinDestSize )
-			return SZ_ERROR_FAIL;
-
-		CLzmaEncHandle enc;
-		SRes res;
-		CLzmaEncProps props;
-
-		enc = LzmaEnc_Create( &g_Alloc );
-		if ( !enc )
-			return SZ_ERROR_FAIL;
-
-		LzmaEncProps_Init( &props );
-		res = LzmaEnc_SetProps( enc, &props );
-
-		if ( res != SZ_OK )
-			return res;
-
-		COutStreamRam outStream( outBuffer, outSize );
-
-		Byte header[LZMA_PROPS_SIZE + 8];
-		size_t headerSize = LZMA_PROPS_SIZE;
-
-		res = LzmaEnc_WriteProperties( enc, header, &headerSize );
-		if ( res != SZ_OK )
-			return res;
-
-		// Uncompressed size after properties in header
-		for ( int i = 0; i < 8; i++ )
-			header[headerSize++] = static_cast<Byte>( inSize >> ( 8 * i ) );
-
-		if ( outStream.DoWrite( header, headerSize ) != headerSize )
-			res = SZ_ERROR_WRITE;
-		else if ( res == SZ_OK )
+		~CEncoder()
 		{
-			CInStreamRam inStream( inBuffer, inSize );
-			res = LzmaEnc_Encode( enc, &outStream, &inStream, nullptr, &g_Alloc, &g_Alloc );
-
-			if ( outStream.Overflow )
-				res = SZ_ERROR_FAIL;
-			else
-				*outSizeProcessed = outStream.Pos;
+			if ( m_enc )
+				LzmaEnc_Destroy( m_enc, &g_Alloc, &g_Alloc );
 		}
 
-		LzmaEnc_Destroy( enc, &g_Alloc, &g_Alloc );
-
-		return res;
-	}
+		CEncoder( const CEncoder& ) = delete;
+		CEncoder& operator=( const CEncoder& ) = delete;
 
-	static uint8_t* Compress( uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
-	{
-		*pOutputSize = 0;
+		// Cheap, the match finder and the literal tables only get reallocated on the next
+		// block if their sizes changed. The encoder keeps the threading it got created with.
+		bool SetProps( const CLzmaEncProps& props )
+		{
+			if ( !m_enc )
+				return false;
 
-		// using same work buffer calcs as the SDK 105% + 64K
-		size_t outSize = inputSize / 20 * 21 + ( 1 << 16 );
-		uint8_t* pOutputBuffer = new uint8_t[outSize];
-		if ( !pOutputBuffer )
-			return nullptr;
+			CLzmaEncProps encProps = props;
+			encProps.numThreads    = m_numThreads;
+			if ( LzmaEnc_SetProps( m_enc, &encProps ) != SZ_OK )
+				return false;
 
-		// compress, skipping past our header
-		size_t compressedSize;
-		int result = LzmaEncode( pInput, inputSize, pOutputBuffer + sizeof( lzma_header_t ), outSize - sizeof( lzma_header_t ), &compressedSize );
-		if ( result != SZ_OK )
-		{
-			Assert( result == SZ_OK );
-			delete[] pOutputBuffer;
-			return nullptr;
+			SizeT propsSize = LZMA_PROPS_SIZE;
+			LzmaEnc_WriteProperties( m_enc, m_properties, &propsSize );
+			return true;
 		}
 
-		// construct our header, strip theirs
-		lzma_header_t* pHeader = reinterpret_cast<lzma_header_t*>( pOutputBuffer );
-		pHeader->id = LZMA_ID;
-		pHeader->actualSize = gsl::narrow<uint32_t>( inputSize );
-		pHeader->lzmaSize = gsl::narrow<uint32_t>( compressedSize - 13 );
-		memcpy( pHeader->properties, pOutputBuffer + sizeof( lzma_header_t ), LZMA_PROPS_SIZE );
+		// Returns the compressed block behind our header, or an empty span if compressing
+		// doesn't make it smaller. Stays valid until the next call.
+		std::span<const uint8_t> OpportunisticCompress( const uint8_t* pInput, size_t inputSize )
+		{
+			if ( !m_enc || inputSize <= sizeof( lzma_header_t ) + 1 )
+				return {};
 
-		// shift the compressed data into place
-		memmove( pOutputBuffer + sizeof( lzma_header_t ), pOutputBuffer + sizeof( lzma_header_t ) + 13, compressedSize - 13 );
+			if ( m_buffer.size() < inputSize )
+				m_buffer.resize( inputSize );
 
-		// final output size is our header plus compressed bits
-		*pOutputSize = sizeof( lzma_header_t ) + compressedSize - 13;
+			// Only room for less than the input, so the encoder gives up as soon as the block grows
+			SizeT lzmaSize = inputSize - sizeof( lzma_header_t ) - 1;
+			const SRes result = LzmaEnc_MemEncode( m_enc, m_buffer.data() + sizeof( lzma_header_t ), &lzmaSize, pInput, inputSize, 0, nullptr, &g_Alloc, &g_Alloc );
+			if ( result != SZ_OK )
+			{
+				// compression got worse or stayed the same
+				Assert( result == SZ_ERROR_OUTPUT_EOF );
+				return {};
+			}
 
-		return pOutputBuffer;
-	}
+			lzma_header_t* pHeader = reinterpret_cast<lzma_header_t*>( m_buffer.data() );
+			pHeader->id = LZMA_ID;
+			pHeader->actualSize = gsl::narrow<uint32_t>( inputSize );
+			pHeader->lzmaSize = gsl::narrow<uint32_t>( lzmaSize );
+			memcpy( pHeader->properties, m_properties, LZMA_PROPS_SIZE );
 
-	uint8_t* OpportunisticCompress( uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
-	{
-		uint8_t* pRet = Compress( pInput, inputSize, pOutputSize );
-		if ( *pOutputSize >= inputSize )
-		{
-			// compression got worse or stayed the same
-			delete[] pRet;
-			return nullptr;
+			return { m_buffer.data(), sizeof( lzma_header_t ) + lzmaSize };
 		}
 
-		return pRet;
-	}
+	private:
+		CLzmaEncHandle m_enc;
+		int m_numThreads;
+		Byte m_properties[LZMA_PROPS_SIZE];
+		std::vector<uint8_t> m_buffer;
+	};
 } // namespace LZMA
 
 #endif // LZMA_HPP
\ No newline at end of file
@@ -21,21 +21,26 @@
 #include "d3dcompiler.h"
 #include <atomic>
 #include <concepts>
+#include <deque>
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <future>
 #include <filesystem>
 #include <iomanip>
+#include <random>
 #include <regex>
 #include <thread>
 
 #include "basetypes.h"
+#include "boundedqueue.hpp"
 #include "cfgprocessor.h"
 #include "cmdsink.h"
+#include "compilerbackend.h"
 #include "d3dxfxc.h"
+#include "shadercache.h"
 #include "shader_vcs_version.h"
 #include "utlbuffer.h"
-#include "utlnodehash.h"
 
 #include "ezOptionParser.hpp"
 #include "termcolor/style.hpp"
@@ -47,15 +52,14 @@
 #include "termcolors.hpp"
 #include "strmanip.hpp"
 #include "shaderparser.h"
+#include "json/json.h"
 
 extern "C" {
-#define _7ZIP_ST
-
 #include "C/7zTypes.h"
+#include "C/Threads.c"
 #include "C/LzFind.c"
+#include "C/LzFindMt.c"
 #include "C/LzmaEnc.c"
-
-#undef _7ZIP_ST
 }
 
 #include "LZMA.hpp"
@@ -76,13 +80,47 @@ static uint64_t g_numShaders = 0, g_numCompileCommands = 0, g_numStaticCombos =
 using Clock = std::chrono::high_resolution_clock;
 std::string g_pShaderPath;
 static std::string g_pShaderVersion;
-static uint32_t g_pShaderCRC;
+static robin_hood::unordered_flat_map<std::string, uint32_t> g_ShaderCRC; // Source crc per shader, written to the vcs header
 static Clock::time_point g_flStartTime;
 static DWORD gFlags		= 0;
 bool g_bVerbose			= false;
 static bool g_bVerbose2 = false;
 static bool g_bFastFail = false;
 
+// How the command range is split between the threads, see SplitCommandRange
+enum class Schedule
+{
+	Auto,    // Static for shaders whose static combos are small enough to balance, Chunked for the rest
+	Static,  // Whole static combos, compiled and packed by one thread
+	Chunked, // Chunks of about the same number of live combos, big static combos get cut
+};
+static Schedule g_eSchedule = Schedule::Auto;
+
+// Threads that only compress packed static combos, see CComboPacker. They come out of the
+// -threads budget, the compile pool gets the rest.
+static uint32_t g_nCompressThreads = 0;
+
+// Threads to compile and compress with, -threads or the core count
+static uint32_t ThreadBudget()
+{
+	unsigned long threads;
+	cmdLine.get( "-threads" )->getULong( threads );
+	const uint32_t maxThreads = std::max( 1u, std::thread::hardware_concurrency() );
+	return threads ? std::min<uint32_t>( threads, maxThreads ) : maxThreads;
+}
+
+// LZMA encoder settings of every block, from -lzma-profile and the options refining it
+static CLzmaEncProps g_LzmaProps;
+
+// When the encoders of the compression threads run their match finder on two threads of their own
+enum class LzmaMt
+{
+	Auto, // Once there is nothing left to compile, on as many as the idle compile threads cover
+	On,   // On every compression thread, all the time
+	Off,
+};
+static LzmaMt g_eLzmaMt = LzmaMt::Auto;
+
 struct ShaderInfo_t
 {
 	ShaderInfo_t() { memset( this, 0, sizeof( *this ) ); }
@@ -101,26 +139,105 @@ static robin_hood::unordered_node_map<std::string, ShaderInfo_t> g_ShaderToShade
 
 static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEntryInfo* pEntry, ShaderInfo_t& shaderInfo );
 
+// Compiled combos are carved out of big blocks owned by the thread that compiled them,
+// instead of getting a heap allocation each. Every combo holds a reference on its block,
+// the block goes away once the last of its combos got packed, on whatever thread that was.
+class CByteCodeArena
+{
+public:
+	static constexpr size_t BLOCK_SIZE      = 1024 * 1024;
+	static constexpr size_t MAX_BLOCK_ALLOC = BLOCK_SIZE / 8; // Bigger ones get a block of their own
+
+	struct Block_t
+	{
+		std::atomic<uint32_t> m_nRefs;
+		size_t m_nUsed;
+		size_t m_nSize;
+
+		[[nodiscard]] uint8_t* Data() noexcept { return reinterpret_cast<uint8_t*>( this + 1 ); }
+
+		void Release() noexcept
+		{
+			if ( m_nRefs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+				::operator delete( this );
+		}
+	};
+
+	~CByteCodeArena()
+	{
+		if ( m_pBlock )
+			m_pBlock->Release();
+	}
+
+	// nSize bytes with a reference on rpBlock
+	[[nodiscard]] void* Alloc( size_t nSize, Block_t*& rpBlock )
+	{
+		nSize = ( nSize + alignof( Block_t ) - 1 ) & ~( alignof( Block_t ) - 1 );
+		if ( nSize > MAX_BLOCK_ALLOC )
+		{
+			rpBlock = NewBlock( nSize );
+			rpBlock->m_nUsed = nSize;
+			return rpBlock->Data();
+		}
+
+		if ( !m_pBlock || m_pBlock->m_nSize - m_pBlock->m_nUsed < nSize )
+		{
+			// The thread's own reference, the combos in it keep the old one alive
+			if ( m_pBlock )
+				m_pBlock->Release();
+			m_pBlock = NewBlock( BLOCK_SIZE );
+		}
+
+		m_pBlock->m_nRefs.fetch_add( 1, std::memory_order_relaxed );
+		rpBlock = m_pBlock;
+		void* pData = m_pBlock->Data() + m_pBlock->m_nUsed;
+		m_pBlock->m_nUsed += nSize;
+		return pData;
+	}
+
+private:
+	static Block_t* NewBlock( size_t nSize )
+	{
+		Block_t* pBlock = new( ::operator new( sizeof( Block_t ) + nSize ) ) Block_t;
+		pBlock->m_nRefs.store( 1, std::memory_order_relaxed );
+		pBlock->m_nUsed = 0;
+		pBlock->m_nSize = nSize;
+		return pBlock;
+	}
+
+	Block_t* m_pBlock = nullptr;
+};
+static thread_local CByteCodeArena s_byteCodeArena;
+
 struct CByteCodeBlock
 {
-	CByteCodeBlock *m_pNext, *m_pPrev;
-	int32_t m_nCRC32;
+	CByteCodeBlock* m_pNext; // Combos added to the same static combo
+	CByteCodeArena::Block_t* m_pBlock;
 	uint64_t m_nComboID;
 	size_t m_nCodeSize;
-	std::unique_ptr<uint8_t[]> m_ByteCode;
+	// bytecode follows
+
+	[[nodiscard]] const uint8_t* ByteCode() const noexcept
+	{
+		return reinterpret_cast<const uint8_t*>( this + 1 );
+	}
 
-	CByteCodeBlock()
+	// Copies the bytecode into the arena of the calling thread
+	[[nodiscard]] static CByteCodeBlock* Create( const void* pByteCode, size_t nCodeSize, uint64_t nComboID )
 	{
-		m_ByteCode = nullptr;
+		CByteCodeArena::Block_t* pBlock;
+		CByteCodeBlock* pCode = new( s_byteCodeArena.Alloc( sizeof( CByteCodeBlock ) + nCodeSize, pBlock ) ) CByteCodeBlock;
+		pCode->m_pNext        = nullptr;
+		pCode->m_pBlock       = pBlock;
+		pCode->m_nComboID     = nComboID;
+		pCode->m_nCodeSize    = nCodeSize;
+		memcpy( pCode + 1, pByteCode, nCodeSize );
+		return pCode;
 	}
 
-	CByteCodeBlock( const void* pByteCode, size_t nCodeSize, uint64_t nComboID )
+	void Release() noexcept
 	{
-		m_ByteCode.reset( new uint8_t[nCodeSize] );
-		m_nComboID  = nComboID;
-		m_nCodeSize = nCodeSize;
-		memcpy( m_ByteCode.get(), pByteCode, nCodeSize );
-		m_nCRC32 = CRC32::ProcessSingleBuffer( m_ByteCode.get(), m_nCodeSize );
+		m_pBlock->Release();
 	}
 };
 
@@ -153,104 +270,186 @@ struct CStaticCombo // all the data for one static combo
 
 		using std::unique_ptr<uint8_t[]>::operator bool;
 	};
-	CStaticCombo *m_pNext, *m_pPrev;
 private:
 	uint64_t m_nStaticComboID;
 
-	std::vector<std::unique_ptr<CByteCodeBlock>> m_DynamicCombos;
+	std::atomic<CByteCodeBlock*> m_pAddedCombos; // Lock-free list, sorted into m_DynamicCombos before packing
+	std::vector<CByteCodeBlock*> m_DynamicCombos;
 
 	PackedCode m_abPackedCode; // Packed code for entire static combo
 
-	static bool CompareDynamicComboIDs( const std::unique_ptr<CByteCodeBlock>& pA, const std::unique_ptr<CByteCodeBlock>& pB )
+	static bool CompareDynamicComboIDs( const CByteCodeBlock* pA, const CByteCodeBlock* pB )
 	{
 		return pA->m_nComboID < pB->m_nComboID;
 	}
 
 public:
-	[[nodiscard]] __forceinline uint64_t Key() const
-	{
-		return m_nStaticComboID;
-	}
-
 	[[nodiscard]] __forceinline uint64_t ComboId() const
 	{
 		return m_nStaticComboID;
 	}
 
-	[[nodiscard]] __forceinline CStaticCombo* Next() const
-	{
-		return m_pNext;
-	}
-
 	[[nodiscard]] __forceinline const PackedCode& Code() const
 	{
 		return m_abPackedCode;
 	}
 
-	[[nodiscard]] __forceinline const std::vector<std::unique_ptr<CByteCodeBlock>>& DynamicCombos() const
+	[[nodiscard]] __forceinline const std::vector<CByteCodeBlock*>& DynamicCombos() const
 	{
 		return m_DynamicCombos;
 	}
 
-	CStaticCombo( uint64_t nComboID )
+	CStaticCombo( uint64_t nComboID ) : m_pAddedCombos( nullptr )
 	{
 		m_nStaticComboID = nComboID;
 	}
 
 	~CStaticCombo()
 	{
-		m_DynamicCombos.clear();
+		for ( CByteCodeBlock* pCode = m_pAddedCombos.load(); pCode; )
+			std::exchange( pCode, pCode->m_pNext )->Release();
+		FreeDynamicCombos();
 	}
 
+	// Safe to call from several threads at once
 	void AddDynamicCombo( uint64_t nComboID, const void* pComboData, size_t nCodeSize )
 	{
-		m_DynamicCombos.emplace_back( std::make_unique<CByteCodeBlock>( pComboData, nCodeSize, nComboID ) );
+		CByteCodeBlock* pCode = CByteCodeBlock::Create( pComboData, nCodeSize, nComboID );
+		pCode->m_pNext        = m_pAddedCombos.load( std::memory_order_relaxed );
+		while ( !m_pAddedCombos.compare_exchange_weak( pCode->m_pNext, pCode, std::memory_order_release, std::memory_order_relaxed ) )
+			continue;
 	}
 
+	// Once all the dynamic combos are in
 	void SortDynamicCombos()
 	{
+		for ( CByteCodeBlock* pCode = m_pAddedCombos.exchange( nullptr, std::memory_order_acquire ); pCode; )
+			m_DynamicCombos.emplace_back( std::exchange( pCode, pCode->m_pNext ) );
 		std::sort( m_DynamicCombos.begin(), m_DynamicCombos.end(), CompareDynamicComboIDs );
 	}
 
+	void FreeDynamicCombos()
+	{
+		for ( CByteCodeBlock* pCode : m_DynamicCombos )
+			pCode->Release();
+		decltype( m_DynamicCombos )().swap( m_DynamicCombos );
+	}
+
 	[[nodiscard]] uint8_t* AllocPackedCodeBlock( size_t nPackedCodeSize )
 	{
 		return m_abPackedCode.AllocData( nPackedCodeSize );
 	}
 };
 
-using StaticComboNodeHash_t = CUtlNodeHash<CStaticCombo, 7097, uint64_t>;
-
-template <typename... Args>
-inline StaticComboNodeHash_t** Construct( StaticComboNodeHash_t** pMemory, const Args&... )
+// Compiled bytecode of one shader by static combo id. Threads add to it without any lock,
+// the pages of static combo slots get allocated on first use, so huge static combo spaces
+// only pay for the parts that actually got compiled.
+class CShaderByteCode
 {
-	return ::new ( pMemory ) StaticComboNodeHash_t*( nullptr ); // Explicitly new with NULL
-}
+public:
+	static constexpr uint64_t PAGE_SIZE = 1024;
 
-using CShaderMap = robin_hood::unordered_map<std::string, StaticComboNodeHash_t*>;
-static CShaderMap g_ShaderByteCode;
+	explicit CShaderByteCode( uint64_t numStaticCombos )
+		: m_numPages( ( numStaticCombos + PAGE_SIZE - 1 ) / PAGE_SIZE )
+		, m_arrPages( std::make_unique<std::atomic<Page_t*>[]>( m_numPages ) ) {}
 
-static CStaticCombo* StaticComboFromDictAdd( const char* pszShaderName, uint64_t nStaticComboId )
-{
-	StaticComboNodeHash_t* &rpNodeHash = g_ShaderByteCode[pszShaderName];
-	if ( !rpNodeHash )
-		rpNodeHash = new StaticComboNodeHash_t;
+	~CShaderByteCode()
+	{
+		for ( uint64_t i = 0; i < m_numPages; ++i )
+			delete m_arrPages[i].load();
+	}
+
+	[[nodiscard]] CStaticCombo* Find( uint64_t nStaticComboId ) const noexcept
+	{
+		const Page_t* pPage = m_arrPages[nStaticComboId / PAGE_SIZE].load( std::memory_order_acquire );
+		return pPage ? pPage->m_arrSlots[nStaticComboId % PAGE_SIZE].load( std::memory_order_acquire ) : nullptr;
+	}
 
 	// search for this static combo. make it if not found
-	CStaticCombo* pStaticCombo = rpNodeHash->FindByKey( nStaticComboId );
-	if ( !pStaticCombo )
+	[[nodiscard]] CStaticCombo* FindOrAdd( uint64_t nStaticComboId )
+	{
+		std::atomic<CStaticCombo*>& rSlot = Slot( nStaticComboId );
+		CStaticCombo* pStaticCombo        = rSlot.load( std::memory_order_acquire );
+		if ( pStaticCombo )
+			return pStaticCombo;
+
+		CStaticCombo* pNew = new CStaticCombo( nStaticComboId );
+		if ( rSlot.compare_exchange_strong( pStaticCombo, pNew, std::memory_order_acq_rel ) )
+			return pNew;
+		delete pNew;
+		return pStaticCombo;
+	}
+
+	// Only while no other thread works on this static combo
+	void Remove( uint64_t nStaticComboId ) noexcept
+	{
+		if ( Page_t* pPage = m_arrPages[nStaticComboId / PAGE_SIZE].load( std::memory_order_acquire ) )
+			delete pPage->m_arrSlots[nStaticComboId % PAGE_SIZE].exchange( nullptr );
+	}
+
+	// In static combo id order
+	template <typename F>
+	void ForEach( F&& fn ) const
+	{
+		for ( uint64_t i = 0; i < m_numPages; ++i )
+		{
+			if ( const Page_t* pPage = m_arrPages[i].load( std::memory_order_acquire ) )
+			{
+				for ( const std::atomic<CStaticCombo*>& rSlot : pPage->m_arrSlots )
+				{
+					if ( CStaticCombo* pStaticCombo = rSlot.load( std::memory_order_acquire ) )
+						fn( pStaticCombo );
+				}
+			}
+		}
+	}
+
+private:
+	struct Page_t
+	{
+		std::atomic<CStaticCombo*> m_arrSlots[PAGE_SIZE] {};
+
+		~Page_t()
+		{
+			for ( std::atomic<CStaticCombo*>& rSlot : m_arrSlots )
+				delete rSlot.load();
+		}
+	};
+
+	std::atomic<CStaticCombo*>& Slot( uint64_t nStaticComboId )
 	{
-		pStaticCombo = new CStaticCombo( nStaticComboId );
-		rpNodeHash->Add( pStaticCombo );
+		std::atomic<Page_t*>& rPage = m_arrPages[nStaticComboId / PAGE_SIZE];
+		Page_t* pPage               = rPage.load( std::memory_order_acquire );
+		if ( !pPage )
+		{
+			Page_t* pNew = new Page_t;
+			if ( rPage.compare_exchange_strong( pPage, pNew, std::memory_order_acq_rel ) )
+				pPage = pNew;
+			else
+				delete pNew;
+		}
+		return pPage->m_arrSlots[nStaticComboId % PAGE_SIZE];
 	}
 
-	return pStaticCombo;
+	uint64_t m_numPages;
+	std::unique_ptr<std::atomic<Page_t*>[]> m_arrPages;
+};
+
+// One per entry of g_arrCompileEntries, set up before compiling starts
+static std::unique_ptr<std::unique_ptr<CShaderByteCode>[]> g_arrShaderByteCode;
+
+// Index into g_arrCompileEntries of any CfgEntryInfo of a shader, the entries are in command order
+static uint64_t ShaderIndex( const CfgProcessor::CfgEntryInfo* pInfo ) noexcept
+{
+	const CfgProcessor::CfgEntryInfo* pEntries = g_arrCompileEntries.get();
+	const CfgProcessor::CfgEntryInfo* pEntry   = std::upper_bound( pEntries, pEntries + g_numShaders, pInfo->m_iCommandStart,
+		[]( uint64_t iCommand, const CfgProcessor::CfgEntryInfo& e ) { return iCommand < e.m_iCommandStart; } ) - 1;
+	return pEntry - pEntries;
 }
 
-static CStaticCombo* StaticComboFromDict( const char* pszShaderName, uint64_t nStaticComboId )
+static CShaderByteCode& ShaderByteCode( const CfgProcessor::CfgEntryInfo* pInfo ) noexcept
 {
-	if ( StaticComboNodeHash_t* pNodeHash = g_ShaderByteCode[pszShaderName] )
-		return pNodeHash->FindByKey( nStaticComboId );
-	return nullptr;
+	return *g_arrShaderByteCode[ShaderIndex( pInfo )];
 }
 
 class CompilerMsgInfo
@@ -275,6 +474,7 @@ protected:
 
 static robin_hood::unordered_flat_set<std::string> g_ShaderHadError;
 static robin_hood::unordered_flat_set<std::string> g_ShaderWrittenToDisk;
+static robin_hood::unordered_flat_map<std::string, uint64_t> g_ShaderStaticCombosPackaged;
 struct CompilerMsg
 {
 	robin_hood::unordered_node_map<std::string, CompilerMsgInfo> warning;
@@ -424,21 +624,38 @@ static bool CompareDupComboIndices( const StaticComboAliasRecord_t& pA, const St
 	return pA.m_nStaticComboID < pB.m_nStaticComboID;
 }
 
-static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf )
+// The single threaded encoder of the calling thread, set up on first use. Encoders with the
+// multithreaded match finder are never thread_local: their destructor joins the match finder
+// threads, which must not happen under the loader lock at thread exit. See CComboPacker::Execute.
+static LZMA::CEncoder& ThreadEncoder()
+{
+	thread_local LZMA::CEncoder encoder( g_LzmaProps );
+	return encoder;
+}
+
+// The settings of an encoder with the multithreaded match finder
+static CLzmaEncProps MtEncoderProps()
+{
+	CLzmaEncProps props = g_LzmaProps;
+	props.numThreads    = 2;
+	return props;
+}
+
+static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf, const CLzmaEncProps& props, LZMA::CEncoder& encoder )
 {
 	if ( !pDynamicComboBuffer.TellPut() )
 		// Nothing to do here
 		return;
 
-	size_t nCompressedSize;
-	uint8_t* pCompressedShader = LZMA::OpportunisticCompress( reinterpret_cast<uint8_t*>( pDynamicComboBuffer.Base() ), pDynamicComboBuffer.TellPut(), &nCompressedSize );
+	encoder.SetProps( props );
+	const std::span<const uint8_t> compressed = encoder.OpportunisticCompress( reinterpret_cast<const uint8_t*>( pDynamicComboBuffer.Base() ), pDynamicComboBuffer.TellPut() );
 	// high 2 bits of length =
 	// 00 = bzip2 compressed
 	// 10 = uncompressed
 	// 01 = lzma compressed
 	// 11 = unused
 
-	if ( !pCompressedShader )
+	if ( compressed.empty() )
 	{
 		// it grew
 		const unsigned long lFlagSize = 0x80000000 | pDynamicComboBuffer.TellPut();
@@ -448,23 +665,62 @@ static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBu
 	}
 	else
 	{
-		const unsigned long lFlagSize = 0x40000000 | gsl::narrow<uint32_t>( nCompressedSize );
+		const unsigned long lFlagSize = 0x40000000 | gsl::narrow<uint32_t>( compressed.size() );
 		pBuf.Put( &lFlagSize, sizeof( lFlagSize ) );
-		pBuf.Put( pCompressedShader, gsl::narrow<uint32_t>( nCompressedSize ) );
-		delete[] pCompressedShader;
-		pnTotalFlushedSize += sizeof( lFlagSize ) + nCompressedSize;
+		pBuf.Put( compressed.data(), gsl::narrow<int>( compressed.size() ) );
+		pnTotalFlushedSize += sizeof( lFlagSize ) + compressed.size();
 	}
 	pDynamicComboBuffer.Clear(); // start over
 }
 
-static void OutputDynamicCombo( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf, uint64_t nComboID, uint32_t nComboSize, const uint8_t* pComboCode )
+// Splits the sorted dynamic combos into the blocks they get compressed in. A block ends
+// before the combo that would take it up to MAX_SHADER_UNPACKED_BLOCK_SIZE, so the blocks
+// are independent of each other and can be compressed in any order.
+static void SplitComboBlocks( const std::vector<CByteCodeBlock*>& arrCombos, std::vector<uint32_t>& arrBlockStarts )
+{
+	size_t nBlockSize = 0;
+	for ( uint32_t i = 0; i < arrCombos.size(); ++i )
+	{
+		const size_t nComboSize = arrCombos[i]->m_nCodeSize;
+		if ( !i || ( nBlockSize && nBlockSize + nComboSize + 16 >= MAX_SHADER_UNPACKED_BLOCK_SIZE ) )
+		{
+			arrBlockStarts.emplace_back( i );
+			nBlockSize = 0;
+		}
+		nBlockSize += 2 * sizeof( uint32_t ) + nComboSize;
+	}
+}
+
+// The dynamic combos of block iBlock out of SplitComboBlocks
+static std::span<CByteCodeBlock* const> ComboBlock( const std::vector<CByteCodeBlock*>& arrCombos, const std::vector<uint32_t>& arrBlockStarts, uint32_t iBlock )
+{
+	const uint32_t iStart = arrBlockStarts[iBlock];
+	const uint32_t iEnd   = iBlock + 1 < arrBlockStarts.size() ? arrBlockStarts[iBlock + 1] : gsl::narrow<uint32_t>( arrCombos.size() );
+	return std::span( arrCombos ).subspan( iStart, iEnd - iStart );
+}
+
+// Lays a block of dynamic combos out the way it gets compressed, the bytecode is read straight out of the arena
+static void PutComboBlock( std::span<CByteCodeBlock* const> combos, CUtlBuffer& pBuf )
+{
+	for ( const CByteCodeBlock* pCode : combos )
+	{
+		pBuf.PutUnsignedInt( gsl::narrow<uint32_t>( pCode->m_nComboID ) );
+		pBuf.PutUnsignedInt( gsl::narrow<uint32_t>( pCode->m_nCodeSize ) );
+		pBuf.Put( pCode->ByteCode(), gsl::narrow<int>( pCode->m_nCodeSize ) );
+	}
+}
+
+// Compresses one block of dynamic combos into pBuf. Returns the length written.
+static size_t PackComboBlock( std::span<CByteCodeBlock* const> combos, CUtlBuffer& pBuf, const CLzmaEncProps& props, LZMA::CEncoder& encoder )
 {
-	if ( pDynamicComboBuffer.TellPut() + nComboSize + 16 >= MAX_SHADER_UNPACKED_BLOCK_SIZE )
-		FlushCombos( pnTotalFlushedSize, pDynamicComboBuffer, pBuf );
+	// Kept around, so it only grows once per thread
+	thread_local CUtlBuffer ubDynamicComboBuffer;
+	ubDynamicComboBuffer.Clear();
+	PutComboBlock( combos, ubDynamicComboBuffer );
 
-	pDynamicComboBuffer.PutUnsignedInt( gsl::narrow<uint32_t>( nComboID ) );
-	pDynamicComboBuffer.PutUnsignedInt( nComboSize );
-	pDynamicComboBuffer.Put( pComboCode, nComboSize );
+	size_t nBytesWritten = 0;
+	FlushCombos( nBytesWritten, ubDynamicComboBuffer, pBuf, props, encoder );
+	return nBytesWritten;
 }
 
 static void GetVCSFilenames( std::span<char> pszMainOutFileName, const ShaderInfo_t& si )
@@ -503,8 +759,8 @@ static void GetVCSFilenames( std::span<char> pszMainOutFileName, const ShaderInf
 // on the async writing thread.
 //
 // So the function WriteShaderFiles should not be reentrant, however the
-// data that it uses might be updated by the main thread when built pieces
-// are received from the workers.
+// data that it uses might be updated by the workers while they compile
+// the remaining shaders.
 //
 static constexpr uint32_t STATIC_COMBO_HASH_SIZE = 73;
 
@@ -521,10 +777,14 @@ static bool CompareComboIds( const StaticComboAuxInfo_t& pA, const StaticComboAu
 
 static void WriteShaderFiles( const char* pShaderName )
 {
-	if ( !g_ShaderWrittenToDisk.emplace( pShaderName ).second )
+	GLOBAL_DATA_MTX_LOCK();
+	const bool bFirstWrite   = g_ShaderWrittenToDisk.emplace( pShaderName ).second;
+	const bool bShaderFailed = g_ShaderHadError.contains( pShaderName );
+	GLOBAL_DATA_MTX_UNLOCK();
+
+	if ( !bFirstWrite )
 		return;
 
-	const bool bShaderFailed                = g_ShaderHadError.contains( pShaderName );
 	const char* const szShaderFileOperation = bShaderFailed ? "Removing failed" : "Writing";
 
 	//static int lastLine               = 0;
@@ -543,24 +803,20 @@ static void WriteShaderFiles( const char* pShaderName )
 	// from global variables under lock.
 	//
 	GLOBAL_DATA_MTX_LOCK();
-	StaticComboNodeHash_t* pByteCodeArray;
-	{
-		StaticComboNodeHash_t*& rp = g_ShaderByteCode[pShaderName]; // Get a static combo pointer, reset it as well
-		pByteCodeArray             = rp;
-		rp                         = nullptr;
-	}
+	const CfgProcessor::CfgEntryInfo* pAnalyze = g_arrCompileEntries.get();
+	while ( pAnalyze->m_szName && strcmp( pAnalyze->m_szName, pShaderName ) )
+		++pAnalyze;
+
+	// Take the bytecode over, all of the static combos are packaged
+	std::unique_ptr<CShaderByteCode> pByteCodeArray;
+	if ( pAnalyze->m_szName )
+		pByteCodeArray = std::move( g_arrShaderByteCode[pAnalyze - g_arrCompileEntries.get()] );
+
 	ShaderInfo_t shaderInfo = g_ShaderToShaderInfo[pShaderName];
-	if ( !shaderInfo.m_pShaderName )
+	if ( !shaderInfo.m_pShaderName && pAnalyze->m_szName )
 	{
-		for ( const CfgProcessor::CfgEntryInfo* pAnalyze = g_arrCompileEntries.get(); pAnalyze->m_szName; ++pAnalyze )
-		{
-			if ( !strcmp( pAnalyze->m_szName, pShaderName ) )
-			{
-				Shader_ParseShaderInfoFromCompileCommands( pAnalyze, shaderInfo );
-				g_ShaderToShaderInfo[pShaderName] = shaderInfo;
-				break;
-			}
-		}
+		Shader_ParseShaderInfoFromCompileCommands( pAnalyze, shaderInfo );
+		g_ShaderToShaderInfo[pShaderName] = shaderInfo;
 	}
 	GLOBAL_DATA_MTX_UNLOCK();
 
@@ -582,7 +838,10 @@ static void WriteShaderFiles( const char* pShaderName )
 		return;
 	}
 
-	if ( !pByteCodeArray )
+	std::vector<CStaticCombo*> arrStatics;
+	if ( pByteCodeArray )
+		pByteCodeArray->ForEach( [&arrStatics]( CStaticCombo* pStatic ) { arrStatics.emplace_back( pStatic ); } );
+	if ( arrStatics.empty() )
 		return;
 
 	if ( g_bVerbose )
@@ -597,51 +856,48 @@ static void WriteShaderFiles( const char* pShaderName )
 	//
 	std::vector<StaticComboAuxInfo_t> StaticComboHeaders;
 
-	StaticComboHeaders.reserve( 1ULL + pByteCodeArray->Count() ); // we know how much ram we need
+	StaticComboHeaders.reserve( 1ULL + arrStatics.size() ); // we know how much ram we need
 
 	std::vector<size_t> comboIndicesHashedByCRC32[STATIC_COMBO_HASH_SIZE];
 	std::vector<StaticComboAliasRecord_t> duplicateCombos;
 
 	// now, lets fill in our combo headers, sort, and write
-	for ( uint32_t nChain = 0; nChain < StaticComboNodeHash_t::NumChains; nChain++ )
+	for ( CStaticCombo* pStatic : arrStatics )
 	{
-		for ( CStaticCombo* pStatic = pByteCodeArray->Chain( nChain ).Head(); pStatic; pStatic = pStatic->Next() )
+		const CStaticCombo::PackedCode& code = pStatic->Code();
+		if ( code.GetLength() )
 		{
-			const CStaticCombo::PackedCode& code = pStatic->Code();
-			if ( code.GetLength() )
+			StaticComboAuxInfo_t hdr {
+				{
+					.m_nStaticComboID = gsl::narrow<uint32_t>( pStatic->ComboId() ),
+					.m_nFileOffset = 0,
+				},
+				CRC32::ProcessSingleBuffer( code.GetData(), code.GetLength() ),
+				pStatic
+			};
+			const uint32_t nHashIdx = hdr.m_nCRC32 % STATIC_COMBO_HASH_SIZE;
+			__assume( 0 <= nHashIdx && nHashIdx < STATIC_COMBO_HASH_SIZE );
+
+			// now, see if we have an identical static combo
+			auto& hash = comboIndicesHashedByCRC32[nHashIdx];
+			bool bIsDuplicate = false;
+			for ( const size_t i : hash )
 			{
-				StaticComboAuxInfo_t hdr {
-					{
-						.m_nStaticComboID = gsl::narrow<uint32_t>( pStatic->ComboId() ),
-						.m_nFileOffset = 0,
-					},
-					CRC32::ProcessSingleBuffer( code.GetData(), code.GetLength() ),
-					pStatic
-				};
-				const uint32_t nHashIdx = hdr.m_nCRC32 % STATIC_COMBO_HASH_SIZE;
-				__assume( 0 <= nHashIdx && nHashIdx < STATIC_COMBO_HASH_SIZE );
-
-				// now, see if we have an identical static combo
-				auto& hash = comboIndicesHashedByCRC32[nHashIdx];
-				bool bIsDuplicate = false;
-				for ( const size_t i : hash )
+				const StaticComboAuxInfo_t& check = StaticComboHeaders[i];
+				const CStaticCombo::PackedCode& checkCode = check.m_pByteCode->Code();
+				if ( check.m_nCRC32 == hdr.m_nCRC32 && checkCode.GetLength() == code.GetLength() && memcmp( checkCode.GetData(), code.GetData(), checkCode.GetLength() ) == 0 )
 				{
-					const StaticComboAuxInfo_t& check = StaticComboHeaders[i];
-					const CStaticCombo::PackedCode& checkCode = check.m_pByteCode->Code();
-					if ( check.m_nCRC32 == hdr.m_nCRC32 && checkCode.GetLength() == code.GetLength() && memcmp( checkCode.GetData(), code.GetData(), checkCode.GetLength() ) == 0 )
-					{
-						// this static combo is the same as another one!!
-						duplicateCombos.emplace_back( StaticComboAliasRecord_t { hdr.m_nStaticComboID, check.m_nStaticComboID } );
-						bIsDuplicate = true;
-						break;
-					}
+					// this static combo is the same as another one!!
+					duplicateCombos.emplace_back( StaticComboAliasRecord_t { hdr.m_nStaticComboID, check.m_nStaticComboID } );
+					bIsDuplicate = true;
+					break;
 				}
+			}
 
-				if ( !bIsDuplicate )
-				{
-					StaticComboHeaders.emplace_back( std::move( hdr ) );
-					hash.emplace_back( StaticComboHeaders.size() - 1 );
-				}
+			if ( !bIsDuplicate )
+			{
+				StaticComboHeaders.emplace_back( std::move( hdr ) );
+				hash.emplace_back( StaticComboHeaders.size() - 1 );
 			}
 		}
 	}
@@ -653,6 +909,9 @@ static void WriteShaderFiles( const char* pShaderName )
 
 	//const unsigned int crc32 = SourceCodeHasher::CalculateCRC( shaderInfo.m_pShaderSrc );
 
+	// Only looked up, the compile threads may still be working on the other shaders
+	const auto itCRC = g_ShaderCRC.find( pShaderName );
+
 	//
 	// Shader file stream buffer
 	//
@@ -666,7 +925,7 @@ static void WriteShaderFiles( const char* pShaderName )
 		shaderInfo.m_Flags,
 		shaderInfo.m_CentroidMask,
 		gsl::narrow<uint32_t>( StaticComboHeaders.size() ),
-		g_pShaderCRC //crc32
+		itCRC != g_ShaderCRC.end() ? itCRC->second : 0 //crc32
 	};
 	ShaderFile.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
 
@@ -691,7 +950,7 @@ static void WriteShaderFiles( const char* pShaderName )
 		SRec.m_nFileOffset = gsl::narrow<uint32_t>( ShaderFile.tellp() );
 		if ( SRec.m_nStaticComboID != 0xffffffff ) // sentinel key?
 		{
-			CStaticCombo* pStatic = pByteCodeArray->FindByKey( SRec.m_nStaticComboID );
+			CStaticCombo* pStatic = pByteCodeArray->Find( SRec.m_nStaticComboID );
 			Assert( pStatic );
 
 			// Put the packed chunk of code for this static combo
@@ -715,13 +974,72 @@ static void WriteShaderFiles( const char* pShaderName )
 	ShaderFile.close();
 
 	// Finalize, free memory
-	delete pByteCodeArray;
+	pByteCodeArray.reset();
 
 	std::cout << "\r" << clr::green << pShaderName << clr::reset << " " << FormatTimeShort( std::chrono::duration_cast<std::chrono::seconds>( Clock::now() - lastTime ).count() ) << "                                        \r";
 	//std::cout << ( "\033["s + std::to_string( lastLine ) + "A" );
 	lastTime = Clock::now();
 }
 
+//
+// Async writing thread: the workers queue every finished shader here and go on compiling,
+// WriteShaderFiles runs in the background. The queue is bounded, so a slow disk throttles
+// the workers instead of piling up packed shaders in memory.
+//
+class CShaderWriterThread
+{
+public:
+	CShaderWriterThread() : m_queue( 8 ), m_numWritten( 0 ), m_tBusy( 0 ), m_tDrain( 0 ) {}
+
+	void Start()
+	{
+		// The writer runs next to the compile threads however many there are, so the global data needs its locks
+		Threading::g_mtxGlobal.SetThreadedMode( Threading::eMultiThreaded );
+		Threading::g_mtxMsgReport.SetThreadedMode( Threading::eMultiThreaded );
+		m_thread = std::thread( &CShaderWriterThread::Execute, this );
+	}
+
+	void Push( const char* pShaderName )
+	{
+		m_queue.Push( pShaderName );
+	}
+
+	// Writes whatever is still queued and stops the thread
+	void Finish()
+	{
+		const Clock::time_point tStart = Clock::now();
+		m_queue.Close();
+		if ( m_thread.joinable() )
+			m_thread.join();
+		m_tDrain = Clock::now() - tStart;
+	}
+
+	[[nodiscard]] uint64_t NumWritten() const noexcept { return m_numWritten; }
+	// Time spent writing in total
+	[[nodiscard]] Clock::duration BusyTime() const noexcept { return m_tBusy; }
+	// The part of it the compilation had to wait for
+	[[nodiscard]] Clock::duration DrainTime() const noexcept { return m_tDrain; }
+
+private:
+	void Execute()
+	{
+		for ( const char* pShaderName; m_queue.Pop( pShaderName ); )
+		{
+			const Clock::time_point tStart = Clock::now();
+			WriteShaderFiles( pShaderName );
+			m_tBusy += Clock::now() - tStart;
+			++m_numWritten;
+		}
+	}
+
+	CBoundedQueue<const char*> m_queue;
+	std::thread m_thread;
+	uint64_t m_numWritten;
+	Clock::duration m_tBusy;
+	Clock::duration m_tDrain;
+};
+static CShaderWriterThread g_ShaderWriter;
+
 static void PrintCompileErrors()
 {
 	// Write all the errors
@@ -753,7 +1071,8 @@ static void PrintCompileErrors()
 		{
 			const auto& msg = sMsg.second;
 			const auto& shaderName = sMsg.first;
-			const std::string searchPat = *cmdLine.lastArgs[0] + "("; // TODO: rework when readding support for multiple files
+			const ShaderInfo_t& shaderInfo = g_ShaderToShaderInfo[shaderName];
+			const std::string searchPat = std::string( shaderInfo.m_pShaderSrc ? shaderInfo.m_pShaderSrc : shaderName.c_str() ) + "(";
 
 			if (const size_t warnings = msg.warning.size())
 				std::cout << shaderName << " " << clr::yellow << warnings << " WARNING(S):                                                         " << clr::reset << std::endl;
@@ -765,7 +1084,7 @@ static void PrintCompileErrors()
 				const uint64_t numReported = cmi.GetNumTimesReported();
 
 				std::string m = trim(szMsg);
-				if (size_t find = m.find(searchPat); find != std::string::npos)
+				if (size_t find = m.find(searchPat); find != std::string::npos && find >= cwdLen)
 					m = m.replace(find - cwdLen, cwdLen, "");
 				std::cout << m << "\nReported " << clr::green << numReported << clr::reset << " time(s)" << std::endl;
 			}
@@ -782,7 +1101,7 @@ static void PrintCompileErrors()
 				const uint64_t numReported = cmi.GetNumTimesReported();
 
 				std::string m = trim(szMsg);
-				if (size_t find = m.find(searchPat); find != std::string::npos)
+				if (size_t find = m.find(searchPat); find != std::string::npos && find >= cwdLen)
 					m = m.replace(find - cwdLen, cwdLen, "");
 				std::cout << m << "\nReported " << clr::green << numReported << clr::reset << " time(s), example command: " << std::endl;
 
@@ -796,33 +1115,10 @@ static void PrintCompileErrors()
 		std::cout << clr::pinkish << "FAILED: " << clr::red << failed << clr::reset << std::endl;
 }
 
-// Assemble a reply package to the master from the compiled bytecode
-// return the length of the package.
-static size_t AssembleWorkerReplyPackage( const CfgProcessor::CfgEntryInfo* pEntry, uint64_t nComboOfEntry, CUtlBuffer& pBuf )
+// Prints the progress once a second, call under the global lock.
+// Returns whether the shader failed, its combos don't get packed then.
+static bool ReportPackageProgress( const CfgProcessor::CfgEntryInfo* pEntry, uint64_t nComboOfEntry )
 {
-	GLOBAL_DATA_MTX_LOCK();
-	CStaticCombo* pStComboRec             = StaticComboFromDict( pEntry->m_szName, nComboOfEntry );
-	StaticComboNodeHash_t* pByteCodeArray = g_ShaderByteCode[pEntry->m_szName];
-	GLOBAL_DATA_MTX_UNLOCK();
-
-	size_t nBytesWritten = 0;
-
-	if ( pStComboRec && !pStComboRec->DynamicCombos().empty() )
-	{
-		CUtlBuffer ubDynamicComboBuffer;
-
-		pStComboRec->SortDynamicCombos();
-		// iterate over all dynamic combos.
-		for ( auto& combo : pStComboRec->DynamicCombos() )
-		{
-			CByteCodeBlock* pCode = combo.get();
-			// check if we have already output an identical combo
-			OutputDynamicCombo( nBytesWritten, ubDynamicComboBuffer, pBuf, pCode->m_nComboID,
-								gsl::narrow<uint32_t>( pCode->m_nCodeSize ), pCode->m_ByteCode.get() );
-		}
-		FlushCombos( nBytesWritten, ubDynamicComboBuffer, pBuf );
-	}
-
 	// Time to limit amount of prints
 	static Clock::time_point s_fLastInfoTime;
 	static uint64_t s_nLastEntry = nComboOfEntry;
@@ -830,13 +1126,6 @@ static size_t AssembleWorkerReplyPackage( const CfgProcessor::CfgEntryInfo* pEnt
 	static const char* s_lastShader = pEntry->m_szName;
 	const Clock::time_point fCurTime = Clock::now();
 
-	GLOBAL_DATA_MTX_LOCK();
-	if ( pStComboRec )
-	{
-		CStaticCombo *pCombo = pByteCodeArray->FindByKey( nComboOfEntry );
-		pByteCodeArray->DeleteByKey( nComboOfEntry );
-		delete pCombo;
-	}
 	if ( std::chrono::duration_cast<std::chrono::seconds>( fCurTime - s_fLastInfoTime ).count() != 0 )
 	{
 		if ( s_lastShader != pEntry->m_szName )
@@ -852,15 +1141,8 @@ static size_t AssembleWorkerReplyPackage( const CfgProcessor::CfgEntryInfo* pEnt
 				  << clr::green2 << s_averageProcess.GetAverage() << clr::reset << " c/m) ] " << FormatTimeShort( std::chrono::duration_cast<std::chrono::seconds>( fCurTime - g_flStartTime ).count() ) << " elapsed         \r";
 		s_fLastInfoTime = fCurTime;
 	}
-	if (g_ShaderHadError.contains(pEntry->m_szName))
-	{
-		PrintCompileErrors();
-		return 0;
-	}
-
-	GLOBAL_DATA_MTX_UNLOCK();
-
-	return nBytesWritten;
+	// Failed shaders are not packed, their errors get printed at the end
+	return g_ShaderHadError.contains( pEntry->m_szName );
 }
 
 template <Threading::Mutex TMutexType>
@@ -869,37 +1151,51 @@ class CWorkerAccumState
 public:
 	explicit CWorkerAccumState( TMutexType* pMutex ) noexcept
 		: m_pMutex( pMutex ), m_iFirstCommand( 0 )
-		, m_iNextCommand( 0 ), m_iEndCommand( 0 )
-		, m_iLastFinished( 0 ), m_hCombo( nullptr ) {}
+		, m_iEndCommand( 0 ), m_nChunks( 0 ) {}
+
+	~CWorkerAccumState()
+	{
+		{
+			std::lock_guard lock( m_mtxPool );
+			m_bShutdown = true;
+		}
+		m_cvWork.notify_all();
+
+		std::for_each( m_arrThreads.begin(), m_arrThreads.end(), []( std::thread& t ) { t.join(); } );
+	}
 
 	void RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand );
 	void RangeFinished();
 
-	void ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo );
-	void ExecuteCompileCommandThreaded( CfgProcessor::ComboHandle hCombo );
+	void ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo, CfgProcessor::ComboCommand& command );
+	void ExecuteCompileCommandThreaded( CfgProcessor::ComboHandle hCombo, CfgProcessor::ComboCommand& command );
 	void HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse );
 
-	void Run( uint32_t ov = 0 )
+	// Starts the worker threads, they stay alive for all the following ranges
+	void Start( uint32_t ov = 0 )
 	{
 		const uint32_t maxThreads = std::thread::hardware_concurrency();
-		uint32_t i = ov ? std::min( ov, maxThreads ) : maxThreads;
-
-		m_arrSubProcessInfos.reserve( i );
-		std::vector<std::thread> active;
+		const uint32_t numThreads = ov ? std::min( ov, maxThreads ) : maxThreads;
 
-		while ( i-- > 0 )
-		{
-			++m_nActive;
-			active.emplace_back( DoExecute, this );
-		}
+		// Every thread owns one chunk queue
+		m_arrQueues = std::make_unique<ChunkQueue_t[]>( numThreads );
+		m_arrThreads.reserve( numThreads );
+		for ( uint32_t i = 0; i < numThreads; ++i )
+			m_arrThreads.emplace_back( DoExecute, this, i );
+	}
 
-		while ( m_nActive )
+	// Wakes up the worker threads for the current range and blocks until all of them are done with it
+	void Run()
+	{
 		{
-			_mm_pause();
-			Sleep( 250 );
+			std::lock_guard lock( m_mtxPool );
+			m_nActive = gsl::narrow<uint32_t>( m_arrThreads.size() );
+			++m_nGeneration;
 		}
+		m_cvWork.notify_all();
 
-		std::for_each( active.begin(), active.end(), []( std::thread& t ) { t.join(); } );
+		std::unique_lock lock( m_mtxPool );
+		m_cvDone.wait( lock, [this] { return !m_nActive; } );
 	}
 
 	void OnProcessST();
@@ -911,85 +1207,878 @@ public:
 
 protected:
 	std::atomic<bool> m_bBreak;
-	std::atomic<int> m_nActive;
 	TMutexType* m_pMutex;
 
-	static void DoExecute( CWorkerAccumState* pThis )
+	// Worker pool, the threads sleep on m_cvWork until the next range is started
+	std::vector<std::thread> m_arrThreads;
+	std::mutex m_mtxPool;
+	std::condition_variable m_cvWork;
+	std::condition_variable m_cvDone;
+	uint64_t m_nGeneration = 0;
+	uint32_t m_nActive     = 0;
+	bool m_bShutdown       = false;
+
+	static void DoExecute( CWorkerAccumState* pThis, uint32_t iSlot )
 	{
-		while ( pThis->OnProcess() )
-			continue;
+		for ( uint64_t nGeneration = 0;; )
+		{
+			{
+				std::unique_lock lock( pThis->m_mtxPool );
+				pThis->m_cvWork.wait( lock, [pThis, nGeneration] { return pThis->m_bShutdown || pThis->m_nGeneration != nGeneration; } );
+				if ( pThis->m_bShutdown )
+					return;
+				nGeneration = pThis->m_nGeneration;
+			}
+
+			while ( pThis->OnProcess( iSlot ) )
+				continue;
 
-		--pThis->m_nActive;
+			std::lock_guard lock( pThis->m_mtxPool );
+			if ( !--pThis->m_nActive )
+				pThis->m_cvDone.notify_all();
+		}
 	}
 
-	thread_local static uint64_t* m_iCurrentId;
-	std::vector<uint64_t> m_arrSubProcessInfos;
+	// Every static combo of the chunked shaders counts down the combos it still waits for,
+	// the thread that brings it to zero hands it to the packer
+	struct StaticSlot_t
+	{
+		std::atomic<uint64_t> m_nOutstanding; // Live combos, or commands for shaders without a live combo map
+		const CfgProcessor::CfgEntryInfo* m_pInfo;
+		uint64_t m_nStaticCombo;
+		StaticSlot_t* m_pNextDone;
+	};
+
+	// The range is split into chunks of commands, every chunk is compiled
+	// in order by a single thread with its own combo handle
+	struct CommandChunk_t
+	{
+		uint64_t m_iStart;
+		uint64_t m_iEnd;
+		uint64_t m_iProgress; // All the commands of the chunk before this one are done
+		const CfgProcessor::CfgEntryInfo* m_pStaticEntry; // Whole static combos, packed by the thread that compiles them
+		StaticSlot_t* m_pSlots; // Static combos of the shader in command order, for the other chunks
+	};
+
+	// Chunks are handed out from the front of the owner's queue and stolen from the back by the other threads
+	struct ChunkQueue_t
+	{
+		TMutexType mtx;
+		std::deque<uint32_t> chunks;
+	};
+
+	thread_local static CommandChunk_t* m_pCurrentChunk;
+	thread_local static CStaticCombo* m_pCurrentStatic; // Collects the combos of a static scheduled chunk
+	std::unique_ptr<ChunkQueue_t[]> m_arrQueues;
+	std::unique_ptr<CommandChunk_t[]> m_arrChunks;
 	uint64_t m_iFirstCommand;
-	uint64_t m_iNextCommand;
 	uint64_t m_iEndCommand;
 
-	uint64_t m_iLastFinished;
+	uint32_t m_nChunks;
 
-	CfgProcessor::ComboHandle m_hCombo;
+	std::unique_ptr<StaticSlot_t[]> m_arrStatics;
+	std::atomic<StaticSlot_t*> m_pDoneStatics { nullptr }; // Lock-free stack of the static combos ready to pack
 
-	bool OnProcess();
-	void TryToPackageData( uint64_t iCommandNumber );
+	[[nodiscard]] uint32_t NumQueues() const noexcept { return std::max<uint32_t>( 1, gsl::narrow<uint32_t>( m_arrThreads.size() ) ); }
+
+	bool OnProcess( uint32_t iSlot );
+	bool PopChunk( uint32_t iSlot, uint32_t& riChunk );
+	void ProcessChunk( CommandChunk_t& chunk, bool bThreaded );
+	void ProcessStaticChunk( CommandChunk_t& chunk, bool bThreaded );
+	void InitStaticSlots( const CfgProcessor::CfgEntryInfo* pInfo, StaticSlot_t* pSlots );
+	void AdvanceChunk( CommandChunk_t& chunk, uint64_t iProgress, bool bCompiled );
+	void TryToPackageData();
 };
 template <Threading::Mutex TMutexType>
-thread_local uint64_t* CWorkerAccumState<TMutexType>::m_iCurrentId;
-
+thread_local typename CWorkerAccumState<TMutexType>::CommandChunk_t* CWorkerAccumState<TMutexType>::m_pCurrentChunk;
 template <Threading::Mutex TMutexType>
-void CWorkerAccumState<TMutexType>::RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand )
+thread_local CStaticCombo* CWorkerAccumState<TMutexType>::m_pCurrentStatic;
+
+struct CommandRange_t
 {
-	m_iFirstCommand = iFirstCommand;
-	m_iNextCommand  = iFirstCommand;
-	m_iEndCommand   = iEndCommand;
-	m_iLastFinished = iFirstCommand;
-	m_hCombo        = nullptr;
-	CfgProcessor::Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
-}
+	uint64_t m_iStart;
+	uint64_t m_iEnd;
+	const CfgProcessor::CfgEntryInfo* m_pEntry;
+	bool m_bStatic; // Whole static combos of a static scheduled shader
+};
 
-template <Threading::Mutex TMutexType>
-void CWorkerAccumState<TMutexType>::RangeFinished()
+// Whether the static combos of the shader go to one thread each, always for -schedule static.
+// Otherwise only if the shader lies in the range completely and an average static combo
+// does not have more live combos than a chunk, cutting them up balances better then.
+static bool IsStaticScheduled( const CfgProcessor::CfgEntryInfo* pInfo, uint64_t iFirstCommand, uint64_t iEndCommand, uint64_t nChunkSize )
 {
-	// Finish packaging data
-	TryToPackageData( m_iEndCommand - 1 );
+	if ( g_eSchedule == Schedule::Chunked || pInfo->m_iCommandStart < iFirstCommand || pInfo->m_iCommandEnd > iEndCommand )
+		return false;
+	if ( g_eSchedule == Schedule::Static )
+		return true;
+
+	const uint64_t nLive = pInfo->m_numLiveCombos ? pInfo->m_numLiveCombos : pInfo->m_numCombos;
+	return nLive / pInfo->m_numStaticCombos <= nChunkSize;
 }
 
-template <Threading::Mutex TMutexType>
-void CWorkerAccumState<TMutexType>::ExecuteCompileCommandThreaded( CfgProcessor::ComboHandle hCombo )
+// Splits the command range into chunks of roughly nChunkSize commands. Shaders with a live
+// combo map get nChunkSize live combos per chunk, otherwise the chunk boundaries follow
+// static combos so that a static combo is rarely shared by threads. Static scheduled
+// shaders always get whole static combos.
+static void SplitCommandRange( uint64_t iFirstCommand, uint64_t iEndCommand, uint64_t nChunkSize, std::vector<CommandRange_t>& arrChunks )
 {
-	CmdSink::IResponse* pResponse = nullptr;
+	CfgProcessor::ComboHandle hCombo = nullptr;
+	for ( uint64_t iCommand = iFirstCommand; iCommand < iEndCommand; )
+	{
+		const CfgProcessor::CfgEntryInfo* pInfo = CfgProcessor::Combo_SetCombo( iCommand, hCombo ) ? Combo_GetEntryInfo( hCombo ) : nullptr;
 
-	char chBuffer[4096];
-	Combo_FormatCommand( hCombo, chBuffer );
-	InterceptFxc::ExecuteCommand( chBuffer, &pResponse, gFlags );
+		uint64_t iChunkEnd = iEndCommand;
+		bool bStatic = false;
+		if ( pInfo && pInfo->m_iCommandEnd > iCommand )
+		{
+			const uint64_t nDynamic = pInfo->m_numDynamicCombos;
+			if ( ( bStatic = IsStaticScheduled( pInfo, iFirstCommand, iEndCommand, nChunkSize ) ) )
+			{
+				// Rounded up to the end of a static combo
+				iChunkEnd = pInfo->m_numLiveCombos ? CfgProcessor::Combo_SkipLive( iCommand, nChunkSize, iEndCommand ) : iCommand + std::max( nChunkSize / nDynamic, uint64_t( 1 ) ) * nDynamic;
+				iChunkEnd = pInfo->m_iCommandStart + ( std::max( iChunkEnd, iCommand + 1 ) - pInfo->m_iCommandStart + nDynamic - 1 ) / nDynamic * nDynamic;
+			}
+			else if ( pInfo->m_numLiveCombos )
+				iChunkEnd = CfgProcessor::Combo_SkipLive( iCommand, nChunkSize, iEndCommand );
+			else if ( nDynamic >= nChunkSize )
+			{
+				// Big static combo, cut it into equal pieces
+				const uint64_t iStaticStart = iCommand - ( iCommand - pInfo->m_iCommandStart ) % nDynamic;
+				const uint64_t nPieces      = ( nDynamic + nChunkSize - 1 ) / nChunkSize;
+				const uint64_t nPieceSize   = ( nDynamic + nPieces - 1 ) / nPieces;
+				iChunkEnd = std::min( iStaticStart + nDynamic, iStaticStart + ( ( iCommand - iStaticStart ) / nPieceSize + 1 ) * nPieceSize );
+			}
+			else
+			{
+				// Several whole static combos
+				const uint64_t nStep = nChunkSize / nDynamic * nDynamic;
+				iChunkEnd = pInfo->m_iCommandStart + ( ( iCommand - pInfo->m_iCommandStart ) / nStep + 1 ) * nStep;
+			}
+			iChunkEnd = std::min( { iChunkEnd, pInfo->m_iCommandEnd, iEndCommand } );
+		}
 
-	HandleCommandResponse( hCombo, pResponse );
+		arrChunks.emplace_back( CommandRange_t { iCommand, iChunkEnd, pInfo && pInfo->m_iCommandEnd > iCommand ? pInfo : nullptr, bStatic } );
+		iCommand = iChunkEnd;
+	}
+	Combo_Free( hCombo );
 }
 
 template <Threading::Mutex TMutexType>
-void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo )
+void CWorkerAccumState<TMutexType>::RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand )
 {
-	CmdSink::IResponse* pResponse = nullptr;
+	m_iFirstCommand = iFirstCommand;
+	m_iEndCommand   = iEndCommand;
 
-	if ( g_bVerbose2 )
+	const uint32_t nQueues = NumQueues();
+	if ( !m_arrQueues )
+		m_arrQueues = std::make_unique<ChunkQueue_t[]>( nQueues );
+
+	// Several chunks per thread leave room for stealing when the compile times differ
+	constexpr uint64_t nChunksPerThread = 16;
+	std::vector<CommandRange_t> arrChunks;
+	SplitCommandRange( iFirstCommand, iEndCommand, std::max<uint64_t>( 1, CfgProcessor::Combo_CountLive( iFirstCommand, iEndCommand ) / ( nQueues * nChunksPerThread ) ), arrChunks );
+
+	m_nChunks   = gsl::narrow<uint32_t>( arrChunks.size() );
+	m_arrChunks = std::make_unique<CommandChunk_t[]>( m_nChunks );
+
+	// The chunks of a shader follow each other, the chunked ones get a slot per static combo
+	uint64_t nSlots = 0;
+	for ( uint32_t i = 0; i < m_nChunks; ++i )
 	{
-		char chReadBuf[4096];
-		Combo_FormatCommandHumanReadable( hCombo, chReadBuf );
-		std::cout << "running: \"" << clr::green << chReadBuf << clr::reset << "\"" << std::endl;
+		const CfgProcessor::CfgEntryInfo* pEntry = arrChunks[i].m_pEntry;
+		if ( pEntry && !arrChunks[i].m_bStatic && ( !i || arrChunks[i - 1].m_pEntry != pEntry ) )
+			nSlots += pEntry->m_numStaticCombos;
 	}
+	m_arrStatics = std::make_unique<StaticSlot_t[]>( nSlots );
+	m_pDoneStatics = nullptr;
 
-	char chBuffer[4096];
-	Combo_FormatCommand( hCombo, chBuffer );
-	InterceptFxc::ExecuteCommand( chBuffer, &pResponse, gFlags );
+	StaticSlot_t* pSlots = m_arrStatics.get();
+	for ( uint32_t i = 0; i < m_nChunks; ++i )
+	{
+		const CfgProcessor::CfgEntryInfo* pEntry = arrChunks[i].m_pEntry;
+		CommandChunk_t& chunk = m_arrChunks[i];
+		chunk.m_iStart       = arrChunks[i].m_iStart;
+		chunk.m_iEnd         = arrChunks[i].m_iEnd;
+		chunk.m_iProgress    = arrChunks[i].m_iStart;
+		chunk.m_pStaticEntry = arrChunks[i].m_bStatic ? pEntry : nullptr;
+		chunk.m_pSlots       = nullptr;
+		if ( !pEntry || arrChunks[i].m_bStatic )
+			continue;
 
-	HandleCommandResponse( hCombo, pResponse );
-}
+		if ( i && arrChunks[i - 1].m_pEntry == pEntry )
+			chunk.m_pSlots = m_arrChunks[i - 1].m_pSlots;
+		else
+		{
+			chunk.m_pSlots = pSlots;
+			InitStaticSlots( pEntry, pSlots );
+			pSlots += pEntry->m_numStaticCombos;
+		}
+	}
 
-static void StopCommandRange();
+	// Deal the chunks round-robin, so all threads start at the beginning of the range
+	for ( uint32_t i = 0; i < nQueues; ++i )
+		m_arrQueues[i].chunks.clear();
+	for ( uint32_t i = 0; i < m_nChunks; ++i )
+		m_arrQueues[i % nQueues].chunks.emplace_back( i );
+}
 
-template <Threading::Mutex TMutexType>
+//
+// Many defines only matter inside #if blocks a given static combo never reaches, so plenty of
+// combos hand the very same text to the compiler. With -preprocess-dedup every combo gets
+// preprocessed first, the first combo to produce a text compiles it, and all the others
+// with the same text wait for that result instead of compiling it again.
+//
+namespace PreprocessDedup
+{
+using Result_t = std::shared_ptr<CmdSink::IResponse>;
+
+// Every combo needs a response of its own, they all share the one compile result
+class CSharedResponse final : public CmdSink::IResponse
+{
+public:
+	explicit CSharedResponse( Result_t pResult ) noexcept : m_pResult( std::move( pResult ) ) {}
+
+	bool Succeeded() noexcept override { return m_pResult->Succeeded(); }
+	size_t GetResultBufferLen() override { return m_pResult->GetResultBufferLen(); }
+	const void* GetResultBuffer() override { return m_pResult->GetResultBuffer(); }
+	const char* GetListing() override { return m_pResult->GetListing(); }
+
+private:
+	Result_t m_pResult;
+};
+
+struct DigestHash_t
+{
+	size_t operator()( const ShaderCache::Digest& digest ) const noexcept
+	{
+		size_t h;
+		memcpy( &h, digest.data(), sizeof( h ) );
+		return h;
+	}
+};
+
+struct ShaderState_t
+{
+	std::mutex m_mtx;
+	robin_hood::unordered_node_map<ShaderCache::Digest, std::shared_future<Result_t>, DigestHash_t> m_mapTexts;
+	std::atomic<uint64_t> m_nCompiled { 0 };
+	std::atomic<uint64_t> m_nShared { 0 };
+};
+
+static bool s_bEnabled = false;
+// Filled in before compiling starts, only looked up afterwards
+static robin_hood::unordered_node_map<std::string_view, ShaderState_t> s_mapShaders;
+
+static void Begin()
+{
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = g_arrCompileEntries.get(); pEntry && pEntry->m_szName; ++pEntry )
+		s_mapShaders[pEntry->m_szName];
+}
+
+static void Compile( const CfgProcessor::CfgEntryInfo* pInfo, const CmdSink::CompileCommand& command, CmdSink::IResponse** ppResponse )
+{
+	InterceptFxc::ICompilerBackend* pBackend = InterceptFxc::GetActiveBackend();
+	ShaderState_t& state                     = s_mapShaders.find( pInfo->m_szName )->second;
+
+	thread_local std::string s_text;
+	if ( !pBackend->Preprocess( command, s_text ) )
+	{
+		// Let the compiler report whatever the preprocessor choked on
+		++state.m_nCompiled;
+		InterceptFxc::ExecuteCommand( command, ppResponse, gFlags );
+		return;
+	}
+
+	ShaderCache::CHasher hasher;
+	hasher.Update( command.m_szShaderModel );
+	hasher.Update( s_text.data(), s_text.size() );
+	const ShaderCache::Digest key = hasher.Final();
+
+	std::promise<Result_t> promise;
+	{
+		std::unique_lock lock( state.m_mtx );
+		const auto it = state.m_mapTexts.find( key );
+		if ( it != state.m_mapTexts.end() )
+		{
+			const std::shared_future<Result_t> result = it->second;
+			lock.unlock();
+
+			const Result_t& pResult = result.get();
+			if ( pResult && ( *ppResponse = new( std::nothrow ) CSharedResponse( pResult ) ) )
+			{
+				++state.m_nShared;
+				return;
+			}
+
+			// No result to share, the combo gets compiled on its own
+			++state.m_nCompiled;
+			InterceptFxc::ExecuteCommand( command, ppResponse, gFlags );
+			return;
+		}
+		state.m_mapTexts.emplace( key, promise.get_future().share() );
+	}
+
+	++state.m_nCompiled;
+	CmdSink::IResponse* pResponse = nullptr;
+	pBackend->CompilePreprocessed( command, s_text, gFlags, &pResponse );
+
+	Result_t pResult;
+	if ( pResponse )
+		pResult.reset( pResponse, []( CmdSink::IResponse* p ) { p->Release(); } );
+	promise.set_value( pResult );
+
+	*ppResponse = pResult ? new( std::nothrow ) CSharedResponse( std::move( pResult ) ) : nullptr;
+	if ( !*ppResponse )
+		InterceptFxc::ExecuteCommand( command, ppResponse, gFlags );
+}
+
+// No more combos of the shader are coming, drop the results
+static void ShaderDone( const char* szShaderName )
+{
+	if ( !s_bEnabled )
+		return;
+
+	ShaderState_t& state = s_mapShaders.find( szShaderName )->second;
+	std::lock_guard lock( state.m_mtx );
+	decltype( state.m_mapTexts )().swap( state.m_mapTexts );
+}
+
+static void Report()
+{
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = g_arrCompileEntries.get(); pEntry && pEntry->m_szName; ++pEntry )
+	{
+		const ShaderState_t& state = s_mapShaders.find( pEntry->m_szName )->second;
+		const uint64_t nCombos     = state.m_nCompiled + state.m_nShared;
+		if ( !nCombos )
+			continue;
+
+		std::cout << "Preprocess dedup: " << clr::green << pEntry->m_szName << clr::reset << " compiled " << clr::green << PrettyPrint( state.m_nCompiled ) << clr::reset << " of " << clr::green << PrettyPrint( nCombos ) << clr::reset
+				  << " combos (" << clr::green << std::fixed << std::setprecision( 1 ) << 100.0 * state.m_nShared / nCombos << "%" << clr::reset << " deduplicated)" << std::defaultfloat << std::endl;
+	}
+}
+}; // namespace PreprocessDedup
+
+// The shader can be written as soon as its last static combo got packaged
+static void StaticCombosPackaged( const CfgProcessor::CfgEntryInfo* pInfo, uint64_t nStaticCombos )
+{
+	GLOBAL_DATA_MTX_LOCK();
+	const bool bShaderDone = ( g_ShaderStaticCombosPackaged[pInfo->m_szName] += nStaticCombos ) == pInfo->m_numStaticCombos;
+	GLOBAL_DATA_MTX_UNLOCK();
+
+	if ( bShaderDone )
+	{
+		PreprocessDedup::ShaderDone( pInfo->m_szName );
+		g_ShaderWriter.Push( pInfo->m_szName );
+	}
+}
+
+//
+// -lzma-tune: shader bytecode is a stream of 4-byte tokens, which the default literal and
+// position bits of LZMA don't know about. Once all static combos of a shader compiled, a
+// block out of each of a few static combos spread over the shader gets trial compressed
+// with several lc/lp/pb settings, then with smaller dictionaries, and the whole shader
+// gets packed with what came out smallest. The samples only depend on the static combo
+// indices, so the settings come out the same on every run. The settings go into the
+// header of every block, so the vcs reader needs nothing new.
+//
+namespace LzmaTune
+{
+struct Candidate_t
+{
+	int m_lc;
+	int m_lp;
+	int m_pb;
+};
+
+// The LzmaEncProps_Init default comes first, it is what the others have to beat. The game's
+// decoder allocates 0x300 << ( lc + lp ) probabilities per block, so lc + lp stays at most 4
+// like in LZMA2, which keeps that table far below the dictionary.
+static constexpr Candidate_t s_candidates[] = {
+	{ 3, 0, 2 },
+	{ 0, 2, 2 },
+	{ 1, 2, 2 },
+	{ 2, 2, 2 },
+	{ 4, 0, 2 },
+	{ 0, 0, 0 },
+};
+static_assert( std::all_of( std::begin( s_candidates ), std::end( s_candidates ), []( const Candidate_t& c ) { return c.m_lc + c.m_lp <= 4; } ) );
+static constexpr uint32_t numSampleBlocks = 4; // One block out of each sample static combo
+static constexpr uint32_t numDictHalvings = 2;
+
+struct ShaderState_t
+{
+	CLzmaEncProps m_props;
+	size_t m_nSampleSize;     // Uncompressed size of the trial blocks
+	size_t m_nSampleDefault;  // What the trial blocks packed to with the default settings
+	size_t m_nSampleTuned;    // and with the chosen ones
+	std::atomic<uint64_t> m_nUnpacked { 0 };
+	std::atomic<uint64_t> m_nPacked { 0 };
+};
+
+static bool s_bEnabled = false;
+// Filled in before compiling starts, only looked up afterwards
+static robin_hood::unordered_node_map<std::string_view, ShaderState_t> s_mapShaders;
+
+static void Begin()
+{
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = g_arrCompileEntries.get(); pEntry && pEntry->m_szName; ++pEntry )
+		s_mapShaders[pEntry->m_szName];
+}
+
+// Packed size of the sample blocks, uncompressible ones count with their own size like in the vcs
+static size_t TrialPack( std::span<const CUtlBuffer> samples, const CLzmaEncProps& props )
+{
+	LZMA::CEncoder& encoder = ThreadEncoder();
+	if ( !encoder.SetProps( props ) )
+		return SIZE_MAX;
+
+	size_t nPacked = 0;
+	for ( const CUtlBuffer& sample : samples )
+	{
+		const std::span<const uint8_t> compressed = encoder.OpportunisticCompress( reinterpret_cast<const uint8_t*>( sample.Base() ), sample.TellPut() );
+		nPacked += compressed.empty() ? static_cast<size_t>( sample.TellPut() ) : compressed.size();
+	}
+	return nPacked;
+}
+
+// Picks the settings to pack the shader with out of at most numSampleBlocks blocks, returns them
+static const CLzmaEncProps& Tune( const CfgProcessor::CfgEntryInfo* pInfo, std::span<const std::span<CByteCodeBlock* const>> sampleBlocks )
+{
+	ShaderState_t& state = s_mapShaders.find( pInfo->m_szName )->second;
+
+	const std::unique_ptr<CUtlBuffer[]> pSamples = std::make_unique<CUtlBuffer[]>( sampleBlocks.size() );
+	const std::span<const CUtlBuffer> samples( pSamples.get(), sampleBlocks.size() );
+	state.m_nSampleSize = 0;
+	for ( uint32_t i = 0; i < sampleBlocks.size(); ++i )
+	{
+		PutComboBlock( sampleBlocks[i], pSamples[i] );
+		state.m_nSampleSize += pSamples[i].TellPut();
+	}
+
+	CLzmaEncProps best = g_LzmaProps;
+	size_t nBest       = SIZE_MAX;
+	for ( const Candidate_t& candidate : s_candidates )
+	{
+		CLzmaEncProps props = g_LzmaProps;
+		props.lc            = candidate.m_lc;
+		props.lp            = candidate.m_lp;
+		props.pb            = candidate.m_pb;
+
+		const size_t nPacked = TrialPack( samples, props );
+		if ( &candidate == s_candidates )
+			state.m_nSampleDefault = nPacked;
+		if ( nPacked < nBest )
+		{
+			best  = props;
+			nBest = nPacked;
+		}
+	}
+
+	// A smaller dictionary is less for the game to allocate, keep it unless the blocks grow
+	LzmaEncProps_Normalize( &best );
+	for ( uint32_t i = 0; i < numDictHalvings && best.dictSize >= ( 1 << 13 ); ++i )
+	{
+		CLzmaEncProps props = best;
+		props.dictSize /= 2;
+
+		const size_t nPacked = TrialPack( samples, props );
+		if ( nPacked > nBest )
+			break;
+		best  = props;
+		nBest = nPacked;
+	}
+
+	state.m_props        = best;
+	state.m_nSampleTuned = nBest;
+	return state.m_props;
+}
+
+static void BlockPacked( const CfgProcessor::CfgEntryInfo* pInfo, std::span<CByteCodeBlock* const> combos, size_t nPacked )
+{
+	size_t nUnpacked = 0;
+	for ( const CByteCodeBlock* pCode : combos )
+		nUnpacked += 2 * sizeof( uint32_t ) + pCode->m_nCodeSize;
+
+	ShaderState_t& state = s_mapShaders.find( pInfo->m_szName )->second;
+	state.m_nUnpacked.fetch_add( nUnpacked, std::memory_order_relaxed );
+	state.m_nPacked.fetch_add( nPacked, std::memory_order_relaxed );
+}
+
+static void Report()
+{
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = g_arrCompileEntries.get(); pEntry && pEntry->m_szName; ++pEntry )
+	{
+		const ShaderState_t& state = s_mapShaders.find( pEntry->m_szName )->second;
+		if ( !state.m_nUnpacked )
+			continue;
+
+		const CLzmaEncProps& props = state.m_props;
+		std::cout << "LZMA tune: " << clr::green << pEntry->m_szName << clr::reset << " lc=" << props.lc << " lp=" << props.lp << " pb=" << props.pb << " dict=" << ( props.dictSize >> 10 ) << " KiB, packed to "
+				  << clr::green << std::fixed << std::setprecision( 1 ) << 100.0 * state.m_nPacked / state.m_nUnpacked << "%" << clr::reset << " (trial blocks " << 100.0 * state.m_nSampleTuned / state.m_nSampleSize
+				  << "%, " << 100.0 * state.m_nSampleDefault / state.m_nSampleSize << "% with the defaults)" << std::defaultfloat << std::endl;
+	}
+}
+}; // namespace LzmaTune
+
+//
+// Compression stage: the workers hand over every static combo whose combos all compiled,
+// cut into the blocks it gets packed in. A pool of its own compresses the blocks, so LZMA
+// stays off the compile threads and the blocks of a big static combo compress in parallel.
+// The queue is bounded, a worker that finds it full compresses the block itself, which
+// keeps the memory of the compiled combos in check without ever leaving a worker idle.
+// Without any compression threads the workers compress everything themselves.
+// With -lzma-tune the static combos of a shader are held back until all of them compiled,
+// see LzmaTune.
+//
+class CComboPacker
+{
+public:
+	CComboPacker() : m_nPending( 0 ), m_bDraining( false ), m_bBreak( false ) {}
+
+	void Start( uint32_t nThreads )
+	{
+		if ( LzmaTune::s_bEnabled )
+			m_arrHeld = std::make_unique<Held_t[]>( g_numShaders );
+
+		if ( !nThreads )
+			return;
+
+		// The compression threads report progress and finish shaders, whatever the number of compile threads
+		Threading::g_mtxGlobal.SetThreadedMode( Threading::eMultiThreaded );
+		Threading::g_mtxMsgReport.SetThreadedMode( Threading::eMultiThreaded );
+
+		// Every multithreaded match finder adds two threads, auto only runs as many as the idle compile threads make up for
+		const uint32_t nCompileThreads = ThreadBudget() > nThreads ? ThreadBudget() - nThreads : 1;
+		const uint32_t nMtEncoders     = g_eLzmaMt == LzmaMt::On ? nThreads : g_eLzmaMt == LzmaMt::Auto ? std::min( nThreads, nCompileThreads / 2 ) : 0;
+
+		m_pQueue = std::make_unique<CBoundedQueue<Task_t>>( 16 * nThreads );
+		for ( uint32_t i = 0; i < nThreads; ++i )
+			m_arrThreads.emplace_back( &CComboPacker::Execute, this, i < nMtEncoders );
+	}
+
+	// Packs everything still queued and stops the threads
+	void Finish()
+	{
+		ReleaseHeld();
+		m_arrHeld.reset();
+		if ( !m_pQueue )
+			return;
+
+		m_pQueue->Close();
+		std::for_each( m_arrThreads.begin(), m_arrThreads.end(), []( std::thread& t ) { t.join(); } );
+		m_arrThreads.clear();
+		m_pQueue.reset();
+	}
+
+	// Takes the static combo over, pStatic may be null if none of its combos compiled
+	void Push( const CfgProcessor::CfgEntryInfo* pInfo, uint64_t nStaticCombo, CStaticCombo* pStatic )
+	{
+		Job_t* pJob          = new Job_t;
+		pJob->m_pInfo        = pInfo;
+		pJob->m_nStaticCombo = nStaticCombo;
+		pJob->m_pStatic      = pStatic;
+		pJob->m_pProps       = &g_LzmaProps;
+		if ( pStatic )
+		{
+			pStatic->SortDynamicCombos();
+			SplitComboBlocks( pStatic->DynamicCombos(), pJob->m_arrBlockStarts );
+		}
+
+		if ( !m_arrHeld )
+			Schedule( pJob );
+		else if ( pJob->m_arrBlockStarts.empty() )
+		{
+			Schedule( pJob );
+			Arrived( pInfo, 1, nullptr );
+		}
+		else
+			Arrived( pInfo, 1, pJob );
+	}
+
+	// Static combos without any live combo, they never get pushed
+	void Skip( const CfgProcessor::CfgEntryInfo* pInfo, uint64_t nStaticCombos )
+	{
+		StaticCombosPackaged( pInfo, nStaticCombos );
+		if ( m_arrHeld && nStaticCombos )
+			Arrived( pInfo, nStaticCombos, nullptr );
+	}
+
+	// Blocks until everything pushed so far is packed
+	void Drain()
+	{
+		// Shaders the command range only covered part of don't get any further
+		ReleaseHeld();
+
+		m_bDraining = true;
+		std::unique_lock lock( m_mtxPending );
+		m_cvPending.wait( lock, [this] { return !m_nPending.load( std::memory_order_acquire ); } );
+		m_bDraining = false;
+	}
+
+	// Whatever is still queued gets dropped instead of packed
+	void Stop() noexcept
+	{
+		m_bBreak = true;
+	}
+
+private:
+	struct Job_t
+	{
+		const CfgProcessor::CfgEntryInfo* m_pInfo;
+		uint64_t m_nStaticCombo;
+		CStaticCombo* m_pStatic;
+		const CLzmaEncProps* m_pProps;          // LZMA settings of the shader
+		std::vector<uint32_t> m_arrBlockStarts; // First dynamic combo of every block
+		std::unique_ptr<CUtlBuffer[]> m_arrPacked;
+		std::atomic<uint32_t> m_nBlocksLeft;
+	};
+
+	struct Task_t
+	{
+		Job_t* m_pJob;
+		uint32_t m_iBlock;
+	};
+
+	// The static combos of a shader that wait for the rest of it, with -lzma-tune
+	struct Held_t
+	{
+		std::mutex m_mtx;
+		std::vector<Job_t*> m_arrJobs;
+		uint64_t m_nArrived = 0; // Static combos pushed or skipped
+	};
+
+	// Queues the blocks of the static combo, or completes it if there is nothing to pack
+	void Schedule( Job_t* pJob )
+	{
+		const uint32_t nBlocks = gsl::narrow<uint32_t>( pJob->m_arrBlockStarts.size() );
+		if ( !nBlocks )
+		{
+			Complete( pJob );
+			return;
+		}
+
+		pJob->m_arrPacked = std::make_unique<CUtlBuffer[]>( nBlocks );
+		pJob->m_nBlocksLeft.store( nBlocks, std::memory_order_relaxed );
+		m_nPending.fetch_add( 1, std::memory_order_relaxed );
+
+		for ( uint32_t i = 0; i < nBlocks; ++i )
+		{
+			Task_t task { pJob, i };
+			if ( !m_pQueue || !m_pQueue->TryPush( task ) )
+				Run( task, ThreadEncoder() );
+		}
+	}
+
+	// Counts static combos of the shader in, pJob is held back if not null. The last one in
+	// tunes and schedules the whole shader.
+	void Arrived( const CfgProcessor::CfgEntryInfo* pInfo, uint64_t nStaticCombos, Job_t* pJob )
+	{
+		Held_t& held = m_arrHeld[ShaderIndex( pInfo )];
+		std::vector<Job_t*> arrJobs;
+		{
+			std::lock_guard lock( held.m_mtx );
+			if ( pJob )
+				held.m_arrJobs.emplace_back( pJob );
+			held.m_nArrived += nStaticCombos;
+			if ( held.m_nArrived < pInfo->m_numStaticCombos )
+				return;
+			arrJobs.swap( held.m_arrJobs );
+		}
+		Release( arrJobs );
+	}
+
+	// Tunes on a block out of each of up to LzmaTune::numSampleBlocks static combos spread
+	// evenly over the shader, then schedules all of them with the settings
+	void Release( std::vector<Job_t*>& arrJobs )
+	{
+		if ( arrJobs.empty() )
+			return;
+
+		if ( !m_bBreak )
+		{
+			std::sort( arrJobs.begin(), arrJobs.end(), []( const Job_t* pA, const Job_t* pB ) { return pA->m_nStaticCombo < pB->m_nStaticCombo; } );
+
+			const size_t nSamples = std::min<size_t>( arrJobs.size(), LzmaTune::numSampleBlocks );
+			std::vector<std::span<CByteCodeBlock* const>> sampleBlocks;
+			for ( size_t i = 0; i < nSamples; ++i )
+			{
+				const Job_t* pSample = arrJobs[i * arrJobs.size() / nSamples];
+				const uint32_t nBlocks = gsl::narrow<uint32_t>( pSample->m_arrBlockStarts.size() );
+				sampleBlocks.emplace_back( ComboBlock( pSample->m_pStatic->DynamicCombos(), pSample->m_arrBlockStarts, nBlocks / 2 ) );
+			}
+
+			const CLzmaEncProps& props = LzmaTune::Tune( arrJobs.front()->m_pInfo, sampleBlocks );
+			for ( Job_t* pJob : arrJobs )
+				pJob->m_pProps = &props;
+		}
+
+		for ( Job_t* pJob : arrJobs )
+			Schedule( pJob );
+	}
+
+	// Whatever is still held back, the rest of its shader is never going to arrive
+	void ReleaseHeld()
+	{
+		if ( !m_arrHeld )
+			return;
+
+		for ( uint64_t i = 0; i < g_numShaders; ++i )
+		{
+			std::vector<Job_t*> arrJobs;
+			{
+				std::lock_guard lock( m_arrHeld[i].m_mtx );
+				arrJobs.swap( m_arrHeld[i].m_arrJobs );
+			}
+			Release( arrJobs );
+		}
+	}
+
+	// bMtMatchFinder: the thread may use an encoder with the multithreaded match finder.
+	// The thread owns it and destroys it before returning, which joins its match finder threads.
+	void Execute( bool bMtMatchFinder )
+	{
+		std::unique_ptr<LZMA::CEncoder> pMtEncoder;
+		for ( Task_t task; m_pQueue->Pop( task ); )
+		{
+			// Auto only turns it on once there is nothing left to compile
+			if ( bMtMatchFinder && ( g_eLzmaMt == LzmaMt::On || m_bDraining ) )
+			{
+				if ( !pMtEncoder )
+					pMtEncoder = std::make_unique<LZMA::CEncoder>( MtEncoderProps() );
+				Run( task, *pMtEncoder );
+			}
+			else
+				Run( task, ThreadEncoder() );
+		}
+		pMtEncoder.reset();
+	}
+
+	void Run( const Task_t& task, LZMA::CEncoder& encoder )
+	{
+		Job_t* pJob = task.m_pJob;
+		if ( !m_bBreak )
+		{
+			const std::span<CByteCodeBlock* const> combos = ComboBlock( pJob->m_pStatic->DynamicCombos(), pJob->m_arrBlockStarts, task.m_iBlock );
+			const size_t nPacked = PackComboBlock( combos, pJob->m_arrPacked[task.m_iBlock], *pJob->m_pProps, encoder );
+			if ( LzmaTune::s_bEnabled )
+				LzmaTune::BlockPacked( pJob->m_pInfo, combos, nPacked );
+		}
+
+		// The thread packing the last block puts the static combo together
+		if ( pJob->m_nBlocksLeft.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
+
+		Complete( pJob );
+		if ( m_nPending.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+		{
+			std::lock_guard lock( m_mtxPending );
+			m_cvPending.notify_all();
+		}
+	}
+
+	void Complete( Job_t* pJob )
+	{
+		const CfgProcessor::CfgEntryInfo* pInfo = pJob->m_pInfo;
+		CStaticCombo* pStatic                   = pJob->m_pStatic;
+		if ( pStatic )
+			pStatic->FreeDynamicCombos();
+
+		if ( !m_bBreak )
+		{
+			GLOBAL_DATA_MTX_LOCK();
+			const bool bShaderFailed = ReportPackageProgress( pInfo, pJob->m_nStaticCombo );
+			GLOBAL_DATA_MTX_UNLOCK();
+
+			size_t nPackedLength = 0;
+			for ( uint32_t i = 0; i < pJob->m_arrBlockStarts.size(); ++i )
+				nPackedLength += pJob->m_arrPacked[i].TellPut();
+
+			// The record stays around for the packed code, unless there is nothing to keep
+			if ( nPackedLength && !bShaderFailed )
+			{
+				uint8_t* pCodeBuffer = pStatic->AllocPackedCodeBlock( nPackedLength );
+				for ( uint32_t i = 0; i < pJob->m_arrBlockStarts.size(); ++i )
+				{
+					const CUtlBuffer& packed = pJob->m_arrPacked[i];
+					memcpy( pCodeBuffer, packed.Base(), packed.TellPut() );
+					pCodeBuffer += packed.TellPut();
+				}
+			}
+			else if ( pStatic )
+				ShaderByteCode( pInfo ).Remove( pJob->m_nStaticCombo );
+
+			StaticCombosPackaged( pInfo, 1 );
+		}
+
+		delete pJob;
+	}
+
+	std::unique_ptr<CBoundedQueue<Task_t>> m_pQueue;
+	std::vector<std::thread> m_arrThreads;
+	std::atomic<uint64_t> m_nPending; // Static combos with blocks left to pack
+	std::mutex m_mtxPending;
+	std::condition_variable m_cvPending;
+	std::atomic<bool> m_bDraining; // Compiling is done, only packing is left
+	std::atomic<bool> m_bBreak;
+	std::unique_ptr<Held_t[]> m_arrHeld; // One per entry of g_arrCompileEntries, with -lzma-tune
+};
+static CComboPacker g_ComboPacker;
+
+// Serves the combo from the bytecode cache if possible, otherwise compiles it and stores the result
+static void CompileCombo( CfgProcessor::ComboHandle hCombo, CfgProcessor::ComboCommand& command, CmdSink::IResponse** ppResponse )
+{
+	const CmdSink::CompileCommand& cmd = Combo_BuildCommand( hCombo, command );
+	const CfgProcessor::CfgEntryInfo* pInfo = Combo_GetEntryInfo( hCombo );
+
+	const auto& Execute = [&]
+	{
+		if ( PreprocessDedup::s_bEnabled )
+			PreprocessDedup::Compile( pInfo, cmd, ppResponse );
+		else
+			InterceptFxc::ExecuteCommand( cmd, ppResponse, gFlags );
+	};
+
+	if ( !ShaderCache::IsEnabled() )
+	{
+		Execute();
+		return;
+	}
+
+	const ShaderCache::Digest key = ShaderCache::MakeKey( pInfo->m_sourceHash, cmd, gFlags, InterceptFxc::GetActiveBackend()->Name() );
+	if ( ( *ppResponse = ShaderCache::Lookup( key ) ) != nullptr )
+		return;
+
+	Execute();
+	if ( *ppResponse && ( *ppResponse )->Succeeded() )
+		ShaderCache::Store( key, *ppResponse );
+}
+
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::ExecuteCompileCommandThreaded( CfgProcessor::ComboHandle hCombo, CfgProcessor::ComboCommand& command )
+{
+	CmdSink::IResponse* pResponse = nullptr;
+
+	CompileCombo( hCombo, command, &pResponse );
+
+	HandleCommandResponse( hCombo, pResponse );
+}
+
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo, CfgProcessor::ComboCommand& command )
+{
+	CmdSink::IResponse* pResponse = nullptr;
+
+	if ( g_bVerbose2 )
+		std::cout << "running: \"" << clr::green << Combo_FormatCommandHumanReadable( hCombo ) << clr::reset << "\"" << std::endl;
+
+	CompileCombo( hCombo, command, &pResponse );
+
+	HandleCommandResponse( hCombo, pResponse );
+}
+
+static void StopCommandRange();
+
+template <Threading::Mutex TMutexType>
 void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse )
 {
 	Assert( pResponse );
@@ -1001,11 +2090,15 @@ void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHa
 
 	if ( pResponse->Succeeded() )
 	{
-		GLOBAL_DATA_MTX_LOCK();
 		const uint64_t nStComboIdx = iComboIndex / pEntryInfo->m_numDynamicCombos;
 		const uint64_t nDyComboIdx = iComboIndex - ( nStComboIdx * pEntryInfo->m_numDynamicCombos );
-		StaticComboFromDictAdd( pEntryInfo->m_szName, nStComboIdx )->AddDynamicCombo( nDyComboIdx, pResponse->GetResultBuffer(), pResponse->GetResultBufferLen() );
-		GLOBAL_DATA_MTX_UNLOCK();
+		if ( CStaticCombo* pStCombo = m_pCurrentStatic )
+		{
+			Assert( pStCombo->ComboId() == nStComboIdx );
+			pStCombo->AddDynamicCombo( nDyComboIdx, pResponse->GetResultBuffer(), pResponse->GetResultBufferLen() );
+		}
+		else
+			ShaderByteCode( pEntryInfo ).FindOrAdd( nStComboIdx )->AddDynamicCombo( nDyComboIdx, pResponse->GetResultBuffer(), pResponse->GetResultBufferLen() );
 	}
 	else // Tell the master that this shader failed
 	{
@@ -1025,145 +2118,241 @@ void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHa
 			szListing = chUnreportedListing;
 		}
 
-		char chBuffer[4096];
-		Combo_FormatCommandHumanReadable( hCombo, chBuffer );
-
-		ErrMsgDispatchMsgLine( chBuffer, szListing, pEntryInfo->m_szName );
+		ErrMsgDispatchMsgLine( Combo_FormatCommandHumanReadable( hCombo ).c_str(), szListing, pEntryInfo->m_szName );
 		if ( !pResponse->Succeeded() && g_bFastFail )
 			StopCommandRange();
 	}
 
 	pResponse->Release();
 
-	// Maybe zip things up
-	TryToPackageData( iCommandNumber );
+	// Everything in the chunk up to this command is done now
+	AdvanceChunk( *m_pCurrentChunk, iCommandNumber + 1, true );
+
+	// Maybe zip things up, static scheduled chunks do it themselves
+	if ( !m_pCurrentStatic )
+		TryToPackageData();
 }
 
 template <Threading::Mutex TMutexType>
-void CWorkerAccumState<TMutexType>::TryToPackageData( uint64_t iCommandNumber )
+void CWorkerAccumState<TMutexType>::InitStaticSlots( const CfgProcessor::CfgEntryInfo* pInfo, StaticSlot_t* pSlots )
 {
-	if ( m_bBreak )
+	const uint64_t nDynamic = pInfo->m_numDynamicCombos;
+	uint64_t nEmpty = 0;
+	for ( uint64_t i = 0; i < pInfo->m_numStaticCombos; ++i )
+	{
+		const uint64_t iStart = std::max( pInfo->m_iCommandStart + i * nDynamic, m_iFirstCommand );
+		const uint64_t iEnd   = std::min( pInfo->m_iCommandStart + ( i + 1 ) * nDynamic, m_iEndCommand );
+
+		StaticSlot_t& slot  = pSlots[i];
+		slot.m_pInfo        = pInfo;
+		slot.m_nStaticCombo = pInfo->m_numStaticCombos - 1 - i;
+		slot.m_pNextDone    = nullptr;
+		slot.m_nOutstanding = iStart >= iEnd ? 0 : pInfo->m_numLiveCombos ? CfgProcessor::Combo_CountLive( iStart, iEnd ) : iEnd - iStart;
+		if ( iStart < iEnd && !slot.m_nOutstanding )
+			++nEmpty;
+	}
+
+	// Nothing to wait for or to pack in these
+	if ( nEmpty )
+		g_ComboPacker.Skip( pInfo, nEmpty );
+}
+
+// Everything in the chunk before iProgress is done now. Shaders with a live combo map count
+// down the compiled combos, the others every command, skipped or not.
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::AdvanceChunk( CommandChunk_t& chunk, uint64_t iProgress, bool bCompiled )
+{
+	const uint64_t iFrom = chunk.m_iProgress;
+	chunk.m_iProgress    = iProgress;
+	if ( !chunk.m_pSlots || iFrom >= iProgress )
 		return;
-	m_pMutex->lock();
 
-	uint64_t iFinishedByNow = iCommandNumber + 1;
+	const CfgProcessor::CfgEntryInfo* pInfo = chunk.m_pSlots->m_pInfo;
+	const uint64_t nDynamic                 = pInfo->m_numDynamicCombos;
+	const auto& Complete = [this]( StaticSlot_t& slot, uint64_t nDone )
+	{
+		if ( slot.m_nOutstanding.fetch_sub( nDone, std::memory_order_acq_rel ) != nDone )
+			return;
 
-	// Check if somebody is running an earlier command
-	for ( const auto& iRunningCommand : m_arrSubProcessInfos )
+		StaticSlot_t* pHead = m_pDoneStatics.load( std::memory_order_relaxed );
+		do
+			slot.m_pNextDone = pHead;
+		while ( !m_pDoneStatics.compare_exchange_weak( pHead, &slot, std::memory_order_release, std::memory_order_relaxed ) );
+	};
+
+	if ( pInfo->m_numLiveCombos )
+	{
+		if ( bCompiled )
+			Complete( chunk.m_pSlots[( iProgress - 1 - pInfo->m_iCommandStart ) / nDynamic], 1 );
+		return;
+	}
+
+	for ( uint64_t iCommand = iFrom; iCommand < iProgress; )
+	{
+		const uint64_t iSlot     = ( iCommand - pInfo->m_iCommandStart ) / nDynamic;
+		const uint64_t iSlotEnd  = std::min( pInfo->m_iCommandStart + ( iSlot + 1 ) * nDynamic, iProgress );
+		Complete( chunk.m_pSlots[iSlot], iSlotEnd - iCommand );
+		iCommand = iSlotEnd;
+	}
+}
+
+// Packs the static combos whose last combo got compiled since the last call
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::TryToPackageData()
+{
+	if ( m_bBreak || !m_pDoneStatics.load( std::memory_order_relaxed ) )
+		return;
+
+	for ( StaticSlot_t* pSlot = m_pDoneStatics.exchange( nullptr, std::memory_order_acquire ); pSlot && !m_bBreak; pSlot = pSlot->m_pNextDone )
+		g_ComboPacker.Push( pSlot->m_pInfo, pSlot->m_nStaticCombo, ShaderByteCode( pSlot->m_pInfo ).Find( pSlot->m_nStaticCombo ) );
+}
+
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::RangeFinished()
+{
+	// Finish packaging data
+	TryToPackageData();
+	g_ComboPacker.Drain();
+}
+
+template <Threading::Mutex TMutexType>
+bool CWorkerAccumState<TMutexType>::PopChunk( uint32_t iSlot, uint32_t& riChunk )
+{
+	// Own queue first, from the front
+	const uint32_t nQueues = NumQueues();
 	{
-		if ( iRunningCommand < iCommandNumber )
+		ChunkQueue_t& queue = m_arrQueues[iSlot];
+		std::lock_guard lock( queue.mtx );
+		if ( !queue.chunks.empty() )
 		{
-			iFinishedByNow = 0;
-			break;
+			riChunk = queue.chunks.front();
+			queue.chunks.pop_front();
+			return true;
 		}
 	}
 
-	const uint64_t iLastFinished = m_iLastFinished;
-	if ( iFinishedByNow > m_iLastFinished )
+	// Then steal from the back of the others
+	for ( uint32_t i = 1; i < nQueues; ++i )
 	{
-		m_iLastFinished = iFinishedByNow;
-		m_pMutex->unlock();
+		ChunkQueue_t& queue = m_arrQueues[( iSlot + i ) % nQueues];
+		std::lock_guard lock( queue.mtx );
+		if ( !queue.chunks.empty() )
+		{
+			riChunk = queue.chunks.back();
+			queue.chunks.pop_back();
+			return true;
+		}
 	}
-	else
+
+	return false;
+}
+
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::ProcessChunk( CommandChunk_t& chunk, bool bThreaded )
+{
+	if ( chunk.m_pStaticEntry )
 	{
-		m_pMutex->unlock();
+		ProcessStaticChunk( chunk, bThreaded );
 		return;
 	}
 
-	CfgProcessor::ComboHandle hChBegin = CfgProcessor::Combo_GetCombo( iLastFinished );
-	CfgProcessor::ComboHandle hChEnd   = CfgProcessor::Combo_GetCombo( iFinishedByNow );
+	m_pCurrentChunk = &chunk;
+
+	// Commands get built in place, the storage only grows until the biggest shader fits
+	thread_local CfgProcessor::ComboCommand s_command;
+
+	CfgProcessor::ComboHandle hCombo = nullptr;
+	uint64_t iCommand = chunk.m_iStart;
+	for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, chunk.m_iEnd ); hCombo && !m_bBreak; CfgProcessor::Combo_GetNext( iCommand, hCombo, chunk.m_iEnd ) )
+	{
+		// Commands skipped up to here count as done
+		AdvanceChunk( chunk, Combo_GetCommandNum( hCombo ), false );
+
+		if ( bThreaded )
+			ExecuteCompileCommandThreaded( hCombo, s_command );
+		else
+			ExecuteCompileCommand( hCombo, s_command );
+	}
+	Combo_Free( hCombo );
+
+	if ( !m_bBreak )
+		AdvanceChunk( chunk, chunk.m_iEnd, false );
+	TryToPackageData();
 
-	Assert( hChBegin && hChEnd );
+	m_pCurrentChunk = nullptr;
+}
+
+// The chunk holds whole static combos and nobody else touches them, so every static combo
+// gets collected locally and packed right after its last combo compiled, no ordering needed
+template <Threading::Mutex TMutexType>
+void CWorkerAccumState<TMutexType>::ProcessStaticChunk( CommandChunk_t& chunk, bool bThreaded )
+{
+	m_pCurrentChunk = &chunk;
 
-	const CfgProcessor::CfgEntryInfo* pInfoBegin = Combo_GetEntryInfo( hChBegin );
-	const CfgProcessor::CfgEntryInfo* pInfoEnd   = Combo_GetEntryInfo( hChEnd );
+	thread_local CfgProcessor::ComboCommand s_command;
 
-	uint64_t nComboBegin     = Combo_GetComboNum( hChBegin ) / pInfoBegin->m_numDynamicCombos;
-	const uint64_t nComboEnd = Combo_GetComboNum( hChEnd ) / pInfoEnd->m_numDynamicCombos;
+	const CfgProcessor::CfgEntryInfo* pInfo = chunk.m_pStaticEntry;
+	const uint64_t nDynamic                 = pInfo->m_numDynamicCombos;
+	CShaderByteCode& byteCode               = ShaderByteCode( pInfo );
+	uint64_t nPacked                        = 0;
 
-	for ( ; pInfoBegin && ( pInfoBegin->m_iCommandStart < pInfoEnd->m_iCommandStart || nComboBegin > nComboEnd ); )
+	CfgProcessor::ComboHandle hCombo = nullptr;
+	uint64_t iCommand = chunk.m_iStart;
+	CfgProcessor::Combo_GetNext( iCommand, hCombo, chunk.m_iEnd );
+	while ( hCombo && !m_bBreak )
 	{
-		// Zip this combo
-		CUtlBuffer mbPacked;
-		const size_t nPackedLength = AssembleWorkerReplyPackage( pInfoBegin, nComboBegin, mbPacked );
+		const uint64_t nStComboIdx = Combo_GetComboNum( hCombo ) / nDynamic;
+		CStaticCombo* pStCombo     = byteCode.FindOrAdd( nStComboIdx );
 
-		if ( nPackedLength )
+		m_pCurrentStatic = pStCombo;
+		do
 		{
-			// Packed buffer
-			GLOBAL_DATA_MTX_LOCK();
-			uint8_t* pCodeBuffer = StaticComboFromDictAdd( pInfoBegin->m_szName, nComboBegin )->AllocPackedCodeBlock( nPackedLength );
-			GLOBAL_DATA_MTX_UNLOCK();
+			chunk.m_iProgress = Combo_GetCommandNum( hCombo );
 
-			if ( pCodeBuffer )
-			{
-				mbPacked.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-				mbPacked.Get( pCodeBuffer, gsl::narrow<int>( nPackedLength ) );
-			}
+			if ( bThreaded )
+				ExecuteCompileCommandThreaded( hCombo, s_command );
+			else
+				ExecuteCompileCommand( hCombo, s_command );
+
+			CfgProcessor::Combo_GetNext( iCommand, hCombo, chunk.m_iEnd );
 		}
+		while ( hCombo && !m_bBreak && Combo_GetComboNum( hCombo ) / nDynamic == nStComboIdx );
+		m_pCurrentStatic = nullptr;
 
-		// Next iteration
-		if ( !nComboBegin-- )
+		if ( !m_bBreak )
 		{
-			Combo_Free( hChBegin );
-			if ( ( hChBegin = CfgProcessor::Combo_GetCombo( pInfoBegin->m_iCommandEnd ) ) != nullptr )
-			{
-				pInfoBegin  = Combo_GetEntryInfo( hChBegin );
-				nComboBegin = pInfoBegin->m_numStaticCombos - 1;
-			}
+			g_ComboPacker.Push( pInfo, nStComboIdx, pStCombo );
+			++nPacked;
 		}
 	}
+	Combo_Free( hCombo );
+
+	// Static combos without any live combo count as packaged too
+	if ( !m_bBreak )
+		g_ComboPacker.Skip( pInfo, ( chunk.m_iEnd - chunk.m_iStart ) / nDynamic - nPacked );
 
-	Combo_Free( hChBegin );
-	Combo_Free( hChEnd );
+	chunk.m_iProgress = chunk.m_iEnd;
+	TryToPackageData();
+
+	m_pCurrentChunk = nullptr;
 }
 
 template <Threading::Mutex TMutexType>
-bool CWorkerAccumState<TMutexType>::OnProcess()
+bool CWorkerAccumState<TMutexType>::OnProcess( uint32_t iSlot )
 {
-	m_pMutex->lock();
-	CfgProcessor::ComboHandle hThreadCombo = m_hCombo ? Combo_Alloc( m_hCombo ) : nullptr;
-	m_arrSubProcessInfos.resize( m_arrSubProcessInfos.size() + 1 );
-	m_iCurrentId = &m_arrSubProcessInfos.back();
-	m_pMutex->unlock();
-
-	uint64_t iThreadCommand = ~0ULL;
-
-	for ( ;; )
-	{
-		m_pMutex->lock();
-		if ( m_hCombo )
-		{
-			Combo_Assign( hThreadCombo, m_hCombo );
-			*m_iCurrentId = Combo_GetCommandNum( hThreadCombo );
-			Combo_GetNext( iThreadCommand, m_hCombo, m_iEndCommand );
-		}
-		else
-		{
-			Combo_Free( hThreadCombo );
-			iThreadCommand = ~0ULL;
-			*m_iCurrentId  = ~0ULL;
-		}
-		m_pMutex->unlock();
-
-		if ( hThreadCombo && !m_bBreak )
-			ExecuteCompileCommandThreaded( hThreadCombo );
-		else
-			break;
-	}
+	uint32_t iChunk;
+	if ( m_bBreak || !PopChunk( iSlot, iChunk ) )
+		return false;
 
-	Combo_Free( hThreadCombo );
-	return false;
+	ProcessChunk( m_arrChunks[iChunk], true );
+	return true;
 }
 
 template <Threading::Mutex TMutexType>
 void CWorkerAccumState<TMutexType>::OnProcessST()
 {
-	while ( m_hCombo && !m_bBreak )
-	{
-		ExecuteCompileCommand( m_hCombo );
-
-		Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
-	}
+	for ( uint32_t iChunk; !m_bBreak && PopChunk( 0, iChunk ); )
+		ProcessChunk( m_arrChunks[iChunk], false );
 }
 
 //
@@ -1228,190 +2417,817 @@ protected:
 		WorkerClass_t* pWorkerObj;
 	} m_ST;
 
-	bool m_bStopped = false;
-};
+	bool m_bStopped = false;
+};
+
+// TODO: Cleanup this hack
+static void StopCommandRange()
+{
+	ProcessCommandRange_Singleton::Instance()->Stop();
+}
+
+void ProcessCommandRange_Singleton::Startup()
+{
+	// The compression threads are part of the budget, which keeps at least one thread to compile
+	const uint32_t budget  = ThreadBudget();
+	const uint32_t threads = budget > g_nCompressThreads ? budget - g_nCompressThreads : 1;
+	if ( threads > 1 )
+	{
+		// Make sure that our mutex is in multi-threaded mode
+		Threading::g_mtxGlobal.SetThreadedMode( Threading::eMultiThreaded );
+		Threading::g_mtxMsgReport.SetThreadedMode( Threading::eMultiThreaded );
+
+		m_MT.pWorkerObj = new MT::WorkerClass_t( &m_MT.mtx );
+		m_MT.pWorkerObj->Start( threads );
+	}
+	else
+		// Otherwise initialize single-threaded mode
+		m_ST.pWorkerObj = new ST::WorkerClass_t( &m_ST.mtx );
+}
+
+void ProcessCommandRange_Singleton::Shutdown()
+{
+	if ( m_MT.pWorkerObj )
+		delete m_MT.pWorkerObj;
+	else if ( m_ST.pWorkerObj )
+		delete m_ST.pWorkerObj;
+}
+
+void ProcessCommandRange_Singleton::Stop()
+{
+	m_bStopped = true;
+	g_ComboPacker.Stop();
+	if ( m_MT.pWorkerObj )
+		m_MT.pWorkerObj->Stop();
+	else
+		m_ST.pWorkerObj->Stop();
+}
+
+
+void ProcessCommandRange_Singleton::ProcessCommandRange( uint64_t shaderStart, uint64_t shaderEnd )
+{
+	if ( m_MT.pWorkerObj )
+	{
+		MT::WorkerClass_t* pWorkerObj = m_MT.pWorkerObj;
+
+		pWorkerObj->RangeBegin( shaderStart, shaderEnd );
+		pWorkerObj->Run();
+		pWorkerObj->RangeFinished();
+	}
+	else
+	{
+		ST::WorkerClass_t* pWorkerObj = m_ST.pWorkerObj;
+
+		pWorkerObj->RangeBegin( shaderStart, shaderEnd );
+		pWorkerObj->OnProcessST();
+		pWorkerObj->RangeFinished();
+	}
+}
+
+static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEntryInfo* pEntry, ShaderInfo_t& shaderInfo )
+{
+	if ( CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( pEntry->m_iCommandStart ) )
+	{
+		CfgProcessor::CfgEntryInfo const* info = Combo_GetEntryInfo( hCombo );
+
+		memset( &shaderInfo, 0, sizeof( ShaderInfo_t ) );
+
+		strcpy_s( shaderInfo.m_szShaderModel, info->m_szShaderVersion );
+		shaderInfo.m_CentroidMask       = info->m_nCentroidMask;
+		shaderInfo.m_Flags              = 0; // not filled out by anything?
+		shaderInfo.m_nShaderCombo       = 0;
+		shaderInfo.m_nTotalShaderCombos = pEntry->m_numCombos;
+		shaderInfo.m_nDynamicCombos     = pEntry->m_numDynamicCombos;
+		shaderInfo.m_nStaticCombo       = 0;
+
+		shaderInfo.m_pShaderName = pEntry->m_szName;
+		shaderInfo.m_pShaderSrc  = pEntry->m_szShaderFileName;
+
+		Combo_Free( hCombo );
+	}
+}
+
+namespace ConfigurationProcessing
+{
+	extern void SetupConfigurationDirect( const std::string& name, const std::string& version, uint32_t centroidMask,
+		const std::vector<Parser::Combo>& static_c, const std::vector<Parser::Combo>& dynamic_c,
+		const std::vector<std::string>& skip, const std::vector<std::string>& includes );
+	extern void FinalizeConfiguration();
+}
+
+// Shader files to work on: the file given on the command line or every line of the -shaderlist file
+static std::vector<std::string> GetShaderFiles()
+{
+	std::vector<std::string> files;
+	if ( !cmdLine.isSet( "-shaderlist" ) )
+	{
+		files.emplace_back( *cmdLine.lastArgs[0] );
+		return files;
+	}
+
+	std::string listFileName;
+	cmdLine.get( "-shaderlist" )->getString( listFileName );
+	std::ifstream listFile( listFileName );
+	if ( !listFile )
+	{
+		std::cout << clr::pinkish << "Can't open \"" << clr::red << listFileName << clr::pinkish << "\"!" << clr::reset << std::endl;
+		exit( -1 );
+	}
+
+	for ( std::string line; std::getline( listFile, line ); )
+	{
+		// Blank lines and // comments are skipped
+		const size_t first = line.find_first_not_of( " \t\r" );
+		if ( first == std::string::npos || line.compare( first, 2, "//" ) == 0 )
+			continue;
+		files.emplace_back( line.substr( first, line.find_last_not_of( " \t\r" ) - first + 1 ) );
+	}
+
+	return files;
+}
+
+// With bDryRun every shader gets set up whatever its crc, and no include gets written
+static void Shared_ParseListOfCompileCommands( bool bDryRun = false )
+{
+	using namespace std::literals;
+	const Clock::time_point tt_start = Clock::now();
+
+	/*char fileListFileName[1024];
+	if ( V_IsAbsolutePath( g_pShaderConfigFile.c_str() ) )
+		strcpy_s( fileListFileName, g_pShaderConfigFile.c_str() );
+	else
+		sprintf_s( fileListFileName, "%s\\%s", g_pShaderPath.c_str(), g_pShaderConfigFile.c_str() );
+
+	if ( !( _access( fileListFileName, 0 ) != -1 ) )
+	{
+		std::cout << clr::pinkish << "Can't open \"" << clr::red << fileListFileName << clr::pinkish << "\"!" << clr::reset << std::endl;
+		exit( -1 );
+	}
+
+	CfgProcessor::ReadConfiguration( fileListFileName );*/
+
+	for ( const std::string& shaderFile : GetShaderFiles() )
+	{
+		const std::string name = Parser::ConstructName( fs::path( shaderFile ).filename().string(), g_pShaderVersion );
+		if ( g_ShaderCRC.contains( name ) )
+			continue;
+
+		const std::string sourceFile = ( fs::path( g_pShaderPath ) / shaderFile ).string();
+		// The crc only goes into the vcs, a dry run leaves it and the deps next to it alone
+		uint32_t crc = 0;
+		if ( !bDryRun && Parser::CheckCrc( sourceFile, name, crc ) && !cmdLine.isSet( "-force" ) )
+			continue;
+
+		std::vector<Parser::Combo> static_c, dynamic_c;
+		std::vector<std::string> skip;
+		uint32_t centroid_mask = 0;
+		std::vector<std::string> includes;
+
+		if ( !Parser::ParseFile( sourceFile, g_pShaderVersion, static_c, dynamic_c, skip, centroid_mask, includes ) )
+		{
+			std::cout << clr::red << "Failed to parse " << shaderFile << clr::reset << std::endl;
+			if ( !cmdLine.isSet( "-shaderlist" ) )
+				exit( -1 );
+
+			// Keep going with the rest of the list, the shader is reported as failed
+			ShaderHadErrorDispatchInt( name.c_str() );
+			continue;
+		}
+		if ( static_c.size() + dynamic_c.size() > CfgProcessor::MAX_DEFINES )
+		{
+			std::cout << clr::red << shaderFile << " has more than " << CfgProcessor::MAX_DEFINES << " combo defines" << clr::reset << std::endl;
+			if ( !cmdLine.isSet( "-shaderlist" ) )
+				exit( -1 );
+
+			ShaderHadErrorDispatchInt( name.c_str() );
+			continue;
+		}
+		if ( !bDryRun )
+			Parser::WriteInclude( ( fs::path( g_pShaderPath ) / "fxctmp9"sv / ( name + ".inc" ) ).string(), name, static_c, dynamic_c, skip );
+		ConfigurationProcessing::SetupConfigurationDirect( name, g_pShaderVersion, centroid_mask, static_c, dynamic_c, skip, includes );
+		g_ShaderCRC.emplace( name, crc );
+	}
+
+	// Everything is up to date
+	if ( g_ShaderCRC.empty() )
+		exit( gsl::narrow_cast<int>( g_ShaderHadError.size() ) );
+
+	ConfigurationProcessing::FinalizeConfiguration();
+	CfgProcessor::DescribeConfiguration( g_arrCompileEntries );
+
+	for ( const CfgProcessor::CfgEntryInfo* pInfo = g_arrCompileEntries.get(); pInfo && pInfo->m_szName; ++pInfo )
+	{
+		++g_numShaders;
+		g_numStaticCombos += pInfo->m_numStaticCombos;
+		g_numCompileCommands = pInfo->m_iCommandEnd;
+	}
+
+	if ( bDryRun )
+		return;
+
+	const Clock::time_point tt_end = Clock::now();
+
+	std::cout << "\rCompiling " << clr::green << PrettyPrint( g_numCompileCommands ) << clr::reset << " commands, setup took " << clr::green << std::chrono::duration_cast<std::chrono::seconds>( tt_end - tt_start ).count() << clr::reset << " seconds.         \r";
+}
+
+static void CompileShaders()
+{
+	ProcessCommandRange_Singleton pcr;
+
+	//
+	// Stick the shader info of every cfg entry
+	//
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = g_arrCompileEntries.get(); pEntry && pEntry->m_szName; ++pEntry )
+	{
+		ShaderInfo_t siLastShaderInfo;
+		memset( &siLastShaderInfo, 0, sizeof( siLastShaderInfo ) );
+
+		Shader_ParseShaderInfoFromCompileCommands( pEntry, siLastShaderInfo );
+
+		g_ShaderToShaderInfo[pEntry->m_szName] = siLastShaderInfo;
+	}
+
+	//
+	// Static combo tables of every shader, the workers store their bytecode there without locking
+	//
+	g_arrShaderByteCode = std::make_unique<std::unique_ptr<CShaderByteCode>[]>( g_numShaders );
+	for ( uint64_t i = 0; i < g_numShaders; ++i )
+		g_arrShaderByteCode[i] = std::make_unique<CShaderByteCode>( g_arrCompileEntries[i].m_numStaticCombos );
+
+	//
+	// Compile all the entries in one go, so the workers never wait for a small shader to finish.
+	// Every shader is queued for writing when its last static combo gets packaged.
+	//
+	if ( PreprocessDedup::s_bEnabled )
+		PreprocessDedup::Begin();
+
+	if ( LzmaTune::s_bEnabled )
+		LzmaTune::Begin();
+
+	g_ShaderWriter.Start();
+	g_ComboPacker.Start( g_nCompressThreads );
+	pcr.ProcessCommandRange( 0, g_numCompileCommands );
+	g_ComboPacker.Finish();
+	g_ShaderWriter.Finish();
+
+	std::cout << "\r                                                                                           \r";
+
+	if ( g_ShaderWriter.NumWritten() )
+	{
+		const auto& seconds = []( Clock::duration d ) { return std::chrono::duration<double>( d ).count(); };
+		const Clock::duration tOverlapped = std::max( g_ShaderWriter.BusyTime() - g_ShaderWriter.DrainTime(), Clock::duration::zero() );
+		std::cout << "Writing " << clr::green << g_ShaderWriter.NumWritten() << clr::reset << " shader(s) took " << std::fixed << std::setprecision( 2 ) << clr::green << seconds( g_ShaderWriter.BusyTime() ) << "s" << clr::reset
+				  << ", " << clr::green << seconds( tOverlapped ) << "s" << clr::reset << " of it overlapped with compiling" << std::defaultfloat << std::endl;
+	}
+
+	if ( PreprocessDedup::s_bEnabled )
+		PreprocessDedup::Report();
+
+	if ( LzmaTune::s_bEnabled )
+		LzmaTune::Report();
+
+	if ( ShaderCache::IsEnabled() )
+	{
+		ShaderCache::Shutdown();
+
+		const ShaderCache::Stats stats = ShaderCache::GetStats();
+		const uint64_t nLookups = stats.m_nHits + stats.m_nMisses;
+		std::cout << "Cache: " << clr::green << PrettyPrint( stats.m_nHits ) << clr::reset << " hits, " << clr::green << PrettyPrint( stats.m_nMisses ) << clr::reset << " misses ("
+				  << clr::green << std::fixed << std::setprecision( 1 ) << ( nLookups ? 100.0 * stats.m_nHits / nLookups : 0.0 ) << "%" << clr::reset << " hit rate), "
+				  << clr::green << PrettyPrint( stats.m_nStored ) << clr::reset << " stored, " << clr::green << PrettyPrint( stats.m_nEvicted ) << clr::reset << " evicted, "
+				  << clr::green << ( stats.m_nBytesRead >> 10 ) << clr::reset << " KiB read, " << clr::green << ( stats.m_nBytesWritten >> 10 ) << clr::reset << " KiB written" << std::defaultfloat << std::endl;
+	}
+}
+
+//
+// -dry-run: counts what is left of every shader after SKIP instead of compiling
+//
+namespace DryRun
+{
+struct ShaderReport
+{
+	const CfgProcessor::CfgEntryInfo* m_pInfo;
+	std::map<uint64_t, uint64_t> m_histogram; // live dynamic combos -> number of static combos with that many
+	uint64_t m_numLive;
+	uint64_t m_numLiveStatic;
+	std::vector<CfgProcessor::SkipClauseStats> m_arrClauses; // With -skip-report
+};
+
+static void Count( std::vector<ShaderReport>& reports, uint32_t numThreads, bool bClauses )
+{
+	// Static combo ranges of every shader, handed out to the threads one at a time
+	struct Task
+	{
+		ShaderReport* m_pReport;
+		uint64_t m_iStaticFirst;
+		uint64_t m_iStaticEnd;
+	};
+	std::vector<Task> tasks;
+	for ( ShaderReport& report : reports )
+	{
+		const uint64_t numStatic = report.m_pInfo->m_numStaticCombos;
+		const uint64_t nStep     = std::max<uint64_t>( 1, numStatic / ( numThreads * 8ULL ) );
+		for ( uint64_t iStatic = 0; iStatic < numStatic; iStatic += nStep )
+			tasks.emplace_back( Task { &report, iStatic, std::min( iStatic + nStep, numStatic ) } );
+	}
+
+	std::atomic<size_t> nNextTask { 0 };
+	std::mutex mtx;
+	const auto& worker = [&]() {
+		for ( size_t i = nNextTask++; i < tasks.size(); i = nNextTask++ )
+		{
+			const Task& task = tasks[i];
+			const CfgProcessor::CfgEntryInfo* pInfo = task.m_pReport->m_pInfo;
+			std::map<uint64_t, uint64_t> histogram;
+			CfgProcessor::Combo_CountLiveDynamic( pInfo, task.m_iStaticFirst, task.m_iStaticEnd, histogram );
+
+			std::vector<CfgProcessor::SkipClauseStats> clauses;
+			if ( bClauses )
+				CfgProcessor::Combo_CountSkipClauses( pInfo, task.m_iStaticFirst * pInfo->m_numDynamicCombos, task.m_iStaticEnd * pInfo->m_numDynamicCombos, clauses );
+
+			std::lock_guard lock( mtx );
+			for ( const auto& [nLive, numStatic] : histogram )
+				task.m_pReport->m_histogram[nLive] += numStatic;
+
+			std::vector<CfgProcessor::SkipClauseStats>& total = task.m_pReport->m_arrClauses;
+			if ( total.empty() )
+				total = std::move( clauses );
+			else
+			{
+				for ( size_t c = 0; c < clauses.size(); ++c )
+				{
+					total[c].m_numSkipped += clauses[c].m_numSkipped;
+					total[c].m_numUnique += clauses[c].m_numUnique;
+					total[c].m_numRedundant += clauses[c].m_numRedundant;
+					total[c].m_nEvalNanoseconds += clauses[c].m_nEvalNanoseconds;
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for ( uint32_t i = 1; i < numThreads; ++i )
+		threads.emplace_back( worker );
+	worker();
+	std::for_each( threads.begin(), threads.end(), []( std::thread& t ) { t.join(); } );
+
+	for ( ShaderReport& report : reports )
+	{
+		report.m_numLive = report.m_numLiveStatic = 0;
+		for ( const auto& [nLive, numStatic] : report.m_histogram )
+		{
+			report.m_numLive += nLive * numStatic;
+			if ( nLive )
+				report.m_numLiveStatic += numStatic;
+		}
+	}
+}
+
+static Json::Value MakeJson( const std::vector<ShaderReport>& reports )
+{
+	Json::Value root( Json::objectValue );
+	Json::Value& shaders = root["shaders"] = Json::Value( Json::arrayValue );
+	uint64_t numCombos = 0, numLive = 0;
+	for ( const ShaderReport& report : reports )
+	{
+		const CfgProcessor::CfgEntryInfo* pInfo = report.m_pInfo;
+		Json::Value& shader           = shaders.append( Json::Value( Json::objectValue ) );
+		shader["name"]                = pInfo->m_szName;
+		shader["file"]                = pInfo->m_szShaderFileName;
+		shader["combos"]              = Json::UInt64( pInfo->m_numCombos );
+		shader["static_combos"]       = Json::UInt64( pInfo->m_numStaticCombos );
+		shader["dynamic_combos"]      = Json::UInt64( pInfo->m_numDynamicCombos );
+		shader["live"]                = Json::UInt64( report.m_numLive );
+		shader["skipped"]             = Json::UInt64( pInfo->m_numCombos - report.m_numLive );
+		shader["live_static_combos"]  = Json::UInt64( report.m_numLiveStatic );
+
+		// Number of live dynamic combos -> how many static combos have that many
+		Json::Value& histogram = shader["live_dynamic_per_static"] = Json::Value( Json::objectValue );
+		for ( const auto& [nLive, numStatic] : report.m_histogram )
+			histogram[std::to_string( nLive )] = Json::UInt64( numStatic );
+
+		// SKIP lines in the order they were written
+		if ( !report.m_arrClauses.empty() )
+		{
+			Json::Value& clauses = shader["skip"] = Json::Value( Json::arrayValue );
+			for ( const CfgProcessor::SkipClauseStats& stats : report.m_arrClauses )
+			{
+				Json::Value& clause   = clauses.append( Json::Value( Json::objectValue ) );
+				clause["clause"]      = stats.m_szClause;
+				clause["order"]       = stats.m_nOrder;
+				clause["skipped"]     = Json::UInt64( stats.m_numSkipped );
+				clause["unique"]      = Json::UInt64( stats.m_numUnique );
+				clause["redundant"]   = Json::UInt64( stats.m_numRedundant );
+				clause["ns_per_combo"] = pInfo->m_numCombos ? static_cast<double>( stats.m_nEvalNanoseconds ) / pInfo->m_numCombos : 0.0;
+			}
+		}
+
+		numCombos += pInfo->m_numCombos;
+		numLive += report.m_numLive;
+	}
 
-// TODO: Cleanup this hack
-static void StopCommandRange()
-{
-	ProcessCommandRange_Singleton::Instance()->Stop();
+	Json::Value& total = root["total"] = Json::Value( Json::objectValue );
+	total["shaders"]   = Json::UInt64( reports.size() );
+	total["combos"]    = Json::UInt64( numCombos );
+	total["live"]      = Json::UInt64( numLive );
+	total["skipped"]   = Json::UInt64( numCombos - numLive );
+	return root;
 }
 
-void ProcessCommandRange_Singleton::Startup()
+static void Print( const std::vector<ShaderReport>& reports )
 {
-	unsigned long threads;
-	cmdLine.get( "-threads" )->getULong( threads );
-	if ( ( threads ? threads : std::thread::hardware_concurrency() ) > 1 )
+	uint64_t numCombos = 0, numLive = 0;
+	for ( const ShaderReport& report : reports )
 	{
-		// Make sure that our mutex is in multi-threaded mode
-		Threading::g_mtxGlobal.SetThreadedMode( Threading::eMultiThreaded );
-		Threading::g_mtxMsgReport.SetThreadedMode( Threading::eMultiThreaded );
+		const CfgProcessor::CfgEntryInfo* pInfo = report.m_pInfo;
+		std::cout << pInfo->m_szName << ": " << clr::green << PrettyPrint( report.m_numLive ) << clr::reset << " of " << PrettyPrint( pInfo->m_numCombos ) << " combos live ("
+				  << std::fixed << std::setprecision( 1 ) << ( pInfo->m_numCombos ? 100.0 * report.m_numLive / pInfo->m_numCombos : 0.0 ) << "%), "
+				  << clr::green << PrettyPrint( report.m_numLiveStatic ) << clr::reset << " of " << PrettyPrint( pInfo->m_numStaticCombos ) << " static combos" << std::defaultfloat;
 
-		m_MT.pWorkerObj = new MT::WorkerClass_t( &m_MT.mtx );
+		// Spread of the live dynamic combos over the static combos that have any
+		if ( report.m_numLiveStatic )
+		{
+			const auto itFirst = report.m_histogram.upper_bound( 0 );
+			uint64_t nMedian = 0, nSeen = 0;
+			for ( auto it = itFirst; it != report.m_histogram.end(); ++it )
+			{
+				nSeen += it->second;
+				if ( nSeen * 2 >= report.m_numLiveStatic )
+				{
+					nMedian = it->first;
+					break;
+				}
+			}
+			std::cout << " with " << itFirst->first << "/" << nMedian << "/" << report.m_histogram.rbegin()->first << " (min/median/max) of " << PrettyPrint( pInfo->m_numDynamicCombos ) << " dynamic ones live";
+		}
+		std::cout << std::endl;
+
+		// Lines that never skip anything on their own are candidates for removal
+		for ( size_t c = 0; c < report.m_arrClauses.size(); ++c )
+		{
+			const CfgProcessor::SkipClauseStats& stats = report.m_arrClauses[c];
+			std::cout << "  SKIP #" << c + 1 << " (evaluated " << stats.m_nOrder + 1 << "): " << clr::green << PrettyPrint( stats.m_numSkipped ) << clr::reset << " skipped, "
+					  << ( stats.m_numUnique ? clr::green : clr::red ) << PrettyPrint( stats.m_numUnique ) << clr::reset << " only by it, "
+					  << PrettyPrint( stats.m_numRedundant ) << " by an earlier line already, " << std::fixed << std::setprecision( 1 )
+					  << ( pInfo->m_numCombos ? static_cast<double>( stats.m_nEvalNanoseconds ) / pInfo->m_numCombos : 0.0 ) << " ns per combo" << std::defaultfloat
+					  << ": " << clr::grey << stats.m_szClause << clr::reset << std::endl;
+		}
+
+		numCombos += pInfo->m_numCombos;
+		numLive += report.m_numLive;
 	}
-	else
-		// Otherwise initialize single-threaded mode
-		m_ST.pWorkerObj = new ST::WorkerClass_t( &m_ST.mtx );
-}
 
-void ProcessCommandRange_Singleton::Shutdown()
-{
-	if ( m_MT.pWorkerObj )
-		delete m_MT.pWorkerObj;
-	else if ( m_ST.pWorkerObj )
-		delete m_ST.pWorkerObj;
+	std::cout << "Total: " << clr::green << PrettyPrint( numLive ) << clr::reset << " of " << PrettyPrint( numCombos ) << " combos in " << reports.size() << " shader(s) left to compile, "
+			  << clr::green << PrettyPrint( numCombos - numLive ) << clr::reset << " skipped" << std::endl;
 }
 
-void ProcessCommandRange_Singleton::Stop()
+// Reports the live combos of every shader on the console, the JSON report goes to reportFile
+// if there is one, or to stdout instead of the console report if it is "-". With bClauses
+// every SKIP line gets evaluated on its own as well.
+static int Run( const std::string& reportFile, bool bClauses )
 {
-	m_bStopped = true;
-	if ( m_MT.pWorkerObj )
-		m_MT.pWorkerObj->Stop();
-	else
-		m_ST.pWorkerObj->Stop();
-}
+	Shared_ParseListOfCompileCommands( true );
 
+	std::vector<ShaderReport> reports;
+	for ( const CfgProcessor::CfgEntryInfo* pInfo = g_arrCompileEntries.get(); pInfo && pInfo->m_szName; ++pInfo )
+		reports.emplace_back( ShaderReport { pInfo, {}, 0, 0, {} } );
 
-void ProcessCommandRange_Singleton::ProcessCommandRange( uint64_t shaderStart, uint64_t shaderEnd )
-{
-	if ( m_MT.pWorkerObj )
-	{
-		MT::WorkerClass_t* pWorkerObj = m_MT.pWorkerObj;
+	unsigned long threads;
+	cmdLine.get( "-threads" )->getULong( threads );
+	Count( reports, threads ? threads : std::max( 1u, std::thread::hardware_concurrency() ), bClauses );
 
-		pWorkerObj->RangeBegin( shaderStart, shaderEnd );
-		unsigned long threads;
-		cmdLine.get( "-threads" )->getULong( threads );
-		pWorkerObj->Run( threads );
-		pWorkerObj->RangeFinished();
-	}
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "\t";
+	if ( reportFile == "-" )
+		std::cout << Json::writeString( builder, MakeJson( reports ) ) << std::endl;
 	else
 	{
-		ST::WorkerClass_t* pWorkerObj = m_ST.pWorkerObj;
+		Print( reports );
+		if ( reportFile.empty() )
+			return gsl::narrow_cast<int>( g_ShaderHadError.size() );
 
-		pWorkerObj->RangeBegin( shaderStart, shaderEnd );
-		pWorkerObj->OnProcessST();
-		pWorkerObj->RangeFinished();
+		std::ofstream file( reportFile, std::ios::trunc );
+		if ( !( file << Json::writeString( builder, MakeJson( reports ) ) << std::endl ) )
+		{
+			std::cout << clr::red << "Can't write " << clr::pinkish << reportFile << clr::reset << std::endl;
+			return -1;
+		}
 	}
+
+	return gsl::narrow_cast<int>( g_ShaderHadError.size() );
 }
+} // namespace DryRun
 
-static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEntryInfo* pEntry, ShaderInfo_t& shaderInfo )
+//
+// Micro-benchmarks of the compile pipeline, selected with -benchmark
+//
+namespace Benchmark
 {
-	if ( CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( pEntry->m_iCommandStart ) )
-	{
-		CfgProcessor::CfgEntryInfo const* info = Combo_GetEntryInfo( hCombo );
+// Fixed cost of a ProcessCommandRange call on top of the actual compiling,
+// measured by handing empty ranges to the worker pool
+static void Dispatch()
+{
+	constexpr uint32_t numRanges = 1000;
 
-		memset( &shaderInfo, 0, sizeof( ShaderInfo_t ) );
+	unsigned long threads;
+	cmdLine.get( "-threads" )->getULong( threads );
+	const uint32_t numThreads = threads ? std::min<uint32_t>( threads, std::thread::hardware_concurrency() ) : std::thread::hardware_concurrency();
 
-		strcpy_s( shaderInfo.m_szShaderModel, info->m_szShaderVersion );
-		shaderInfo.m_CentroidMask       = info->m_nCentroidMask;
-		shaderInfo.m_Flags              = 0; // not filled out by anything?
-		shaderInfo.m_nShaderCombo       = 0;
-		shaderInfo.m_nTotalShaderCombos = pEntry->m_numCombos;
-		shaderInfo.m_nDynamicCombos     = pEntry->m_numDynamicCombos;
-		shaderInfo.m_nStaticCombo       = 0;
+	ProcessCommandRange_Singleton pcr;
+	pcr.ProcessCommandRange( 0, 0 ); // Warm-up
 
-		shaderInfo.m_pShaderName = pEntry->m_szName;
-		shaderInfo.m_pShaderSrc  = pEntry->m_szShaderFileName;
+	const Clock::time_point poolStart = Clock::now();
+	for ( uint32_t i = 0; i < numRanges; ++i )
+		pcr.ProcessCommandRange( 0, 0 );
+	const Clock::time_point poolEnd = Clock::now();
 
-		Combo_Free( hCombo );
+	// For reference, starting and joining the threads for every range
+	const Clock::time_point spawnStart = Clock::now();
+	for ( uint32_t i = 0; i < numRanges; ++i )
+	{
+		std::vector<std::thread> active;
+		for ( uint32_t j = 0; j < numThreads; ++j )
+			active.emplace_back( [] {} );
+		std::for_each( active.begin(), active.end(), []( std::thread& t ) { t.join(); } );
 	}
-}
+	const Clock::time_point spawnEnd = Clock::now();
 
-namespace ConfigurationProcessing
-{
-	extern void SetupConfigurationDirect( const std::string& name, const std::string& version, uint32_t centroidMask,
-		const std::vector<Parser::Combo>& static_c, const std::vector<Parser::Combo>& dynamic_c,
-		const std::vector<std::string>& skip, const std::vector<std::string>& includes );
+	const auto& perRange = []( Clock::duration d ) { return std::chrono::duration<double, std::micro>( d ).count() / numRanges; };
+	std::cout << "dispatch: " << numRanges << " empty ranges on " << numThreads << " thread(s), " << clr::green << std::fixed << std::setprecision( 2 ) << perRange( poolEnd - poolStart ) << clr::reset << " us per range"
+			  << " (starting and joining threads per range: " << clr::green << perRange( spawnEnd - spawnStart ) << clr::reset << " us)" << std::defaultfloat << std::endl;
 }
 
-static void Shared_ParseListOfCompileCommands()
+// Walks every combo of a generated shader with lots of SKIP lines through the
+// expression trees, the compiled skip programs, the programs specialized per
+// static combo, the live combo map and the decision diagram
+static void Skip()
 {
 	using namespace std::literals;
-	const Clock::time_point tt_start = Clock::now();
-
-	/*char fileListFileName[1024];
-	if ( V_IsAbsolutePath( g_pShaderConfigFile.c_str() ) )
-		strcpy_s( fileListFileName, g_pShaderConfigFile.c_str() );
-	else
-		sprintf_s( fileListFileName, "%s\\%s", g_pShaderPath.c_str(), g_pShaderConfigFile.c_str() );
-
-	if ( !( _access( fileListFileName, 0 ) != -1 ) )
-	{
-		std::cout << clr::pinkish << "Can't open \"" << clr::red << fileListFileName << clr::pinkish << "\"!" << clr::reset << std::endl;
-		exit( -1 );
-	}
-
-	CfgProcessor::ReadConfiguration( fileListFileName );*/
+	constexpr uint32_t numStatic  = 6;
+	constexpr uint32_t numDynamic = 7;
+	constexpr uint32_t numSkip    = 40;
+	constexpr uint32_t numPasses  = 5;
+
+	// Same shader every run, so the numbers stay comparable
+	std::mt19937 rng( 1234 );
+	const auto& var = [&rng]() {
+		const uint32_t i = rng() % ( numStatic + numDynamic );
+		return i < numStatic ? "$S"s + std::to_string( i ) : "$D"s + std::to_string( i - numStatic );
+	};
+	const auto& term = [&rng, &var]() {
+		static constexpr const char* ops[] = { " == ", " != ", " > ", " < " };
+		switch ( rng() % 4 )
+		{
+		case 0:
+			return var();
+		case 1:
+			return "!"s + var();
+		default:
+			return "( "s + var() + ops[rng() % std::size( ops )] + std::to_string( rng() % 2 ) + " )";
+		}
+	};
 
-	const std::string name = Parser::ConstructName( fs::path( *cmdLine.lastArgs[0] ).filename().string(), g_pShaderVersion );
-	if ( Parser::CheckCrc( ( fs::path( g_pShaderPath ) / *cmdLine.lastArgs[0] ).string(), name, g_pShaderCRC ) && !cmdLine.isSet( "-force" ) )
-	{
-		exit( 0 );
+	const fs::path dir = fs::temp_directory_path() / "shadercompile_benchmark";
+	std::error_code ec;
+	fs::create_directories( dir, ec );
+	const std::string fileName = "skipbench_ps30.fxc";
+	// -benchmark returns before -ver gets read, the version goes with the file name
+	const std::string version = "30";
+	{
+		std::ofstream src( dir / fileName, std::ios::trunc );
+		for ( uint32_t i = 0; i < numStatic; ++i )
+			src << "// STATIC: \"S" << i << "\" \"0.." << 1 + i % 3 << "\"\n";
+		for ( uint32_t i = 0; i < numDynamic; ++i )
+			src << "// DYNAMIC: \"D" << i << "\" \"0.." << 1 + i % 2 << "\"\n";
+		for ( uint32_t i = 0; i < numSkip; ++i )
+		{
+			src << "// SKIP: " << term();
+			for ( uint32_t j = 3 + rng() % 2; j; --j )
+				src << " && " << term();
+			src << "\n";
+		}
+		src << "float4 main() : COLOR { return 0; }\n";
 	}
 
+	g_pShaderPath = dir.string();
 	std::vector<Parser::Combo> static_c, dynamic_c;
 	std::vector<std::string> skip;
 	uint32_t centroid_mask = 0;
 	std::vector<std::string> includes;
-
-	if ( !Parser::ParseFile( ( fs::path( g_pShaderPath ) / *cmdLine.lastArgs[0] ).string(), g_pShaderVersion, static_c, dynamic_c, skip, centroid_mask, includes ) )
+	if ( !Parser::ParseFile( ( dir / fileName ).string(), version, static_c, dynamic_c, skip, centroid_mask, includes ) )
 	{
-		std::cout << clr::red << "Failed to parse " << *cmdLine.lastArgs[0] << clr::reset << std::endl;
-		exit( -1 );
+		std::cout << clr::red << "Failed to parse " << ( dir / fileName ).string() << clr::reset << std::endl;
+		return;
 	}
-	Parser::WriteInclude( ( fs::path( g_pShaderPath ) / "fxctmp9"sv / ( name + ".inc" ) ).string(), name, static_c, dynamic_c, skip );
-	ConfigurationProcessing::SetupConfigurationDirect( name, g_pShaderVersion, centroid_mask, static_c, dynamic_c, skip, includes );
-
+	ConfigurationProcessing::SetupConfigurationDirect( Parser::ConstructName( fileName, version ), version, centroid_mask, static_c, dynamic_c, skip, includes );
+	ConfigurationProcessing::FinalizeConfiguration();
 	CfgProcessor::DescribeConfiguration( g_arrCompileEntries );
+	const uint64_t numCommands = g_arrCompileEntries[0].m_iCommandEnd;
 
-	for ( const CfgProcessor::CfgEntryInfo* pInfo = g_arrCompileEntries.get(); pInfo && pInfo->m_szName; ++pInfo )
+	struct Result
 	{
-		++g_numShaders;
-		g_numStaticCombos += pInfo->m_numStaticCombos;
-		g_numCompileCommands = pInfo->m_iCommandEnd;
-	}
+		const char* szName;
+		double flSetup; // ns per combo spent in FinalizeConfiguration
+		double flWalk;  // ns per combo spent iterating
+		uint64_t numLeft;
+	};
+	const auto& perCombo = [numCommands]( Clock::duration d, uint32_t nTimes ) { return std::chrono::duration<double, std::nano>( d ).count() / ( static_cast<double>( numCommands ) * nTimes ); };
+	const auto& walk = [numCommands, &perCombo]( const char* szName, CfgProcessor::SkipEvaluation eMode ) {
+		Result result { szName, 0.0, 0.0, 0 };
+		CfgProcessor::SetSkipEvaluation( eMode );
+
+		const Clock::time_point setupStart = Clock::now();
+		for ( uint32_t pass = 0; pass < numPasses; ++pass )
+			ConfigurationProcessing::FinalizeConfiguration();
+		result.flSetup = perCombo( Clock::now() - setupStart, numPasses );
+
+		const Clock::time_point walkStart = Clock::now();
+		for ( uint32_t pass = 0; pass < numPasses; ++pass )
+		{
+			result.numLeft = 0;
+			CfgProcessor::ComboHandle hCombo = nullptr;
+			uint64_t iCommand = 0;
+			for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, numCommands ); hCombo; CfgProcessor::Combo_GetNext( iCommand, hCombo, numCommands ) )
+				++result.numLeft;
+			CfgProcessor::Combo_Free( hCombo );
+		}
+		result.flWalk = perCombo( Clock::now() - walkStart, numPasses );
+		return result;
+	};
 
-	const Clock::time_point tt_end = Clock::now();
+	const Result results[] = {
+		walk( "expression tree: ", CfgProcessor::SkipEvaluation::Tree ),
+		walk( "compiled program:", CfgProcessor::SkipEvaluation::Compiled ),
+		walk( "residual program:", CfgProcessor::SkipEvaluation::Residual ),
+		walk( "live combo map:  ", CfgProcessor::SkipEvaluation::LiveMap ),
+		walk( "decision diagram:", CfgProcessor::SkipEvaluation::Diagram ),
+	};
 
-	std::cout << "\rCompiling " << clr::green << PrettyPrint( g_numCompileCommands ) << clr::reset << " commands, setup took " << clr::green << std::chrono::duration_cast<std::chrono::seconds>( tt_end - tt_start ).count() << clr::reset << " seconds.         \r";
+	std::cout << "skip: " << PrettyPrint( numCommands ) << " combos, " << skip.size() << " SKIP lines, " << PrettyPrint( results[0].numLeft ) << " left to compile" << std::endl;
+	for ( const Result& result : results )
+	{
+		std::cout << "  " << result.szName << " " << clr::green << std::fixed << std::setprecision( 2 ) << result.flSetup + result.flWalk << clr::reset << " ns per combo"
+				  << " (setup " << result.flSetup << ", walk " << result.flWalk << ")" << std::defaultfloat << std::endl;
+		if ( result.numLeft != results[0].numLeft )
+			std::cout << clr::red << "  mismatch: leaves " << PrettyPrint( result.numLeft ) << " combos" << clr::reset << std::endl;
+	}
+
+	fs::remove_all( dir, ec );
 }
 
-static void CompileShaders()
+// Compresses blocks of compiled shaders with a fresh encoder and output buffer per block
+// and with the encoder a thread keeps around. The blocks are packed from the compiled
+// shader files or directories given on the command line, without any the synthetic
+// backend makes the bytecode up.
+static void Lzma()
 {
-	ProcessCommandRange_Singleton pcr;
+	constexpr uint32_t numSynthetic = 4000;
+	constexpr uint32_t numPasses    = 5;
+
+	std::vector<std::vector<uint8_t>> combos;
+	const auto& addFile = [&combos]( const fs::path& path ) {
+		std::ifstream file( path, std::ios::binary );
+		std::vector<uint8_t>& code = combos.emplace_back( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+		if ( code.empty() )
+			combos.pop_back();
+	};
+	for ( const std::string* pArg : cmdLine.lastArgs )
+	{
+		std::error_code ec;
+		if ( fs::is_directory( *pArg, ec ) )
+		{
+			for ( const fs::directory_entry& entry : fs::recursive_directory_iterator( *pArg, ec ) )
+				if ( entry.is_regular_file( ec ) )
+					addFile( entry.path() );
+		}
+		else
+			addFile( *pArg );
+	}
 
-	//
-	// We will iterate on the cfg entries and process them
-	//
-	for ( const CfgProcessor::CfgEntryInfo* pEntry = g_arrCompileEntries.get(); pEntry && pEntry->m_szName; ++pEntry )
+	const bool bSynthetic = combos.empty();
+	if ( bSynthetic )
 	{
-		//
-		// Stick the shader info
-		//
-		ShaderInfo_t siLastShaderInfo;
-		memset( &siLastShaderInfo, 0, sizeof( siLastShaderInfo ) );
+		if ( !InterceptFxc::SetActiveBackend( "synthetic" ) )
+			return;
 
-		Shader_ParseShaderInfoFromCompileCommands( pEntry, siLastShaderInfo );
+		InterceptFxc::ICompilerBackend* pBackend = InterceptFxc::GetActiveBackend();
+		for ( uint32_t i = 0; i < numSynthetic; ++i )
+		{
+			const std::string combo = std::to_string( i );
+			const CmdSink::ShaderMacro macros[] = { { "COMBO", combo.c_str() }, { nullptr, nullptr } };
+			CmdSink::IResponse* pResponse = nullptr;
+			pBackend->Compile( { "lzmabench_ps30.fxc", "ps_3_0", macros }, 0, &pResponse );
+			if ( pResponse && pResponse->Succeeded() )
+			{
+				const uint8_t* pCode = static_cast<const uint8_t*>( pResponse->GetResultBuffer() );
+				combos.emplace_back( pCode, pCode + pResponse->GetResultBufferLen() );
+			}
+			if ( pResponse )
+				pResponse->Release();
+		}
+	}
 
-		g_ShaderToShaderInfo[pEntry->m_szName] = siLastShaderInfo;
+	// Same framing and block size as PackComboBlock
+	std::vector<std::vector<uint8_t>> blocks( 1 );
+	size_t numBytes = 0;
+	for ( uint32_t i = 0; i < combos.size(); ++i )
+	{
+		const std::vector<uint8_t>& code = combos[i];
+		if ( !blocks.back().empty() && blocks.back().size() + code.size() + 16 >= MAX_SHADER_UNPACKED_BLOCK_SIZE )
+			blocks.emplace_back();
 
-		//
-		// Compile stuff
-		//
-		pcr.ProcessCommandRange( pEntry->m_iCommandStart, pEntry->m_iCommandEnd );
+		const uint32_t header[] = { i, gsl::narrow<uint32_t>( code.size() ) };
+		std::vector<uint8_t>& block = blocks.back();
+		block.insert( block.end(), reinterpret_cast<const uint8_t*>( header ), reinterpret_cast<const uint8_t*>( header + 2 ) );
+		block.insert( block.end(), code.begin(), code.end() );
+		numBytes += sizeof( header ) + code.size();
+	}
+	if ( !numBytes )
+	{
+		std::cout << clr::red << "No compiled shaders to pack" << clr::reset << std::endl;
+		return;
+	}
 
-		if ( pcr.Stoped() )
-			break;
+	const auto& fresh = []( const std::vector<uint8_t>& block ) -> size_t {
+		CLzmaEncProps props;
+		LzmaEncProps_Init( &props );
+		props.numThreads = 1;
+		SizeT outSize = block.size() / 20 * 21 + ( 1 << 16 );
+		std::unique_ptr<Byte[]> pOut( new Byte[outSize] );
+		Byte properties[LZMA_PROPS_SIZE];
+		SizeT propsSize = LZMA_PROPS_SIZE;
+		if ( ::LzmaEncode( pOut.get(), &outSize, block.data(), block.size(), &props, properties, &propsSize, 0, nullptr, &LZMA::g_Alloc, &LZMA::g_Alloc ) != SZ_OK || outSize + sizeof( LZMA::lzma_header_t ) >= block.size() )
+			return block.size();
+		return outSize + sizeof( LZMA::lzma_header_t );
+	};
+	const auto& reused = []( const std::vector<uint8_t>& block ) -> size_t {
+		const std::span<const uint8_t> compressed = ThreadEncoder().OpportunisticCompress( block.data(), block.size() );
+		return compressed.empty() ? block.size() : compressed.size();
+	};
+	std::unique_ptr<LZMA::CEncoder> pMtEncoder;
+	if ( g_eLzmaMt != LzmaMt::Off )
+		pMtEncoder = std::make_unique<LZMA::CEncoder>( MtEncoderProps() );
+	const auto& reusedMt = [&pMtEncoder]( const std::vector<uint8_t>& block ) -> size_t {
+		const std::span<const uint8_t> compressed = pMtEncoder->OpportunisticCompress( block.data(), block.size() );
+		return compressed.empty() ? block.size() : compressed.size();
+	};
+
+	struct Result
+	{
+		const char* szName;
+		double flBlock; // us per block
+		size_t numPacked;
+	};
+	const auto& run = [&blocks]( const char* szName, const auto& compress ) {
+		Result result { szName, 0.0, 0 };
+		const Clock::time_point start = Clock::now();
+		for ( uint32_t pass = 0; pass < numPasses; ++pass )
+		{
+			result.numPacked = 0;
+			for ( const std::vector<uint8_t>& block : blocks )
+				result.numPacked += compress( block );
+		}
+		result.flBlock = std::chrono::duration<double, std::micro>( Clock::now() - start ).count() / ( static_cast<double>( blocks.size() ) * numPasses );
+		return result;
+	};
+
+	// Warm-up, sets the thread's encoders up
+	reused( blocks[0] );
+	if ( g_eLzmaMt != LzmaMt::Off )
+		reusedMt( blocks[0] );
+
+	std::vector<Result> results = {
+		run( "fresh encoder per block:  ", fresh ),
+		run( "reused encoder:           ", reused ),
+	};
+	if ( g_eLzmaMt != LzmaMt::Off )
+		results.emplace_back( run( "reused, mt match finder:  ", reusedMt ) );
 
-		//
-		// Now when the whole shader is finished we can write it
-		//
-		const char* szShaderToWrite = pEntry->m_szName;
-		WriteShaderFiles( szShaderToWrite );
+	std::cout << "lzma: " << blocks.size() << " blocks of " << PrettyPrint( combos.size() ) << ( bSynthetic ? " synthetic" : "" ) << " combos, " << std::fixed << std::setprecision( 2 ) << numBytes / ( 1024.0 * 1024.0 ) << " MiB" << std::endl;
+	for ( const Result& result : results )
+	{
+		std::cout << "  " << result.szName << " " << clr::green << result.flBlock << clr::reset << " us per block"
+				  << " (" << numBytes / ( 1024.0 * 1024.0 ) / ( result.flBlock * blocks.size() / 1e6 ) << " MiB/s, packed to " << 100.0 * result.numPacked / numBytes << "%)" << std::endl;
 	}
+	std::cout << std::defaultfloat;
+}
 
-	std::cout << "\r                                                                                           \r";
+static bool Run( const std::string& name )
+{
+	if ( name == "dispatch" )
+		Dispatch();
+	else if ( name == "skip" )
+		Skip();
+	else if ( name == "lzma" )
+		Lzma();
+	else
+	{
+		std::cout << clr::red << "Unknown benchmark: " << clr::pinkish << name << clr::reset << ", available: dispatch, skip, lzma" << std::endl;
+		return false;
+	}
+	return true;
 }
+}; // namespace Benchmark
 
 static LONG WINAPI ExceptionFilter( _EXCEPTION_POINTERS* pExceptionInfo )
 {
@@ -1521,14 +3337,32 @@ int main( int argc, const char* argv[] )
 	}
 
 	cmdLine.overview = "Source shader compiler.";
-	cmdLine.syntax   = "ShaderCompile [OPTIONS] file.fxc";
+	cmdLine.syntax   = "ShaderCompile [OPTIONS] file.fxc\n       ShaderCompile [OPTIONS] -shaderlist shaders.txt";
 	cmdLine.add( "", true, 1, 0, "Sets shader version", "-ver", "/ver" );
 	cmdLine.add( "", true, 1, 0, "Base path for shaders", "-shaderpath", "/shaderpath" );
+	cmdLine.add( "", false, 1, 0, "Compile every shader listed in the file (one per line) in a single run", "-shaderlist", "/shaderlist" );
 	cmdLine.add( "", false, 0, 0, "Skip crc check during compilation", "-force", "/force" );
 	cmdLine.add( "", false, 0, 0, "Calculate crc for shader", "-crc", "/crc" );
 	cmdLine.add( "", false, 0, 0, "Generate only header", "-dynamic", "/dynamic" );
 	cmdLine.add( "", false, 0, 0, "Stop on first error", "-fastfail", "/fastfail" );
 	cmdLine.add( "0", false, 1, 0, "Number of threads used, defaults to core count", "-threads", "/threads" );
+	cmdLine.add( "d3dcompiler", false, 1, 0, "Compiler backend: d3dcompiler or synthetic (fake bytecode, for pipeline benchmarking)", "-backend", "/backend" );
+	cmdLine.add( "2048", false, 1, 0, "Synthetic backend: default bytecode size in bytes", "-synth-size" );
+	cmdLine.add( "0", false, 1, 0, "Synthetic backend: default compile latency in microseconds", "-synth-latency" );
+	cmdLine.add( "", false, 1, 0, "Keeps compiled combos in this directory and reuses them across runs", "-cache", "/cache" );
+	cmdLine.add( "4096", false, 1, 0, "Size limit of the -cache directory in MiB, least recently used combos get evicted", "-cache-size" );
+	cmdLine.add( "", false, 0, 0, "Preprocesses every combo and compiles each distinct preprocessed text only once", "-preprocess-dedup" );
+	cmdLine.add( "auto", false, 1, 0, "How combos are split between threads: static (a thread compiles and packs whole static combos), chunked or auto", "-schedule" );
+	cmdLine.add( "auto", false, 1, 0, "Threads out of -threads that compress the packed combos, 0 compresses on the compile threads, auto uses a quarter of them", "-compress-threads" );
+	cmdLine.add( "default", false, 1, 0, "LZMA settings: fast (for iterating), default or ultra (smallest vcs files, for release builds)", "-lzma-profile" );
+	cmdLine.add( "", false, 1, 0, "LZMA compression level 0-9, overrides the one of -lzma-profile", "-lzma-level" );
+	cmdLine.add( "", false, 1, 0, "LZMA dictionary size in KiB, defaults to the size of a block", "-lzma-dict" );
+	cmdLine.add( "", false, 1, 0, "LZMA match finder: hc4 (fast), bt2, bt3 or bt4, defaults to the one of the level", "-lzma-mf" );
+	cmdLine.add( "auto", false, 1, 0, "Runs the LZMA match finder of the compression threads on two threads of its own: on, off or auto (once compiling is done)", "-lzma-mt" );
+	cmdLine.add( "", false, 0, 0, "Picks the LZMA lc/lp/pb and dictionary per shader by trial compressing some of its blocks, for release builds", "-lzma-tune" );
+	cmdLine.add( "", false, 1, 0, "Runs a pipeline micro-benchmark instead of compiling: dispatch, skip, lzma (packs the compiled shader files given, synthetic ones without)", "-benchmark" );
+	cmdLine.add( "", false, 1, 0, "Counts the combos left after SKIP instead of compiling and writes a JSON report to the file, - for stdout", "-dry-run" );
+	cmdLine.add( "", false, 0, 0, "Reports what every SKIP line removes and what it costs to evaluate instead of compiling, goes into the -dry-run report as well", "-skip-report" );
 	cmdLine.add( "", false, 0, 0, "Shows help", "-help", "-h", "/help", "/h" );
 
 	cmdLine.add( "", false, 0, 0, "Verbose file cache and final shader info", "-verbose", "/verbose" );
@@ -1605,8 +3439,95 @@ int main( int argc, const char* argv[] )
 		break;
 	}
 
+	{
+		LzmaEncProps_Init( &g_LzmaProps );
+		g_LzmaProps.numThreads = 1;
+
+		std::string profile;
+		cmdLine.get( "-lzma-profile" )->getString( profile );
+		if ( profile == "fast" )
+			g_LzmaProps.level = 1;
+		else if ( profile == "ultra" )
+		{
+			g_LzmaProps.level = 9;
+			g_LzmaProps.fb    = LZMA_MATCH_LEN_MAX;
+		}
+		else if ( profile != "default" )
+		{
+			std::cout << clr::red << "Unknown LZMA profile: " << clr::pinkish << profile << clr::reset << ", available: fast, default, ultra" << std::endl;
+			return -1;
+		}
+
+		if ( cmdLine.isSet( "-lzma-level" ) )
+		{
+			int level;
+			cmdLine.get( "-lzma-level" )->getInt( level );
+			if ( level < 0 || level > 9 )
+			{
+				std::cout << clr::red << "Invalid LZMA level: " << clr::pinkish << level << clr::reset << std::endl;
+				return -1;
+			}
+			g_LzmaProps.level = level;
+		}
+
+		// Every block gets compressed on its own, so by default the dictionary doesn't go past one
+		if ( cmdLine.isSet( "-lzma-dict" ) )
+		{
+			unsigned long dictSize;
+			cmdLine.get( "-lzma-dict" )->getULong( dictSize );
+			if ( dictSize < 4 || dictSize > ( 1 << 20 ) )
+			{
+				std::cout << clr::red << "Invalid LZMA dictionary size: " << clr::pinkish << dictSize << clr::reset << " KiB" << std::endl;
+				return -1;
+			}
+			g_LzmaProps.dictSize = dictSize * 1024;
+		}
+		else
+			g_LzmaProps.reduceSize = MAX_SHADER_UNPACKED_BLOCK_SIZE;
+
+		std::string mf;
+		cmdLine.get( "-lzma-mf" )->getString( mf );
+		if ( mf == "hc4" )
+			g_LzmaProps.btMode = 0;
+		else if ( mf == "bt2" || mf == "bt3" || mf == "bt4" )
+		{
+			g_LzmaProps.btMode       = 1;
+			g_LzmaProps.numHashBytes = mf[2] - '0';
+		}
+		else if ( !mf.empty() )
+		{
+			std::cout << clr::red << "Unknown LZMA match finder: " << clr::pinkish << mf << clr::reset << ", available: hc4, bt2, bt3, bt4" << std::endl;
+			return -1;
+		}
+
+		std::string mt;
+		cmdLine.get( "-lzma-mt" )->getString( mt );
+		if ( mt == "on" )
+			g_eLzmaMt = LzmaMt::On;
+		else if ( mt == "off" )
+			g_eLzmaMt = LzmaMt::Off;
+		else if ( mt != "auto" )
+		{
+			std::cout << clr::red << "Invalid -lzma-mt: " << clr::pinkish << mt << clr::reset << ", available: auto, on, off" << std::endl;
+			return -1;
+		}
+
+		// Only the binary tree match finder of the normal mode runs on threads
+		CLzmaEncProps props = g_LzmaProps;
+		LzmaEncProps_Normalize( &props );
+		if ( !props.algo || !props.btMode )
+			g_eLzmaMt = LzmaMt::Off;
+	}
+
+	if ( cmdLine.isSet( "-benchmark" ) )
+	{
+		std::string benchmark;
+		cmdLine.get( "-benchmark" )->getString( benchmark );
+		return Benchmark::Run( benchmark ) ? 0 : -1;
+	}
+
 	std::vector<std::string> badOptions;
-	if ( !cmdLine.gotRequired( badOptions ) || cmdLine.lastArgs.size() != 1 )
+	if ( !cmdLine.gotRequired( badOptions ) || cmdLine.lastArgs.size() != ( cmdLine.isSet( "-shaderlist" ) ? 0 : 1 ) )
 	{
 		std::cout << clr::red << clr::bold << "ERROR: Missing argument" << ( badOptions.size() == 1 ? ": " : "s:\n" ) << clr::reset;
 		for ( const auto& option : badOptions )
@@ -1634,34 +3555,117 @@ int main( int argc, const char* argv[] )
 	cmdLine.get( "-shaderpath" )->getString( g_pShaderPath );
 	if ( cmdLine.isSet( "-crc" ) )
 	{
-		const std::string name = Parser::ConstructName( fs::path( *cmdLine.lastArgs[0] ).filename().string(), g_pShaderVersion );
-		uint32_t crc = 0;
-		Parser::CheckCrc( ( fs::path( g_pShaderPath ) / *cmdLine.lastArgs[0] ).string(), name, crc );
-		std::cout << crc << std::endl;
+		for ( const std::string& shaderFile : GetShaderFiles() )
+		{
+			const std::string name = Parser::ConstructName( fs::path( shaderFile ).filename().string(), g_pShaderVersion );
+			uint32_t crc = 0;
+			Parser::CheckCrc( ( fs::path( g_pShaderPath ) / shaderFile ).string(), name, crc );
+			std::cout << crc << std::endl;
+		}
 		return 0;
 	}
 
 	if ( cmdLine.isSet( "-dynamic" ) )
 	{
 		using namespace std::literals;
-		std::vector<Parser::Combo> static_c, dynamic_c;
-		std::vector<std::string> skip;
-		uint32_t centroid_mask = 0;
-		std::vector<std::string> includes;
-
-		if ( !Parser::ParseFile( ( fs::path( g_pShaderPath ) / *cmdLine.lastArgs[0] ).string(), g_pShaderVersion, static_c, dynamic_c, skip, centroid_mask, includes ) )
+		bool bFailed = false;
+		for ( const std::string& shaderFile : GetShaderFiles() )
 		{
-			std::cout << clr::red << "Failed to parse " << *cmdLine.lastArgs[0] << clr::reset << std::endl;
-			return -1;
+			std::vector<Parser::Combo> static_c, dynamic_c;
+			std::vector<std::string> skip;
+			uint32_t centroid_mask = 0;
+			std::vector<std::string> includes;
+
+			if ( !Parser::ParseFile( ( fs::path( g_pShaderPath ) / shaderFile ).string(), g_pShaderVersion, static_c, dynamic_c, skip, centroid_mask, includes ) )
+			{
+				std::cout << clr::red << "Failed to parse " << shaderFile << clr::reset << std::endl;
+				bFailed = true;
+				continue;
+			}
+			const std::string name = Parser::ConstructName( fs::path( shaderFile ).filename().string(), g_pShaderVersion );
+			Parser::WriteInclude( ( fs::path( g_pShaderPath ) / "fxctmp9"sv / ( name + ".inc" ) ).string(), name, static_c, dynamic_c, skip );
 		}
-		const std::string name = Parser::ConstructName( fs::path( *cmdLine.lastArgs[0] ).filename().string(), g_pShaderVersion );
-		Parser::WriteInclude( ( fs::path( g_pShaderPath ) / "fxctmp9"sv / ( name + ".inc" ) ).string(), name, static_c, dynamic_c, skip );
-		return 0;
+		return bFailed ? -1 : 0;
+	}
+
+	if ( cmdLine.isSet( "-dry-run" ) || cmdLine.isSet( "-skip-report" ) )
+	{
+		std::string reportFile;
+		if ( cmdLine.isSet( "-dry-run" ) )
+			cmdLine.get( "-dry-run" )->getString( reportFile );
+		return DryRun::Run( reportFile, cmdLine.isSet( "-skip-report" ) );
 	}
 
 	g_bVerbose = cmdLine.isSet( "-verbose" );
 	g_bVerbose2 = cmdLine.isSet( "-verbose2" );
 	g_bFastFail = cmdLine.isSet( "-fastfail" );
+	PreprocessDedup::s_bEnabled = cmdLine.isSet( "-preprocess-dedup" );
+	LzmaTune::s_bEnabled        = cmdLine.isSet( "-lzma-tune" );
+
+	{
+		std::string schedule;
+		cmdLine.get( "-schedule" )->getString( schedule );
+		if ( schedule == "static" )
+			g_eSchedule = Schedule::Static;
+		else if ( schedule == "chunked" )
+			g_eSchedule = Schedule::Chunked;
+		else if ( schedule != "auto" )
+		{
+			std::cout << clr::red << "Unknown schedule: " << clr::pinkish << schedule << clr::reset << ", available: auto static chunked" << std::endl;
+			return -1;
+		}
+	}
+
+	{
+		std::string compressThreads;
+		cmdLine.get( "-compress-threads" )->getString( compressThreads );
+		// A quarter of the budget, nothing below 4 threads, where the compile threads compress themselves
+		if ( compressThreads == "auto" )
+			g_nCompressThreads = ThreadBudget() / 4;
+		else
+		{
+			char* pEnd;
+			const unsigned long nThreads = strtoul( compressThreads.c_str(), &pEnd, 10 );
+			if ( compressThreads.empty() || *pEnd || nThreads > 256 )
+			{
+				std::cout << clr::red << "Invalid number of compression threads: " << clr::pinkish << compressThreads << clr::reset << std::endl;
+				return -1;
+			}
+			// At least one thread is left to compile
+			g_nCompressThreads = std::min<uint32_t>( nThreads, ThreadBudget() - 1 );
+		}
+	}
+
+	{
+		std::string backend;
+		cmdLine.get( "-backend" )->getString( backend );
+		if ( !InterceptFxc::SetActiveBackend( backend.c_str() ) )
+		{
+			std::cout << clr::red << "Unknown compiler backend: " << clr::pinkish << backend << clr::reset << ", available:";
+			for ( const char* szName : InterceptFxc::GetBackendNames() )
+				std::cout << " " << szName;
+			std::cout << std::endl;
+			return -1;
+		}
+
+		unsigned long synthSize, synthLatency;
+		cmdLine.get( "-synth-size" )->getULong( synthSize );
+		cmdLine.get( "-synth-latency" )->getULong( synthLatency );
+		InterceptFxc::SetSyntheticDefaults( synthSize, synthLatency );
+	}
+
+	if ( cmdLine.isSet( "-cache" ) )
+	{
+		std::string cacheDir;
+		cmdLine.get( "-cache" )->getString( cacheDir );
+		unsigned long long cacheSize;
+		cmdLine.get( "-cache-size" )->getULongLong( cacheSize );
+		if ( !ShaderCache::Init( cacheDir, cacheSize << 20 ) )
+		{
+			std::cout << clr::red << "Can't use cache directory " << clr::pinkish << cacheDir << clr::reset << std::endl;
+			return -1;
+		}
+	}
 
 	// Setting up the minidump handlers
 	SetUnhandledExceptionFilter( ExceptionFilter );
@@ -0,0 +1,86 @@
+﻿#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking FIFO between pipeline stages. Push waits while the queue is full,
+// which throttles the producers down to the speed of the consumer.
+template <typename T>
+class CBoundedQueue
+{
+public:
+	explicit CBoundedQueue( size_t nCapacity ) noexcept : m_nCapacity( nCapacity ), m_bClosed( false ) {}
+
+	// Returns false if the queue got closed while waiting for space
+	bool Push( T value )
+	{
+		std::unique_lock lock( m_mtx );
+		m_cvNotFull.wait( lock, [this] { return m_bClosed || m_items.size() < m_nCapacity; } );
+		if ( m_bClosed )
+			return false;
+
+		m_items.emplace_back( std::move( value ) );
+		lock.unlock();
+		m_cvNotEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false instead of waiting if the queue is full or closed
+	bool TryPush( T& value )
+	{
+		std::unique_lock lock( m_mtx );
+		if ( m_bClosed || m_items.size() >= m_nCapacity )
+			return false;
+
+		m_items.emplace_back( std::move( value ) );
+		lock.unlock();
+		m_cvNotEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue is closed and drained
+	bool Pop( T& value )
+	{
+		std::unique_lock lock( m_mtx );
+		m_cvNotEmpty.wait( lock, [this] { return m_bClosed || !m_items.empty(); } );
+		if ( m_items.empty() )
+			return false;
+
+		value = std::move( m_items.front() );
+		m_items.pop_front();
+		lock.unlock();
+		m_cvNotFull.notify_one();
+		return true;
+	}
+
+	[[nodiscard]] size_t Size()
+	{
+		std::lock_guard lock( m_mtx );
+		return m_items.size();
+	}
+
+	[[nodiscard]] size_t Capacity() const noexcept { return m_nCapacity; }
+
+	// No more pushes, pops still return the remaining items
+	void Close()
+	{
+		{
+			std::lock_guard lock( m_mtx );
+			m_bClosed = true;
+		}
+		m_cvNotEmpty.notify_all();
+		m_cvNotFull.notify_all();
+	}
+
+private:
+	std::mutex m_mtx;
+	std::condition_variable m_cvNotEmpty;
+	std::condition_variable m_cvNotFull;
+	std::deque<T> m_items;
+	size_t m_nCapacity;
+	bool m_bClosed;
+};
+
+#endif // BOUNDEDQUEUE_HPP
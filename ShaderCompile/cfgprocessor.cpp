@@ -15,16 +15,23 @@
 
 #include "cfgprocessor.h"
 #include "d3dxfxc.h"
+#include "shadercache.h"
 
 #include "utlbuffer.h"
 #include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
 #include <concepts>
 #include <cstdarg>
 #include <ctime>
-#include <map>
+#include <deque>
+#include <emmintrin.h>
+#include <intrin.h>
 #include <numeric>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <fstream>
@@ -90,16 +97,505 @@ public:
 	virtual int GetVariableSlot( char const* szVariableName ) const noexcept	= 0;
 };
 
+//
+// Skip predicate flattened into a postfix program. Evaluating it is a tight loop over
+// the variable slots instead of a virtual call per tree node and per variable.
+//
+class CSkipProgram
+{
+public:
+	enum Op : uint8_t
+	{
+		OP_CONST,
+		OP_VAR,
+		OP_NOT,
+		OP_AND,
+		OP_OR,
+		OP_EQ,
+		OP_NEQ,
+		OP_G,
+		OP_GE,
+		OP_L,
+		OP_LE,
+		OP_VAR_EQ, // Variable compared with a constant, same order as the comparisons above
+		OP_VAR_NEQ,
+		OP_VAR_G,
+		OP_VAR_GE,
+		OP_VAR_L,
+		OP_VAR_LE,
+		OP_JUMP_IF_FALSE, // Short-circuit &&: jumps if the top is 0, leaving it there
+		OP_JUMP_IF_TRUE,  // Short-circuit ||: jumps if the top is not 0, leaving a 1 there
+	};
+
+	// Combos evaluated at once by EvaluateLanes
+	static constexpr uint32_t LANES = 16;
+	// Stands in for the size of a program too deep to flatten
+	static constexpr size_t MAX_SIZE = 64;
+
+	void Clear() noexcept
+	{
+		m_arrCode.clear();
+		m_arrSlots.clear();
+		m_nDepth = m_nMaxDepth = 0;
+		m_nLastTarget = 0;
+		m_pFixedVars  = nullptr;
+		m_pFixedSlots = nullptr;
+	}
+
+	// Partial evaluation: the variables flagged in pFixedSlots get emitted as their
+	// values in pVars and folded away. Both have to outlive the emitting.
+	void SetFixedVariables( const int* pVars, const uint8_t* pFixedSlots ) noexcept
+	{
+		m_pFixedVars  = pVars;
+		m_pFixedSlots = pFixedSlots;
+	}
+
+	void EmitVariable( int nSlot )
+	{
+		if ( m_pFixedSlots && m_pFixedSlots[nSlot] )
+			Emit( OP_CONST, m_pFixedVars[nSlot] );
+		else
+			Emit( OP_VAR, nSlot );
+	}
+
+	// Lets an expression take back what it emitted, once it turned out constant
+	struct Mark
+	{
+		size_t nSize;
+		int nDepth;
+	};
+	[[nodiscard]] Mark GetMark() const noexcept { return Mark { m_arrCode.size(), m_nDepth }; }
+	void Rewind( const Mark& mark ) noexcept
+	{
+		m_arrCode.resize( mark.nSize );
+		m_nDepth      = mark.nDepth;
+		m_nLastTarget = std::min( m_nLastTarget, mark.nSize );
+	}
+	[[nodiscard]] bool IsConstantSince( const Mark& mark, int& rValue ) const noexcept
+	{
+		if ( m_arrCode.size() != mark.nSize + 1 || m_arrCode.back().op != OP_CONST )
+			return false;
+		rValue = m_arrCode.back().arg;
+		return true;
+	}
+	// The whole program folded into a constant
+	[[nodiscard]] bool IsConstant( int& rValue ) const noexcept { return IsConstantSince( Mark { 0, 0 }, rValue ); }
+
+	void Emit( Op op, int arg = 0 )
+	{
+		switch ( op )
+		{
+		case OP_VAR:
+			if ( std::find( m_arrSlots.begin(), m_arrSlots.end(), arg ) == m_arrSlots.end() )
+				m_arrSlots.emplace_back( arg );
+			[[fallthrough]];
+		case OP_CONST:
+			m_nMaxDepth = std::max( m_nMaxDepth, ++m_nDepth );
+			break;
+		case OP_NOT: // !$VAR is $VAR == 0
+			if ( CanFuse( 1 ) && m_arrCode.back().op == OP_VAR )
+			{
+				m_arrCode.back() = Instruction { OP_VAR_EQ, m_arrCode.back().arg, 0 };
+				return;
+			}
+			if ( CanFuse( 1 ) && m_arrCode.back().op == OP_CONST )
+			{
+				m_arrCode.back().arg = !m_arrCode.back().arg;
+				return;
+			}
+			break;
+		case OP_EQ:
+		case OP_NEQ:
+		case OP_G:
+		case OP_GE:
+		case OP_L:
+		case OP_LE:
+			--m_nDepth;
+			if ( CanFuse( 2 ) && m_arrCode.end()[-2].op == OP_VAR && m_arrCode.back().op == OP_CONST )
+			{
+				const int nSlot = m_arrCode.end()[-2].arg;
+				const int value = m_arrCode.back().arg;
+				m_arrCode.pop_back();
+				m_arrCode.back() = Instruction { static_cast<Op>( op - OP_EQ + OP_VAR_EQ ), nSlot, value };
+				return;
+			}
+			if ( CanFuse( 2 ) && m_arrCode.end()[-2].op == OP_CONST && m_arrCode.back().op == OP_CONST )
+			{
+				const int value = Compare( op, m_arrCode.end()[-2].arg, m_arrCode.back().arg );
+				m_arrCode.pop_back();
+				m_arrCode.back().arg = value;
+				return;
+			}
+			break;
+		case OP_JUMP_IF_FALSE: // The operand stays for the OP_AND/OP_OR that follows
+		case OP_JUMP_IF_TRUE:
+			break;
+		default:
+			--m_nDepth;
+			break;
+		}
+
+		m_arrCode.emplace_back( Instruction { op, arg, 0 } );
+	}
+
+	// Returns the jump to patch once its target got emitted
+	[[nodiscard]] size_t EmitJump( Op op )
+	{
+		Emit( op );
+		return m_arrCode.size() - 1;
+	}
+	void PatchJump( size_t iJump ) noexcept
+	{
+		m_nLastTarget        = m_arrCode.size();
+		m_arrCode[iJump].arg = gsl::narrow<int>( m_nLastTarget );
+	}
+
+	// A jump landing on a jump of the same kind takes that one too, so a chain of
+	// ||s or &&s exits in one step. Jumps only go forward, so walk back to front.
+	void ThreadJumps() noexcept
+	{
+		for ( size_t i = m_arrCode.size(); i-- > 0; )
+		{
+			Instruction& ins = m_arrCode[i];
+			if ( ( ins.op == OP_JUMP_IF_FALSE || ins.op == OP_JUMP_IF_TRUE ) && static_cast<size_t>( ins.arg ) < m_arrCode.size() && m_arrCode[ins.arg].op == ins.op )
+				ins.arg = m_arrCode[ins.arg].arg;
+		}
+	}
+
+	[[nodiscard]] bool IsValid() const noexcept { return !m_arrCode.empty() && m_nDepth == 1 && m_nMaxDepth <= MAX_DEPTH; }
+	// Variable slots the program reads
+	[[nodiscard]] const std::vector<int>& UsedSlots() const noexcept { return m_arrSlots; }
+	[[nodiscard]] size_t Size() const noexcept { return m_arrCode.size(); }
+
+	// Programs with the same code, residual programs that came out the same are one case
+	[[nodiscard]] bool operator==( const CSkipProgram& x ) const noexcept { return m_arrCode == x.m_arrCode; }
+	[[nodiscard]] size_t Hash() const noexcept
+	{
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for ( const Instruction& ins : m_arrCode )
+			h = ( h ^ ( static_cast<uint64_t>( ins.op ) | static_cast<uint64_t>( static_cast<uint32_t>( ins.arg ) ) << 8 ) ^ static_cast<uint64_t>( static_cast<uint32_t>( ins.value ) ) << 40 ) * 0x100000001b3ULL;
+		return static_cast<size_t>( h );
+	}
+
+	[[nodiscard]] int Evaluate( const int* pVars ) const noexcept
+	{
+		int stack[MAX_DEPTH];
+		int* pTop = stack - 1;
+
+		const Instruction* const pBegin = m_arrCode.data();
+		const Instruction* const pEnd   = pBegin + m_arrCode.size();
+		for ( const Instruction* pIns = pBegin; pIns < pEnd; ++pIns )
+		{
+			switch ( pIns->op )
+			{
+			case OP_CONST:
+				*++pTop = pIns->arg;
+				break;
+			case OP_VAR:
+				*++pTop = pVars[pIns->arg];
+				break;
+			case OP_NOT:
+				*pTop = !*pTop;
+				break;
+			case OP_AND:
+				--pTop;
+				*pTop = pTop[0] && pTop[1];
+				break;
+			case OP_OR:
+				--pTop;
+				*pTop = pTop[0] || pTop[1];
+				break;
+			case OP_EQ:
+				--pTop;
+				*pTop = pTop[0] == pTop[1];
+				break;
+			case OP_NEQ:
+				--pTop;
+				*pTop = pTop[0] != pTop[1];
+				break;
+			case OP_G:
+				--pTop;
+				*pTop = pTop[0] > pTop[1];
+				break;
+			case OP_GE:
+				--pTop;
+				*pTop = pTop[0] >= pTop[1];
+				break;
+			case OP_L:
+				--pTop;
+				*pTop = pTop[0] < pTop[1];
+				break;
+			case OP_LE:
+				--pTop;
+				*pTop = pTop[0] <= pTop[1];
+				break;
+			case OP_VAR_EQ:
+				*++pTop = pVars[pIns->arg] == pIns->value;
+				break;
+			case OP_VAR_NEQ:
+				*++pTop = pVars[pIns->arg] != pIns->value;
+				break;
+			case OP_VAR_G:
+				*++pTop = pVars[pIns->arg] > pIns->value;
+				break;
+			case OP_VAR_GE:
+				*++pTop = pVars[pIns->arg] >= pIns->value;
+				break;
+			case OP_VAR_L:
+				*++pTop = pVars[pIns->arg] < pIns->value;
+				break;
+			case OP_VAR_LE:
+				*++pTop = pVars[pIns->arg] <= pIns->value;
+				break;
+			case OP_JUMP_IF_FALSE:
+				if ( !*pTop )
+					pIns = pBegin + pIns->arg - 1;
+				break;
+			case OP_JUMP_IF_TRUE:
+				if ( *pTop )
+				{
+					*pTop = 1;
+					pIns  = pBegin + pIns->arg - 1;
+				}
+				break;
+			}
+		}
+
+		return *pTop;
+	}
+
+	//
+	// Evaluates LANES combos at once with SSE2. pVarLanes holds LANES values for every
+	// variable slot, one after another. Jumps are only taken when all the lanes agree,
+	// otherwise both sides get evaluated and combined by the OP_AND/OP_OR.
+	// Returns the mask of lanes the predicate is true for.
+	//
+	[[nodiscard]] uint32_t EvaluateLanes( const int* pVarLanes ) const noexcept
+	{
+		constexpr uint32_t VECTORS = LANES / 4;
+		struct Lanes
+		{
+			__m128i v[VECTORS];
+		};
+
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one  = _mm_set1_epi32( 1 );
+
+		// Lanes holding 0, one bit per lane
+		const auto& ZeroMask = [zero]( const Lanes& x ) noexcept {
+			uint32_t mask = 0;
+			for ( uint32_t j = 0; j < VECTORS; ++j )
+				mask |= static_cast<uint32_t>( _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( x.v[j], zero ) ) ) ) << ( j * 4 );
+			return mask;
+		};
+		const auto& Load = [pVarLanes]( Lanes& x, int nSlot ) noexcept {
+			for ( uint32_t j = 0; j < VECTORS; ++j )
+				x.v[j] = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pVarLanes + nSlot * LANES + j * 4 ) );
+		};
+		const auto& Set = []( Lanes& x, int value ) noexcept {
+			for ( uint32_t j = 0; j < VECTORS; ++j )
+				x.v[j] = _mm_set1_epi32( value );
+		};
+		// Leaves 0 or 1 in x, like the scalar comparisons
+		const auto& Compare = [one]( Lanes& x, const Lanes& y, Op op ) noexcept {
+			switch ( op )
+			{
+			case OP_EQ:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					x.v[j] = _mm_and_si128( _mm_cmpeq_epi32( x.v[j], y.v[j] ), one );
+				break;
+			case OP_NEQ:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					x.v[j] = _mm_andnot_si128( _mm_cmpeq_epi32( x.v[j], y.v[j] ), one );
+				break;
+			case OP_G:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					x.v[j] = _mm_and_si128( _mm_cmpgt_epi32( x.v[j], y.v[j] ), one );
+				break;
+			case OP_GE:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					x.v[j] = _mm_andnot_si128( _mm_cmplt_epi32( x.v[j], y.v[j] ), one );
+				break;
+			case OP_L:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					x.v[j] = _mm_and_si128( _mm_cmplt_epi32( x.v[j], y.v[j] ), one );
+				break;
+			default:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					x.v[j] = _mm_andnot_si128( _mm_cmpgt_epi32( x.v[j], y.v[j] ), one );
+				break;
+			}
+		};
+
+		Lanes stack[MAX_DEPTH];
+		Lanes* pTop = stack - 1;
+		Lanes constant;
+
+		const Instruction* const pBegin = m_arrCode.data();
+		const Instruction* const pEnd   = pBegin + m_arrCode.size();
+		for ( const Instruction* pIns = pBegin; pIns < pEnd; ++pIns )
+		{
+			switch ( pIns->op )
+			{
+			case OP_CONST:
+				Set( *++pTop, pIns->arg );
+				break;
+			case OP_VAR:
+				Load( *++pTop, pIns->arg );
+				break;
+			case OP_NOT:
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					pTop->v[j] = _mm_and_si128( _mm_cmpeq_epi32( pTop->v[j], zero ), one );
+				break;
+			case OP_AND:
+				--pTop;
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					pTop->v[j] = _mm_andnot_si128( _mm_or_si128( _mm_cmpeq_epi32( pTop[0].v[j], zero ), _mm_cmpeq_epi32( pTop[1].v[j], zero ) ), one );
+				break;
+			case OP_OR:
+				--pTop;
+				for ( uint32_t j = 0; j < VECTORS; ++j )
+					pTop->v[j] = _mm_andnot_si128( _mm_and_si128( _mm_cmpeq_epi32( pTop[0].v[j], zero ), _mm_cmpeq_epi32( pTop[1].v[j], zero ) ), one );
+				break;
+			case OP_EQ:
+			case OP_NEQ:
+			case OP_G:
+			case OP_GE:
+			case OP_L:
+			case OP_LE:
+				--pTop;
+				Compare( pTop[0], pTop[1], pIns->op );
+				break;
+			case OP_VAR_EQ:
+			case OP_VAR_NEQ:
+			case OP_VAR_G:
+			case OP_VAR_GE:
+			case OP_VAR_L:
+			case OP_VAR_LE:
+				Load( *++pTop, pIns->arg );
+				Set( constant, pIns->value );
+				Compare( *pTop, constant, static_cast<Op>( pIns->op - OP_VAR_EQ + OP_EQ ) );
+				break;
+			case OP_JUMP_IF_FALSE:
+				if ( ZeroMask( *pTop ) == ( 1u << LANES ) - 1 )
+					pIns = pBegin + pIns->arg - 1;
+				break;
+			case OP_JUMP_IF_TRUE:
+				if ( !ZeroMask( *pTop ) )
+				{
+					Set( *pTop, 1 );
+					pIns = pBegin + pIns->arg - 1;
+				}
+				break;
+			}
+		}
+
+		return ~ZeroMask( *pTop ) & ( ( 1u << LANES ) - 1 );
+	}
+
+private:
+	static constexpr int MAX_DEPTH = 32;
+
+	// The last n instructions can be folded into one unless a jump lands in between
+	[[nodiscard]] bool CanFuse( size_t n ) const noexcept { return m_arrCode.size() >= n && m_nLastTarget <= m_arrCode.size() - n; }
+
+	[[nodiscard]] static int Compare( Op op, int x, int y ) noexcept
+	{
+		switch ( op )
+		{
+		case OP_EQ:
+			return x == y;
+		case OP_NEQ:
+			return x != y;
+		case OP_G:
+			return x > y;
+		case OP_GE:
+			return x >= y;
+		case OP_L:
+			return x < y;
+		default:
+			return x <= y;
+		}
+	}
+
+	struct Instruction
+	{
+		Op op;
+		int arg;   // constant, variable slot or jump target
+		int value; // constant the variable is compared with
+
+		bool operator==( const Instruction& ) const noexcept = default;
+	};
+
+	std::vector<Instruction> m_arrCode;
+	std::vector<int> m_arrSlots;
+	int m_nDepth         = 0;
+	int m_nMaxDepth      = 0;
+	size_t m_nLastTarget = 0;
+
+	const int* m_pFixedVars      = nullptr;
+	const uint8_t* m_pFixedSlots = nullptr;
+};
+
 class IExpression
 {
 public:
 	virtual ~IExpression()												= default;
 	virtual int Evaluate( const IEvaluationContext* pCtx ) const noexcept		= 0;
 	virtual void Print( const IEvaluationContext* pCtx ) const			= 0;
+	virtual void Emit( CSkipProgram& program ) const					= 0;
 };
 
 #define EVAL int Evaluate( [[maybe_unused]] const IEvaluationContext* pCtx ) const noexcept override
 #define PRNT void Print( [[maybe_unused]] const IEvaluationContext* pCtx ) const override
+#define EMIT void Emit( [[maybe_unused]] CSkipProgram& program ) const override
+
+// && and || with a short-circuit jump, an operand that came out constant gets folded.
+// The parser nests chains to the right, starting with y keeps the stack flat.
+static void EmitLogical( CSkipProgram& program, const IExpression* pX, const IExpression* pY, bool bAnd )
+{
+	const auto& IsDecisive = [bAnd]( int value ) noexcept { return bAnd ? !value : value != 0; };
+	const CSkipProgram::Mark start = program.GetMark();
+	int value;
+
+	pY->Emit( program );
+	if ( program.IsConstantSince( start, value ) )
+	{
+		program.Rewind( start );
+		if ( IsDecisive( value ) )
+			program.Emit( CSkipProgram::OP_CONST, !bAnd );
+		else
+		{
+			pX->Emit( program );
+			program.Emit( CSkipProgram::OP_CONST, 0 );
+			program.Emit( CSkipProgram::OP_NEQ );
+		}
+		return;
+	}
+
+	const CSkipProgram::Mark jump = program.GetMark();
+	const size_t iJump = program.EmitJump( bAnd ? CSkipProgram::OP_JUMP_IF_FALSE : CSkipProgram::OP_JUMP_IF_TRUE );
+	const CSkipProgram::Mark x = program.GetMark();
+	pX->Emit( program );
+	if ( program.IsConstantSince( x, value ) )
+	{
+		if ( IsDecisive( value ) )
+		{
+			program.Rewind( start );
+			program.Emit( CSkipProgram::OP_CONST, !bAnd );
+		}
+		else
+		{
+			program.Rewind( jump );
+			program.Emit( CSkipProgram::OP_CONST, 0 );
+			program.Emit( CSkipProgram::OP_NEQ );
+		}
+		return;
+	}
+
+	program.Emit( bAnd ? CSkipProgram::OP_AND : CSkipProgram::OP_OR );
+	program.PatchJump( iJump );
+}
 
 class CExprConstant : public IExpression
 {
@@ -110,6 +606,7 @@ public:
 	{
 		std::cout << clr::green << m_value << clr::reset;
 	}
+	EMIT { program.Emit( CSkipProgram::OP_CONST, m_value ); }
 
 private:
 	int m_value;
@@ -127,6 +624,13 @@ public:
 		else
 			std::cout << clr::red << "$**@**" << clr::reset;
 	}
+	EMIT
+	{
+		if ( m_nSlot >= 0 )
+			program.EmitVariable( m_nSlot );
+		else
+			program.Emit( CSkipProgram::OP_CONST, 0 );
+	}
 
 private:
 	int m_nSlot;
@@ -159,6 +663,11 @@ BEGIN_EXPR_UNARY( CExprUnary_Negate )
 		std::cout << clr::grey << "!";
 		m_x->Print( pCtx );
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		program.Emit( CSkipProgram::OP_NOT );
+	}
 END_EXPR_UNARY()
 
 class CExprBinary : public IExpression
@@ -198,6 +707,7 @@ BEGIN_EXPR_BINARY( CExprBinary_And )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT { EmitLogical( program, m_x, m_y, true ); }
 	EXPR_BINARY_PRIORITY( 1 );
 END_EXPR_BINARY()
 
@@ -214,6 +724,7 @@ BEGIN_EXPR_BINARY( CExprBinary_Or )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT { EmitLogical( program, m_x, m_y, false ); }
 	EXPR_BINARY_PRIORITY( 2 );
 END_EXPR_BINARY()
 
@@ -230,6 +741,12 @@ BEGIN_EXPR_BINARY( CExprBinary_Eq )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		m_y->Emit( program );
+		program.Emit( CSkipProgram::OP_EQ );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -246,6 +763,12 @@ BEGIN_EXPR_BINARY( CExprBinary_Neq )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		m_y->Emit( program );
+		program.Emit( CSkipProgram::OP_NEQ );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -262,6 +785,12 @@ BEGIN_EXPR_BINARY( CExprBinary_G )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		m_y->Emit( program );
+		program.Emit( CSkipProgram::OP_G );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -278,6 +807,12 @@ BEGIN_EXPR_BINARY( CExprBinary_Ge )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		m_y->Emit( program );
+		program.Emit( CSkipProgram::OP_GE );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -294,6 +829,12 @@ BEGIN_EXPR_BINARY( CExprBinary_L )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		m_y->Emit( program );
+		program.Emit( CSkipProgram::OP_L );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -310,9 +851,17 @@ BEGIN_EXPR_BINARY( CExprBinary_Le )
 		m_y->Print( pCtx );
 		std::cout << clr::grey << " )" << clr::reset;
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		m_y->Emit( program );
+		program.Emit( CSkipProgram::OP_LE );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
+class ComboGenerator;
+
 class CComplexExpression : public IExpression
 {
 public:
@@ -323,11 +872,57 @@ public:
 	}
 	~CComplexExpression() override { Clear(); }
 
-	void Parse( char const* szExpression );
+	// Every SKIP line is a clause of its own, the expression is true if one of them is
+	void Parse( const std::vector<std::string>& clauses );
 	void Clear() noexcept;
 
+	[[nodiscard]] size_t NumClauses() const noexcept { return m_arrClauses.size(); }
+	[[nodiscard]] const std::string& ClauseText( size_t i ) const noexcept { return m_arrClauseText[i]; }
+	[[nodiscard]] const IExpression* Clause( size_t i ) const noexcept { return m_arrClauses[i]; }
+	[[nodiscard]] const std::vector<uint32_t>& ClauseOrder() const noexcept { return m_arrOrder; }
+	int EvaluateClause( size_t i, const IEvaluationContext* pCtx, const int* pVars ) const noexcept
+	{
+		return m_arrClausePrograms[i].IsValid() ? m_arrClausePrograms[i].Evaluate( pVars ) : m_arrClauses[i]->Evaluate( pCtx );
+	}
+
+	// Clauses get evaluated in this order from now on, the first one that is true decides
+	void SetClauseOrder( const std::vector<uint32_t>& order );
+	// Orders the clauses by how often they skip on a sample of the combos, against what they cost to evaluate
+	void OrderClauses( const ComboGenerator& cg );
+
 public:
 	EVAL { return m_pRoot ? m_pRoot->Evaluate( pCtx ? pCtx : m_pContext ) : 0; }
+	EMIT
+	{
+		if ( !m_arrClauses.empty() )
+			EmitClauses( program );
+		else if ( m_pRoot )
+			m_pRoot->Emit( program );
+		else
+			program.Emit( CSkipProgram::OP_CONST, 0 );
+	}
+
+	// Combo iteration goes through here, with the values of the variable slots at hand
+	int EvaluateSlots( const IEvaluationContext* pCtx, const int* pVars ) const noexcept
+	{
+		return s_bCompiledSkip && m_program.IsValid() ? m_program.Evaluate( pVars ) : Evaluate( pCtx );
+	}
+
+	// Program for the block evaluation, nullptr if the expression was too deep to flatten
+	const CSkipProgram* CompiledProgram() const noexcept { return m_program.IsValid() ? &m_program : nullptr; }
+
+	// Partial evaluation for one static combo: the static defines are fixed at their values
+	// in pVars, what is left only depends on dynamic defines or folded into a constant
+	void EmitResidual( const int* pVars, const uint8_t* pStaticSlots, CSkipProgram& residual ) const
+	{
+		residual.Clear();
+		residual.SetFixedVariables( pVars, pStaticSlots );
+		Emit( residual );
+		residual.SetFixedVariables( nullptr, nullptr );
+		residual.ThreadJumps();
+	}
+
+	static bool s_bCompiledSkip;
 	PRNT
 	{
 		std::cout << clr::grey << "[ ";
@@ -339,6 +934,7 @@ public:
 	}
 
 protected:
+	void EmitClauses( CSkipProgram& program ) const;
 	IExpression* ParseTopLevel( char*& szExpression );
 	IExpression* ParseInternal( char*& szExpression );
 	template <typename T, typename... Args, typename = std::void_t<decltype( T( std::declval<Args>()... ) )>>
@@ -354,6 +950,12 @@ protected:
 	std::vector<std::unique_ptr<IExpression>> m_arrAllExpressions;
 	IExpression* m_pRoot;
 	IEvaluationContext* m_pContext;
+	CSkipProgram m_program;
+
+	std::vector<IExpression*> m_arrClauses;
+	std::vector<std::string> m_arrClauseText;
+	std::vector<CSkipProgram> m_arrClausePrograms; // For evaluating the clauses one by one
+	std::vector<uint32_t> m_arrOrder;
 
 	IExpression* m_pDefTrue;
 	IExpression* m_pDefFalse;
@@ -367,27 +969,91 @@ protected:
 
 #undef EVAL
 #undef PRNT
+#undef EMIT
 
-void CComplexExpression::Parse( char const* szExpression )
+bool CComplexExpression::s_bCompiledSkip = true;
+
+void CComplexExpression::Parse( const std::vector<std::string>& clauses )
 {
 	Clear();
 
 	m_pDefTrue  = Expression<CExprConstant>( 1 );
 	m_pDefFalse = Expression<CExprConstant>( 0 );
 
-	m_pRoot = m_pDefFalse;
-
-	if ( szExpression )
+	for ( const std::string& clause : clauses )
 	{
-		std::string qs( szExpression );
+		std::string qs( clause );
 		char* expression		= qs.data();
 		char* const szExpectEnd	= expression + qs.length();
 		char* szParse			= expression;
-		m_pRoot					= ParseTopLevel( szParse );
+		IExpression* pClause	= ParseTopLevel( szParse );
 
 		if ( szParse != szExpectEnd )
-			m_pRoot = m_pDefFalse;
+			pClause = m_pDefFalse;
+
+		m_arrClauses.emplace_back( pClause );
+		m_arrClauseText.emplace_back( clause );
+		CSkipProgram& program = m_arrClausePrograms.emplace_back();
+		pClause->Emit( program );
+		program.ThreadJumps();
+	}
+
+	std::vector<uint32_t> order( m_arrClauses.size() );
+	std::iota( order.begin(), order.end(), 0 );
+	SetClauseOrder( order );
+}
+
+void CComplexExpression::SetClauseOrder( const std::vector<uint32_t>& order )
+{
+	m_arrOrder = order;
+
+	// The tree evaluates x first, so the chain is nested to the right
+	m_pRoot = m_pDefFalse;
+	for ( auto it = m_arrOrder.crbegin(); it != m_arrOrder.crend(); ++it )
+		m_pRoot = Expression<CExprBinary_Or>( m_arrClauses[*it], m_pRoot );
+
+	// Too deep to flatten means the tree keeps doing the work
+	m_program.Clear();
+	Emit( m_program );
+	m_program.ThreadJumps();
+}
+
+// The clauses OR-ed together in evaluation order, jumping out at the first one that is true.
+// Clauses that folded into a constant drop out, or decide it all if they are true.
+void CComplexExpression::EmitClauses( CSkipProgram& program ) const
+{
+	const CSkipProgram::Mark start = program.GetMark();
+	bool bEmitted = false;
+	for ( const uint32_t i : m_arrOrder )
+	{
+		const CSkipProgram::Mark clause = program.GetMark();
+		const size_t iJump = bEmitted ? program.EmitJump( CSkipProgram::OP_JUMP_IF_TRUE ) : 0;
+		const CSkipProgram::Mark x = program.GetMark();
+		m_arrClauses[i]->Emit( program );
+
+		int value;
+		if ( program.IsConstantSince( x, value ) )
+		{
+			if ( value )
+			{
+				program.Rewind( start );
+				program.Emit( CSkipProgram::OP_CONST, 1 );
+				return;
+			}
+			program.Rewind( clause );
+			continue;
+		}
+
+		if ( bEmitted )
+		{
+			program.Emit( CSkipProgram::OP_OR );
+			program.PatchJump( iJump );
+		}
+		bEmitted = true;
 	}
+
+	if ( !bEmitted )
+		program.Emit( CSkipProgram::OP_CONST, 0 );
 }
 
 IExpression* CComplexExpression::ParseTopLevel( char* &szExpression )
@@ -569,6 +1235,11 @@ void CComplexExpression::Clear() noexcept
 {
 	m_arrAllExpressions.clear();
 	m_pRoot = nullptr;
+	m_program.Clear();
+	m_arrClauses.clear();
+	m_arrClauseText.clear();
+	m_arrClausePrograms.clear();
+	m_arrOrder.clear();
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -582,7 +1253,7 @@ class ComboGenerator : public IEvaluationContext
 public:
 	ComboGenerator() = default;
 	ComboGenerator( const ComboGenerator& ) = default;
-	ComboGenerator( ComboGenerator&& old ) noexcept : m_arrDefines( std::move( old.m_arrDefines ) ), m_mapDefines( std::move( old.m_mapDefines ) ), m_arrVarSlots( std::move( old.m_arrVarSlots ) ) {}
+	ComboGenerator( ComboGenerator&& old ) noexcept : m_arrDefines( std::move( old.m_arrDefines ) ), m_mapDefines( std::move( old.m_mapDefines ) ), m_arrVarSlots( std::move( old.m_arrVarSlots ) ), m_arrStaticSlots( std::move( old.m_arrStaticSlots ) ) {}
 
 	void AddDefine( Define const& df );
 	[[nodiscard]] Define const* GetDefinesBase() const noexcept { return m_arrDefines.data(); }
@@ -590,6 +1261,25 @@ public:
 
 	[[nodiscard]] uint64_t NumCombos() const noexcept;
 	[[nodiscard]] uint64_t NumCombos( bool bStaticCombos ) const noexcept;
+	// Dynamic defines come first, then the static ones
+	[[nodiscard]] size_t NumDefines( bool bStatic ) const noexcept
+	{
+		return std::count_if( m_arrDefines.cbegin(), m_arrDefines.cend(), [bStatic]( const Define& d ) noexcept { return d.IsStatic() == bStatic; } );
+	}
+	// 1 for every slot of a static define
+	[[nodiscard]] const uint8_t* StaticSlots() const noexcept { return m_arrStaticSlots.data(); }
+
+	// Values of the defines for the combo at iOffset in command order: the mixed-radix
+	// digits of the offset, counted down from the max values
+	void ValuesAt( uint64_t iOffset, int* pValues ) const noexcept
+	{
+		for ( const Define& d : m_arrDefines )
+		{
+			const uint64_t nInterval = static_cast<uint64_t>( d.Max() ) - d.Min() + 1;
+			*pValues++ = d.Max() - static_cast<int>( iOffset % nInterval );
+			iOffset /= nInterval;
+		}
+	}
 
 	// IEvaluationContext
 public:
@@ -607,6 +1297,7 @@ protected:
 	std::vector<Define> m_arrDefines;
 	std::unordered_map<std::string, int> m_mapDefines;
 	std::vector<int> m_arrVarSlots;
+	std::vector<uint8_t> m_arrStaticSlots;
 };
 
 void ComboGenerator::AddDefine( Define const& df )
@@ -614,6 +1305,7 @@ void ComboGenerator::AddDefine( Define const& df )
 	m_mapDefines.emplace( df.Name(), gsl::narrow<int>( m_arrDefines.size() ) );
 	m_arrDefines.emplace_back( df );
 	m_arrVarSlots.emplace_back( 1 );
+	m_arrStaticSlots.emplace_back( df.IsStatic() );
 }
 
 uint64_t ComboGenerator::NumCombos() const noexcept
@@ -630,32 +1322,718 @@ uint64_t ComboGenerator::NumCombos( bool bStaticCombos ) const noexcept
 		[bStaticCombos]( const Define& d ) noexcept { return d.IsStatic() == bStaticCombos ? static_cast<uint64_t>( d.Max() ) - d.Min() + 1ULL : 1ULL; } );
 }
 
-extern std::string g_pShaderPath;
-extern bool g_bVerbose;
-namespace ConfigurationProcessing
-{
-class CfgEntry
+// Define values kept somewhere else, the names come from the generator
+class CSlotValues final : public IEvaluationContext
 {
 public:
-	CfgEntry() noexcept : m_szName( "" ), m_szShaderSrc( "" ), m_pCg( nullptr ), m_pExpr( nullptr )
+	CSlotValues( const ComboGenerator& cg, const int* pValues ) noexcept : m_cg( cg ), m_pValues( pValues ) {}
+
+	[[nodiscard]] int GetVariableValue( int nSlot ) const noexcept override { return m_pValues[nSlot]; }
+	[[nodiscard]] char const* GetVariableName( int nSlot ) const noexcept override { return m_cg.GetVariableName( nSlot ); }
+	[[nodiscard]] int GetVariableSlot( char const* szVariableName ) const noexcept override { return m_cg.GetVariableSlot( szVariableName ); }
+
+private:
+	const ComboGenerator& m_cg;
+	const int* m_pValues;
+};
+
+void CComplexExpression::OrderClauses( const ComboGenerator& cg )
+{
+	constexpr uint64_t MAX_SAMPLES = 4096;
+
+	const size_t numClauses = m_arrClauses.size();
+	if ( numClauses < 2 )
+		return;
+
+	// How many of the sampled combos every clause skips. The samples step through the combos by
+	// about the golden ratio of them, coprime with their number: a power of two stride would
+	// keep the lowest defines at the same value in every sample of a power of two combo space.
+	const uint64_t numCombos  = cg.NumCombos();
+	const uint64_t numSamples = std::min( numCombos, MAX_SAMPLES );
+	uint64_t nStep = static_cast<uint64_t>( static_cast<double>( numCombos ) * 0.6180339887498949 ) | 1;
+	while ( std::gcd( nStep, numCombos ) != 1 )
+		nStep += 2;
+	nStep %= std::max<uint64_t>( numCombos, 1 );
+
+	std::vector<int> arrValues( cg.GetDefinesEnd() - cg.GetDefinesBase() );
+	const CSlotValues ctx( cg, arrValues.data() );
+	std::vector<uint64_t> arrSkipped( numClauses );
+	for ( uint64_t iSample = 0, iCombo = 0; iSample < numSamples; ++iSample, iCombo = iCombo >= numCombos - nStep ? iCombo - ( numCombos - nStep ) : iCombo + nStep )
 	{
-		memset( &m_eiInfo, 0, sizeof( m_eiInfo ) );
+		cg.ValuesAt( iCombo, arrValues.data() );
+		for ( size_t i = 0; i < numClauses; ++i )
+			arrSkipped[i] += EvaluateClause( i, &ctx, arrValues.data() ) != 0;
 	}
 
-	static void Destroy( CfgEntry const& x ) noexcept
+	// For clauses independent of each other, going by the chance to skip over the
+	// cost of the evaluation gives the lowest expected cost of the whole ||
+	std::vector<double> arrRank( numClauses );
+	for ( size_t i = 0; i < numClauses; ++i )
 	{
-		delete x.m_pCg;
-		delete x.m_pExpr;
+		const size_t nSize = m_arrClausePrograms[i].IsValid() ? m_arrClausePrograms[i].Size() : CSkipProgram::MAX_SIZE;
+		arrRank[i] = static_cast<double>( arrSkipped[i] ) / std::max<size_t>( nSize, 1 );
 	}
 
-public:
-	bool operator<( const CfgEntry& x ) const noexcept { return m_pCg->NumCombos() < x.m_pCg->NumCombos(); }
+	std::vector<uint32_t> order( m_arrOrder );
+	std::stable_sort( order.begin(), order.end(), [&arrRank]( uint32_t a, uint32_t b ) { return arrRank[a] > arrRank[b]; } );
+	SetClauseOrder( order );
+}
+
+extern std::string g_pShaderPath;
+extern bool g_bVerbose;
+namespace ConfigurationProcessing
+{
+//////////////////////////////////////////////////////////////////////////
+//
+// Live combos
+//
+// The combos of a shader that survive the skip expression, worked out up
+// front so the combo iteration goes right from one live combo to the next.
+// Offsets are command numbers relative to the first command of the shader.
+//
+//////////////////////////////////////////////////////////////////////////
+
+class ILiveCombos
+{
+public:
+	virtual ~ILiveCombos() = default;
+
+	[[nodiscard]] virtual bool IsLive( uint64_t iOffset ) const noexcept = 0;
+	// First live offset in [iOffset, iEnd), iEnd if there is none
+	[[nodiscard]] virtual uint64_t FindNext( uint64_t iOffset, uint64_t iEnd ) const noexcept = 0;
+	// Number of live offsets in [iBegin, iEnd)
+	[[nodiscard]] virtual uint64_t Count( uint64_t iBegin, uint64_t iEnd ) const noexcept = 0;
+	// Offset right after the nLive-th live offset from iOffset on, at most iEnd
+	[[nodiscard]] virtual uint64_t Skip( uint64_t iOffset, uint64_t nLive, uint64_t iEnd ) const noexcept = 0;
+};
+
+//
+// One bit per command of a shader, set if the combo is live. Built by running
+// the skip program over blocks of combos, then finding the next live combo is
+// a scan for the next set bit.
+//
+class CLiveCombos final : public ILiveCombos
+{
+public:
+	// Bigger shaders keep evaluating combo by combo, the map would get too big
+	static constexpr uint64_t MAX_COMBOS = 1ULL << 28;
+	// Residual programs kept around per build thread
+	static constexpr uint64_t MAX_RESIDUALS = 1 << 16;
+
+	void Build( const ComboGenerator& cg, const CComplexExpression& expr, const CSkipProgram& program );
+
+	[[nodiscard]] bool IsLive( uint64_t iOffset ) const noexcept override { return ( m_arrBits[iOffset >> 6] >> ( iOffset & 63 ) ) & 1; }
+	[[nodiscard]] uint64_t FindNext( uint64_t iOffset, uint64_t iEnd ) const noexcept override;
+	[[nodiscard]] uint64_t Count( uint64_t iBegin, uint64_t iEnd ) const noexcept override;
+	[[nodiscard]] uint64_t Skip( uint64_t iOffset, uint64_t nLive, uint64_t iEnd ) const noexcept override;
+
+private:
+	void SetBits( uint64_t iOffset, uint64_t bits, uint32_t numBits ) noexcept;
+	void SetRange( uint64_t iOffset, uint64_t n ) noexcept;
+
+	std::vector<uint64_t> m_arrBits;
+};
+
+void CLiveCombos::Build( const ComboGenerator& cg, const CComplexExpression& expr, const CSkipProgram& program )
+{
+	constexpr uint32_t LANES = CSkipProgram::LANES;
+	static_assert( 64 % LANES == 0 );
+
+	const uint64_t numCombos  = cg.NumCombos();
+	const uint64_t numDynamic = cg.NumCombos( false );
+	const uint64_t numStatic  = cg.NumCombos( true );
+	const size_t numWords     = gsl::narrow<size_t>( ( numCombos + 63 ) / 64 );
+	m_arrBits.assign( numWords, 0 );
+
+	const Define* const pDefs    = cg.GetDefinesBase();
+	const size_t numDefs         = cg.GetDefinesEnd() - pDefs;
+	const size_t numDynamicDefs  = cg.NumDefines( false );
+	const uint8_t* pStaticSlots  = cg.StaticSlots();
+
+	// Residual programs get looked up by the values of the static defines the skip
+	// expression reads, as a mixed-radix number over them
+	std::vector<std::pair<int, uint64_t>> arrKeySlots; // slot, stride
+	uint64_t numKeys = 1;
+	for ( const int nSlot : program.UsedSlots() )
+	{
+		if ( !pStaticSlots[nSlot] || numKeys > MAX_RESIDUALS )
+			continue;
+		arrKeySlots.emplace_back( nSlot, numKeys );
+		numKeys *= static_cast<uint64_t>( pDefs[nSlot].Max() ) - pDefs[nSlot].Min() + 1;
+	}
+
+	// Worth it when every static combo has enough dynamic ones to fill the lanes
+	// and every residual program gets used for a good number of combos
+	const bool bResidual = numStatic > 1 && numDynamic >= LANES && numKeys <= MAX_RESIDUALS && numKeys * 16 <= numCombos;
+
+	const auto& ValuesAt = [&cg, numDefs]( uint64_t iOffset ) {
+		std::vector<int> arrValues( numDefs );
+		cg.ValuesAt( iOffset, arrValues.data() );
+		return arrValues;
+	};
+
+	// Runs the program over n combos from iBegin on, stepping the first numStepDefs defines
+	const auto& Evaluate = [this, pDefs]( const CSkipProgram& prog, std::vector<int>& arrValues, std::vector<int>& arrLanes, uint64_t iBegin, uint64_t n, size_t numStepDefs ) {
+		const std::vector<int>& arrSlots = prog.UsedSlots();
+		for ( uint64_t iBlock = iBegin, iEnd = iBegin + n; iBlock < iEnd; iBlock += LANES )
+		{
+			const uint32_t numLanes = static_cast<uint32_t>( std::min<uint64_t>( LANES, iEnd - iBlock ) );
+			for ( uint32_t iLane = 0; iLane < numLanes; ++iLane )
+			{
+				for ( const int nSlot : arrSlots )
+					arrLanes[nSlot * LANES + iLane] = arrValues[nSlot];
+
+				// Next combo, same walk as ComboHandleImpl::NextNotSkipped
+				for ( size_t i = 0; i < numStepDefs; ++i )
+				{
+					if ( --arrValues[i] >= pDefs[i].Min() )
+						break;
+					arrValues[i] = pDefs[i].Max();
+				}
+			}
+
+			SetBits( iBlock, ~prog.EvaluateLanes( arrLanes.data() ) & ( ( 1u << numLanes ) - 1 ), numLanes );
+		}
+	};
+
+	// Whole words of combos
+	const auto& BuildWords = [&]( uint64_t iFirstWord, uint64_t iEndWord ) {
+		const uint64_t iBegin = iFirstWord * 64;
+		std::vector<int> arrValues = ValuesAt( iBegin );
+		std::vector<int> arrLanes( numDefs * LANES );
+		Evaluate( program, arrValues, arrLanes, iBegin, std::min( iEndWord * 64, numCombos ) - iBegin, numDefs );
+	};
+
+	// Whole static combos, partially evaluating the skip expression for each. Static combos
+	// skipped as a whole cost nothing, the others only run what depends on dynamic defines.
+	const auto& BuildStatic = [&]( uint64_t iFirstStatic, uint64_t iEndStatic ) {
+		std::vector<int> arrValues = ValuesAt( iFirstStatic * numDynamic );
+		std::vector<int> arrLanes( numDefs * LANES );
+		std::vector<CSkipProgram> arrResiduals( gsl::narrow<size_t>( numKeys ) );
+		std::vector<uint8_t> arrBuilt( gsl::narrow<size_t>( numKeys ) );
+
+		for ( uint64_t iStatic = iFirstStatic; iStatic < iEndStatic; ++iStatic )
+		{
+			size_t nKey = 0;
+			for ( const auto& [nSlot, nStride] : arrKeySlots )
+				nKey += gsl::narrow_cast<size_t>( ( pDefs[nSlot].Max() - arrValues[nSlot] ) * nStride );
+
+			CSkipProgram& residual = arrResiduals[nKey];
+			if ( !arrBuilt[nKey] )
+			{
+				expr.EmitResidual( arrValues.data(), pStaticSlots, residual );
+				arrBuilt[nKey] = 1;
+			}
+
+			int value;
+			if ( !residual.IsConstant( value ) )
+				Evaluate( residual, arrValues, arrLanes, iStatic * numDynamic, numDynamic, numDynamicDefs );
+			else if ( !value )
+				SetRange( iStatic * numDynamic, numDynamic );
+
+			// Next static combo, the dynamic defines wrapped back to their max values
+			for ( size_t i = numDynamicDefs; i < numDefs; ++i )
+			{
+				if ( --arrValues[i] >= pDefs[i].Min() )
+					break;
+				arrValues[i] = pDefs[i].Max();
+			}
+		}
+	};
+
+	// Work units are independent as long as no word of the map is shared,
+	// a big shader is split over all the cores
+	const uint64_t numUnits  = bResidual ? numStatic : numWords;
+	const uint64_t nUnitSize = bResidual ? numDynamic : 64;
+	const uint64_t nAlign    = bResidual ? 64 / std::gcd<uint64_t>( numDynamic, 64 ) : 1;
+	const auto& BuildUnits   = [&]( uint64_t iFirst, uint64_t iEnd ) {
+		if ( bResidual )
+			BuildStatic( iFirst, iEnd );
+		else
+			BuildWords( iFirst, iEnd );
+	};
+
+	constexpr uint64_t MIN_COMBOS_PER_THREAD = 1 << 20;
+	const size_t numThreads = gsl::narrow_cast<size_t>( std::clamp<uint64_t>( numUnits * nUnitSize / MIN_COMBOS_PER_THREAD, 1, std::max( 1u, std::thread::hardware_concurrency() ) ) );
+	if ( numThreads == 1 )
+	{
+		BuildUnits( 0, numUnits );
+		return;
+	}
+
+	std::vector<std::thread> arrThreads;
+	for ( size_t i = 0; i < numThreads; ++i )
+	{
+		const uint64_t iFirst = numUnits * i / numThreads / nAlign * nAlign;
+		const uint64_t iEnd   = i + 1 == numThreads ? numUnits : numUnits * ( i + 1 ) / numThreads / nAlign * nAlign;
+		arrThreads.emplace_back( BuildUnits, iFirst, iEnd );
+	}
+	std::for_each( arrThreads.begin(), arrThreads.end(), []( std::thread& t ) { t.join(); } );
+}
+
+void CLiveCombos::SetBits( uint64_t iOffset, uint64_t bits, uint32_t numBits ) noexcept
+{
+	const size_t iWord   = gsl::narrow_cast<size_t>( iOffset >> 6 );
+	const uint32_t nShift = iOffset & 63;
+	m_arrBits[iWord] |= bits << nShift;
+	if ( nShift + numBits > 64 )
+		m_arrBits[iWord + 1] |= bits >> ( 64 - nShift );
+}
+
+void CLiveCombos::SetRange( uint64_t iOffset, uint64_t n ) noexcept
+{
+	for ( const uint64_t iEnd = iOffset + n; iOffset < iEnd; )
+	{
+		const uint32_t numBits = static_cast<uint32_t>( std::min<uint64_t>( 64 - ( iOffset & 63 ), iEnd - iOffset ) );
+		SetBits( iOffset, numBits == 64 ? ~0ULL : ( 1ULL << numBits ) - 1, numBits );
+		iOffset += numBits;
+	}
+}
+
+uint64_t CLiveCombos::FindNext( uint64_t iOffset, uint64_t iEnd ) const noexcept
+{
+	if ( iOffset >= iEnd )
+		return iEnd;
+
+	size_t iWord        = gsl::narrow_cast<size_t>( iOffset >> 6 );
+	const size_t iLast  = gsl::narrow_cast<size_t>( ( iEnd - 1 ) >> 6 );
+	uint64_t bits       = m_arrBits[iWord] & ( ~0ULL << ( iOffset & 63 ) );
+	while ( !bits )
+	{
+		if ( ++iWord > iLast )
+			return iEnd;
+		bits = m_arrBits[iWord];
+	}
+
+	return std::min<uint64_t>( iWord * 64ULL + std::countr_zero( bits ), iEnd );
+}
+
+uint64_t CLiveCombos::Count( uint64_t iBegin, uint64_t iEnd ) const noexcept
+{
+	if ( iBegin >= iEnd )
+		return 0;
+
+	const size_t iFirst = gsl::narrow_cast<size_t>( iBegin >> 6 );
+	const size_t iLast  = gsl::narrow_cast<size_t>( ( iEnd - 1 ) >> 6 );
+	uint64_t nLive      = 0;
+	for ( size_t iWord = iFirst; iWord <= iLast; ++iWord )
+	{
+		uint64_t bits = m_arrBits[iWord];
+		if ( iWord == iFirst )
+			bits &= ~0ULL << ( iBegin & 63 );
+		if ( iWord == iLast && ( iEnd & 63 ) )
+			bits &= ( 1ULL << ( iEnd & 63 ) ) - 1;
+		nLive += std::popcount( bits );
+	}
+	return nLive;
+}
+
+uint64_t CLiveCombos::Skip( uint64_t iOffset, uint64_t nLive, uint64_t iEnd ) const noexcept
+{
+	if ( !nLive || iOffset >= iEnd )
+		return std::min( iOffset, iEnd );
+
+	size_t iWord  = gsl::narrow_cast<size_t>( iOffset >> 6 );
+	uint64_t bits = m_arrBits[iWord] & ( ~0ULL << ( iOffset & 63 ) );
+	for ( ;; )
+	{
+		const uint64_t nBits = std::popcount( bits );
+		if ( nLive <= nBits )
+		{
+			for ( ; nLive > 1; --nLive )
+				bits &= bits - 1;
+			return std::min<uint64_t>( iWord * 64ULL + std::countr_zero( bits ) + 1, iEnd );
+		}
+
+		nLive -= nBits;
+		if ( ++iWord * 64ULL >= iEnd )
+			return iEnd;
+		bits = m_arrBits[iWord];
+	}
+}
+
+//
+// Decision diagram of the live combos, for shaders too big for a bit per combo. Every node
+// branches on the value of one define, from the last define (the highest digit of the offset)
+// down to the first, and every path ends in a live or a skipped terminal. Paths that end early
+// stand for all the combos below them. Nodes that behave the same are shared, so the diagram
+// stays small as long as the skip expression only ties together a few defines at a time.
+//
+// Built top down by partial evaluation: a node is what is left of the skip expression once
+// the defines above it got fixed, combos that leave the same residual program share a node.
+// Every node knows how many live combos are below it, counting, finding the n-th live combo
+// and finding the next one then just walk down from the root.
+//
+class CComboDiagram final : public ILiveCombos
+{
+public:
+	// Gives up past this many nodes, the combos then get evaluated one by one
+	static constexpr size_t MAX_NODES = 1 << 16;
+
+	// False if the diagram got too big
+	bool Build( const ComboGenerator& cg, const IExpression& expr );
+
+	[[nodiscard]] bool IsLive( uint64_t iOffset ) const noexcept override;
+	[[nodiscard]] uint64_t FindNext( uint64_t iOffset, uint64_t iEnd ) const noexcept override;
+	[[nodiscard]] uint64_t Count( uint64_t iBegin, uint64_t iEnd ) const noexcept override;
+	[[nodiscard]] uint64_t Skip( uint64_t iOffset, uint64_t nLive, uint64_t iEnd ) const noexcept override;
+
+	[[nodiscard]] size_t NumNodes() const noexcept { return m_arrNodes.size(); }
+
+private:
+	// Terminals, the nodes come after them
+	static constexpr uint32_t SKIPPED    = 0;
+	static constexpr uint32_t LIVE       = 1;
+	static constexpr uint32_t FIRST_NODE = 2;
+
+	struct Node
+	{
+		uint32_t iEdges;   // Children in m_arrEdges, one per value of the define
+		uint64_t numLive;
+	};
+
+	// Live combos of a block of nBlock combos that node stands for
+	[[nodiscard]] uint64_t Weight( uint32_t node, uint64_t nBlock ) const noexcept
+	{
+		return node == LIVE ? nBlock : node == SKIPPED ? 0 : m_arrNodes[node].numLive;
+	}
+	// Live offsets before iOffset
+	[[nodiscard]] uint64_t CountBelow( uint64_t iOffset ) const noexcept;
+	// Offset of the nLive-th live combo, counting from 1, there has to be one
+	[[nodiscard]] uint64_t Select( uint64_t nLive ) const noexcept;
+
+	std::vector<Node> m_arrNodes;
+	std::vector<uint32_t> m_arrEdges;
+	std::vector<uint32_t> m_arrValues; // Number of values of every define
+	std::vector<uint64_t> m_arrBlock;  // Combos below a child of a node of every define, the number of combos last
+	uint32_t m_nRoot = SKIPPED;
+};
+
+bool CComboDiagram::Build( const ComboGenerator& cg, const IExpression& expr )
+{
+	const Define* const pDefs = cg.GetDefinesBase();
+	const size_t numDefs      = cg.GetDefinesEnd() - pDefs;
+
+	m_arrNodes.assign( FIRST_NODE, Node { 0, 0 } );
+	m_arrEdges.clear();
+	m_arrValues.resize( numDefs );
+	m_arrBlock.resize( numDefs + 1 );
+	m_arrBlock[0] = 1;
+	for ( size_t d = 0; d < numDefs; ++d )
+	{
+		m_arrValues[d]    = static_cast<uint32_t>( static_cast<int64_t>( pDefs[d].Max() ) - pDefs[d].Min() + 1 );
+		m_arrBlock[d + 1] = m_arrBlock[d] * m_arrValues[d];
+	}
+
+	struct ProgramHash
+	{
+		size_t operator()( const CSkipProgram* p ) const noexcept { return p->Hash(); }
+	};
+	struct ProgramEqual
+	{
+		bool operator()( const CSkipProgram* a, const CSkipProgram* b ) const noexcept { return *a == *b; }
+	};
+
+	// Nodes of one define before they get merged: the define values that lead there, what
+	// is left of the expression, and the children as a terminal or FIRST_NODE + their index
+	struct Level
+	{
+		std::vector<int> arrValues;
+		std::deque<CSkipProgram> residuals;
+		std::unordered_map<const CSkipProgram*, uint32_t, ProgramHash, ProgramEqual> mapResiduals;
+		std::vector<uint32_t> arrEdges;
+	};
+	std::vector<Level> levels( numDefs );
+	std::vector<uint8_t> arrFixed( numDefs, 0 );
+	size_t numNodes = 0;
+
+	CSkipProgram residual;
+	const auto& EmitResidual = [&expr, &residual, &arrFixed]( const int* pValues ) {
+		residual.Clear();
+		residual.SetFixedVariables( pValues, arrFixed.data() );
+		expr.Emit( residual );
+		residual.SetFixedVariables( nullptr, nullptr );
+	};
+	// Terminal if the residual folded into a constant, otherwise the node of define d - 1 for
+	// it. With every define fixed it always is a constant.
+	const auto& Classify = [&]( size_t d, const int* pValues ) -> uint32_t {
+		int value;
+		if ( residual.IsConstant( value ) )
+			return value ? SKIPPED : LIVE;
+
+		Assert( d );
+		Level& level    = levels[d - 1];
+		const auto find = level.mapResiduals.find( &residual );
+		if ( find != level.mapResiduals.end() )
+			return find->second;
+
+		const uint32_t node = FIRST_NODE + gsl::narrow_cast<uint32_t>( level.residuals.size() );
+		level.mapResiduals.emplace( &level.residuals.emplace_back( std::move( residual ) ), node );
+		level.arrValues.insert( level.arrValues.end(), pValues, pValues + numDefs );
+		++numNodes;
+		return node;
+	};
+
+	std::vector<int> arrValues( numDefs );
+	EmitResidual( arrValues.data() );
+	const uint32_t nRoot = Classify( numDefs, arrValues.data() );
+
+	for ( size_t d = numDefs; d-- > 0; )
+	{
+		Level& level = levels[d];
+		arrFixed[d]  = 1;
+		for ( size_t i = 0; i < level.residuals.size(); ++i )
+		{
+			std::copy_n( &level.arrValues[i * numDefs], numDefs, arrValues.data() );
+
+			// Defines the residual does not read lead to the same child for every value
+			const std::vector<int>& used = level.residuals[i].UsedSlots();
+			const bool bUsed = std::find( used.cbegin(), used.cend(), static_cast<int>( d ) ) != used.cend();
+			for ( uint32_t j = 0; j < m_arrValues[d]; ++j )
+			{
+				if ( !bUsed && j )
+				{
+					level.arrEdges.emplace_back( level.arrEdges.back() );
+					continue;
+				}
+
+				arrValues[d] = pDefs[d].Max() - static_cast<int>( j );
+				EmitResidual( arrValues.data() );
+				level.arrEdges.emplace_back( Classify( d, arrValues.data() ) );
+			}
+
+			if ( numNodes > MAX_NODES )
+				return false;
+		}
+
+		level.mapResiduals.clear();
+		level.residuals.clear();
+		level.arrValues.clear();
+	}
+
+	// Bottom up, merge the nodes with the same children and count the live combos. Nodes with
+	// the same terminal for every value are that terminal.
+	std::vector<uint32_t> arrBelow, arrIds;
+	std::map<std::vector<uint32_t>, uint32_t> mapNodes;
+	std::vector<uint32_t> arrChildren;
+	for ( size_t d = 0; d < numDefs; ++d )
+	{
+		const Level& level      = levels[d];
+		const uint32_t numValues = m_arrValues[d];
+		arrIds.resize( level.arrEdges.size() / numValues );
+		mapNodes.clear();
+		for ( size_t i = 0; i < arrIds.size(); ++i )
+		{
+			arrChildren.assign( &level.arrEdges[i * numValues], &level.arrEdges[i * numValues] + numValues );
+			for ( uint32_t& child : arrChildren )
+				child = child < FIRST_NODE ? child : arrBelow[child - FIRST_NODE];
+
+			if ( arrChildren.front() < FIRST_NODE && std::all_of( arrChildren.cbegin(), arrChildren.cend(), [&arrChildren]( uint32_t child ) { return child == arrChildren.front(); } ) )
+			{
+				arrIds[i] = arrChildren.front();
+				continue;
+			}
+
+			const auto [it, bInserted] = mapNodes.emplace( arrChildren, gsl::narrow_cast<uint32_t>( m_arrNodes.size() ) );
+			arrIds[i] = it->second;
+			if ( !bInserted )
+				continue;
+
+			uint64_t numLive = 0;
+			for ( const uint32_t child : arrChildren )
+				numLive += Weight( child, m_arrBlock[d] );
+			m_arrNodes.emplace_back( Node { gsl::narrow_cast<uint32_t>( m_arrEdges.size() ), numLive } );
+			m_arrEdges.insert( m_arrEdges.end(), arrChildren.cbegin(), arrChildren.cend() );
+		}
+		arrBelow.swap( arrIds );
+	}
+
+	m_nRoot = nRoot < FIRST_NODE ? nRoot : arrBelow[nRoot - FIRST_NODE];
+	return true;
+}
+
+bool CComboDiagram::IsLive( uint64_t iOffset ) const noexcept
+{
+	uint32_t node = m_nRoot;
+	for ( size_t d = m_arrValues.size(); node >= FIRST_NODE; )
+	{
+		--d;
+		node = m_arrEdges[m_arrNodes[node].iEdges + iOffset / m_arrBlock[d] % m_arrValues[d]];
+	}
+	return node == LIVE;
+}
+
+uint64_t CComboDiagram::CountBelow( uint64_t iOffset ) const noexcept
+{
+	const uint64_t numCombos = m_arrBlock.back();
+	if ( iOffset >= numCombos )
+		return Weight( m_nRoot, numCombos );
+
+	uint64_t nLive  = 0;
+	uint64_t nBlock = numCombos;
+	uint32_t node   = m_nRoot;
+	for ( size_t d = m_arrValues.size(); node >= FIRST_NODE; )
+	{
+		--d;
+		const uint32_t* const pEdges = &m_arrEdges[m_arrNodes[node].iEdges];
+		const uint64_t j             = iOffset / m_arrBlock[d] % m_arrValues[d];
+		for ( uint64_t k = 0; k < j; ++k )
+			nLive += Weight( pEdges[k], m_arrBlock[d] );
+		node   = pEdges[j];
+		nBlock = m_arrBlock[d];
+	}
+	return node == LIVE ? nLive + iOffset % nBlock : nLive;
+}
+
+uint64_t CComboDiagram::Select( uint64_t nLive ) const noexcept
+{
+	uint64_t iOffset = 0;
+	uint32_t node    = m_nRoot;
+	for ( size_t d = m_arrValues.size(); node >= FIRST_NODE; )
+	{
+		--d;
+		const uint32_t* const pEdges = &m_arrEdges[m_arrNodes[node].iEdges];
+		for ( uint32_t j = 0;; ++j )
+		{
+			const uint64_t nWeight = Weight( pEdges[j], m_arrBlock[d] );
+			if ( nLive <= nWeight )
+			{
+				iOffset += j * m_arrBlock[d];
+				node = pEdges[j];
+				break;
+			}
+			nLive -= nWeight;
+		}
+	}
+	return iOffset + nLive - 1;
+}
+
+uint64_t CComboDiagram::FindNext( uint64_t iOffset, uint64_t iEnd ) const noexcept
+{
+	if ( iOffset >= iEnd )
+		return iEnd;
+
+	const uint64_t nLive = CountBelow( iOffset ) + 1;
+	return nLive > Weight( m_nRoot, m_arrBlock.back() ) ? iEnd : std::min( Select( nLive ), iEnd );
+}
+
+uint64_t CComboDiagram::Count( uint64_t iBegin, uint64_t iEnd ) const noexcept
+{
+	return iBegin < iEnd ? CountBelow( iEnd ) - CountBelow( iBegin ) : 0;
+}
+
+uint64_t CComboDiagram::Skip( uint64_t iOffset, uint64_t nLive, uint64_t iEnd ) const noexcept
+{
+	if ( !nLive || iOffset >= iEnd )
+		return std::min( iOffset, iEnd );
+
+	nLive += CountBelow( iOffset );
+	return nLive > Weight( m_nRoot, m_arrBlock.back() ) ? iEnd : std::min( Select( nLive ) + 1, iEnd );
+}
+
+// Unsigned division by a constant as a multiply and shifts (Granlund & Montgomery),
+// splitting a combo number into define values then needs no div instructions
+class CFastDivider
+{
+public:
+	explicit CFastDivider( uint64_t d = 1 ) noexcept : m_nDivisor( d ), m_nMagic( 0 ), m_nShift( std::countr_zero( d ) )
+	{
+		if ( std::has_single_bit( d ) )
+			return;
+
+		// m = floor( 2^64 * ( 2^l - d ) / d ) + 1 with l = ceil( log2( d ) ), one bit at a time
+		const uint32_t l = std::bit_width( d );
+		uint64_t nRemainder = ( l == 64 ? 0 : 1ULL << l ) - d;
+		for ( uint32_t i = 0; i < 64; ++i )
+		{
+			const bool bCarry = nRemainder >> 63;
+			nRemainder <<= 1;
+			m_nMagic <<= 1;
+			if ( bCarry || nRemainder >= d )
+			{
+				nRemainder -= d;
+				m_nMagic |= 1;
+			}
+		}
+		++m_nMagic;
+		m_nShift = l - 1;
+	}
+
+	[[nodiscard]] uint64_t Divide( uint64_t n ) const noexcept
+	{
+		if ( !m_nMagic )
+			return n >> m_nShift;
+		const uint64_t t = MulHigh( m_nMagic, n );
+		return ( t + ( ( n - t ) >> 1 ) ) >> m_nShift;
+	}
+
+	[[nodiscard]] uint64_t Divisor() const noexcept { return m_nDivisor; }
+
+private:
+	// High 64 bits of the 128 bit product
+	[[nodiscard]] static uint64_t MulHigh( uint64_t a, uint64_t b ) noexcept
+	{
+#if defined( _M_X64 ) || defined( _M_ARM64 )
+		return __umulh( a, b );
+#else
+		// 32-bit targets have no 64x64 multiply, put it together from four 32x32 ones
+		const uint64_t aLo = static_cast<uint32_t>( a ), aHi = a >> 32;
+		const uint64_t bLo = static_cast<uint32_t>( b ), bHi = b >> 32;
+		const uint64_t lolo = aLo * bLo;
+		const uint64_t hilo = aHi * bLo;
+		const uint64_t lohi = aLo * bHi;
+		const uint64_t mid  = ( lolo >> 32 ) + static_cast<uint32_t>( hilo ) + static_cast<uint32_t>( lohi );
+		return aHi * bHi + ( hilo >> 32 ) + ( lohi >> 32 ) + ( mid >> 32 );
+#endif
+	}
+
+	uint64_t m_nDivisor;
+	uint64_t m_nMagic; // 0 for powers of two, which just shift
+	uint32_t m_nShift;
+};
+
+// Live combo maps get built by FinalizeConfiguration, can be turned off for benchmarking
+static bool s_bLiveCombos = true;
+// Shaders without a map get a decision diagram of the live combos instead
+static bool s_bComboDiagram = true;
+// Shaders without a map specialize the skip program for every static combo
+static bool s_bResidualSkip = true;
+// Needs enough dynamic combos per static one to pay for specializing the program
+static constexpr uint64_t MIN_RESIDUAL_DYNAMIC_COMBOS = 64;
+
+class CfgEntry
+{
+public:
+	CfgEntry() noexcept : m_szName( "" ), m_szShaderSrc( "" ), m_pCg( nullptr ), m_pExpr( nullptr ), m_pLive( nullptr ), m_bResidualSkip( false )
+	{
+		memset( &m_eiInfo, 0, sizeof( m_eiInfo ) );
+	}
+
+	static void Destroy( CfgEntry const& x ) noexcept
+	{
+		delete x.m_pCg;
+		delete x.m_pExpr;
+		delete x.m_pLive;
+	}
+
+	// Layout of the macro template, the value slots get patched for every combo
+	static constexpr size_t MACRO_SHADERCOMBO  = 0;
+	static constexpr size_t MACRO_SHADER_MODEL = 1;
+	static constexpr size_t MACRO_FIRST_DEFINE = 2;
+	static constexpr size_t MACRO_VALUE_SIZE   = 24; // Fits a 64-bit hex combo number or an int
+
+public:
+	bool operator<( const CfgEntry& x ) const noexcept { return m_pCg->NumCombos() < x.m_pCg->NumCombos(); }
 
 public:
 	char const* m_szName;
 	char const* m_szShaderSrc;
 	ComboGenerator* m_pCg;
 	CComplexExpression* m_pExpr;
+	ILiveCombos* m_pLive; // nullptr when the combos get evaluated one by one
+	std::vector<CFastDivider> m_arrIntervals; // Number of values of every define, for decoding combo numbers
+	bool m_bResidualSkip; // Without a map, evaluate what is left of the skip program after fixing the static defines
+	std::vector<CmdSink::ShaderMacro> m_arrMacros; // SHADERCOMBO, SHADER_MODEL_*, defines, null-terminated
 
 	CfgProcessor::CfgEntryInfo m_eiInfo;
 };
@@ -663,6 +2041,38 @@ public:
 static std::set<std::string> s_strPool;
 static std::multiset<CfgEntry> s_setEntries;
 
+// Hash of everything the shader gets built from, keys the bytecode cache
+static void HashSourceFiles( CfgProcessor::CfgEntryInfo& info, const std::vector<std::string>& files )
+{
+	ShaderCache::CHasher hasher;
+	for ( const std::string& file : files )
+	{
+		const char* pLastSlash = std::max( strrchr( file.c_str(), '/' ), strrchr( file.c_str(), '\\' ) );
+		const char* szJustFilename = pLastSlash ? pLastSlash + 1 : file.c_str();
+
+		hasher.Update( szJustFilename );
+		if ( const CSharedFile* pFile = fileCache.Get( szJustFilename ) )
+			hasher.Update( pFile->Data(), pFile->Size() );
+	}
+
+	const ShaderCache::Digest digest = hasher.Final();
+	memcpy( info.m_sourceHash, digest.data(), digest.size() );
+}
+
+// Fills in everything that does not change from combo to combo
+static void BuildMacroTemplate( CfgEntry& cfg )
+{
+	std::string shaderModel = std::string( "SHADER_MODEL_" ) + cfg.m_eiInfo.m_szShaderVersion;
+	std::transform( shaderModel.begin(), shaderModel.end(), shaderModel.begin(), []( char c ) { return static_cast<char>( toupper( static_cast<unsigned char>( c ) ) ); } );
+
+	cfg.m_arrMacros.clear();
+	cfg.m_arrMacros.emplace_back( CmdSink::ShaderMacro { "SHADERCOMBO", nullptr } );
+	cfg.m_arrMacros.emplace_back( CmdSink::ShaderMacro { s_strPool.emplace( shaderModel ).first->c_str(), "1" } );
+	for ( const Define* pDef = cfg.m_pCg->GetDefinesBase(); pDef < cfg.m_pCg->GetDefinesEnd(); ++pDef )
+		cfg.m_arrMacros.emplace_back( CmdSink::ShaderMacro { pDef->Name(), nullptr } );
+	cfg.m_arrMacros.emplace_back( CmdSink::ShaderMacro { nullptr, nullptr } );
+}
+
 class ComboHandleImpl : public IEvaluationContext
 {
 public:
@@ -672,12 +2082,26 @@ public:
 	const CfgEntry* m_pEntry;
 
 public:
-	ComboHandleImpl() noexcept : m_iTotalCommand( 0 ), m_iComboNumber( 0 ), m_numCombos( 0 ), m_pEntry( nullptr ) {}
+	ComboHandleImpl() noexcept : m_iTotalCommand( 0 ), m_iComboNumber( 0 ), m_numCombos( 0 ), m_pEntry( nullptr ), m_numVarSlots( 0 ), m_iResidualStatic( UINT64_MAX ) {}
 	ComboHandleImpl( const ComboHandleImpl& ) = default;
 
+	// Back to a fresh handle, keeping the storage of the residual program
+	void Reset() noexcept
+	{
+		m_iTotalCommand = m_iComboNumber = m_numCombos = 0;
+		m_pEntry          = nullptr;
+		m_numVarSlots     = 0;
+		m_iResidualStatic = UINT64_MAX;
+	}
+
 	// IEvaluationContext
 private:
-	std::vector<int> m_arrVarSlots;
+	int m_arrVarSlots[CfgProcessor::MAX_DEFINES];
+	size_t m_numVarSlots;
+
+	// Skip program specialized for static combo m_iResidualStatic
+	CSkipProgram m_residual;
+	uint64_t m_iResidualStatic;
 
 public:
 	int GetVariableValue( int nSlot ) const noexcept override { return m_arrVarSlots[nSlot]; }
@@ -686,48 +2110,71 @@ public:
 
 	// External implementation
 public:
-	bool Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry );
+	bool Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry, uint64_t iOffset = 0 ) noexcept;
+	void DecodeValues( uint64_t iOffset ) noexcept;
 	bool AdvanceCommands( uint64_t& riAdvanceMore ) noexcept;
 	bool NextNotSkipped( uint64_t iTotalCommand ) noexcept;
-	bool IsSkipped() const noexcept { return m_pEntry->m_pExpr->Evaluate( this ) != 0; }
-	void FormatCommand( std::span<char> pchBuffer ) const;
-	void FormatCommandHumanReadable( std::span<char> pchBuffer ) const;
+	bool NextLive( const ILiveCombos& live, uint64_t iTotalCommand ) noexcept;
+	bool NextResidual( uint64_t iTotalCommand ) noexcept;
+	bool IsSkipped() const noexcept
+	{
+		if ( m_pEntry->m_pLive )
+			return !m_pEntry->m_pLive->IsLive( m_numCombos - 1 - m_iComboNumber );
+		return m_pEntry->m_pExpr->EvaluateSlots( this, m_arrVarSlots ) != 0;
+	}
+	const CmdSink::CompileCommand& BuildCommand( CfgProcessor::ComboCommand& rCommand ) const;
+	std::string FormatCommandHumanReadable() const;
 };
 
-static std::map<uint64_t, ComboHandleImpl> s_mapComboCommands;
+// Where every entry starts in the command space, in command order and
+// ending with the terminator. Filled by FinalizeConfiguration.
+static std::vector<uint64_t> s_arrCommandStarts;
+static std::vector<const CfgEntry*> s_arrCommandEntries;
 
-bool ComboHandleImpl::Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry )
+// Entry that iCommand falls into, the terminator past the last one
+static size_t FindCommandEntry( uint64_t iCommand ) noexcept
 {
-	m_iTotalCommand = iTotalCommand;
-	m_pEntry        = pEntry;
-	m_numCombos     = m_pEntry->m_pCg->NumCombos();
+	const auto it = std::upper_bound( s_arrCommandStarts.cbegin(), s_arrCommandStarts.cend(), iCommand );
+	return it == s_arrCommandStarts.cbegin() ? 0 : it - s_arrCommandStarts.cbegin() - 1;
+}
 
-	// Defines
-	Define const* const pDefVars    = m_pEntry->m_pCg->GetDefinesBase();
-	Define const* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
+// Sets the handle to the combo at iOffset within the entry, keeps the storage of a reused handle
+bool ComboHandleImpl::Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry, uint64_t iOffset ) noexcept
+{
+	if ( pEntry->m_arrIntervals.size() > CfgProcessor::MAX_DEFINES )
+		return false;
+	if ( m_pEntry != pEntry )
+		m_iResidualStatic = UINT64_MAX;
 
-	// Set all the variables to max values
-	for ( const Define* pSetDef = pDefVars; pSetDef < pDefVarsEnd; ++pSetDef )
-		m_arrVarSlots.emplace_back( pSetDef->Max() );
+	m_iTotalCommand = iTotalCommand;
+	m_pEntry        = pEntry;
+	m_numCombos     = m_pEntry->m_pCg ? m_pEntry->m_pCg->NumCombos() : 0;
+	m_iComboNumber  = m_numCombos ? m_numCombos - 1 - iOffset : 0;
 
-	m_iComboNumber = m_numCombos - 1;
+	m_numVarSlots = m_pEntry->m_arrIntervals.size();
+	DecodeValues( iOffset );
 	return true;
 }
 
+// Splits the offset of a combo within its shader into the define values, a mixed-radix
+// number with the first define as the lowest digit, counting down from the max values
+void ComboHandleImpl::DecodeValues( uint64_t iOffset ) noexcept
+{
+	const Define* const pDefVars          = m_pEntry->m_pCg ? m_pEntry->m_pCg->GetDefinesBase() : nullptr;
+	const CFastDivider* const pIntervals = m_pEntry->m_arrIntervals.data();
+	for ( size_t i = 0, iEnd = m_numVarSlots; i < iEnd; ++i )
+	{
+		const uint64_t iNext = pIntervals[i].Divide( iOffset );
+		m_arrVarSlots[i]     = pDefVars[i].Max() - static_cast<int>( iOffset - iNext * pIntervals[i].Divisor() );
+		iOffset              = iNext;
+	}
+}
+
 bool ComboHandleImpl::AdvanceCommands( uint64_t& riAdvanceMore ) noexcept
 {
 	if ( !riAdvanceMore )
 		return true;
 
-	// Get the pointers
-	int* const pnValues    = m_arrVarSlots.data();
-	int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	int* pSetValues;
-
-	// Defines
-	Define const* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
-	Define const* pSetDef;
-
 	if ( m_iComboNumber < riAdvanceMore )
 	{
 		riAdvanceMore -= m_iComboNumber;
@@ -737,24 +2184,22 @@ bool ComboHandleImpl::AdvanceCommands( uint64_t& riAdvanceMore ) noexcept
 	// Do the advance
 	m_iTotalCommand += riAdvanceMore;
 	m_iComboNumber -= riAdvanceMore;
-	for ( pSetValues = pnValues, pSetDef = pDefVars; ( pSetValues < pnValuesEnd ) && ( riAdvanceMore > 0 ); ++pSetValues, ++pSetDef )
-	{
-		riAdvanceMore += ( static_cast<uint64_t>( pSetDef->Max() ) - *pSetValues );
-		*pSetValues = pSetDef->Max();
-
-		const int iInterval = ( pSetDef->Max() - pSetDef->Min() + 1 );
-		*pSetValues -= static_cast<int>( riAdvanceMore % iInterval );
-		riAdvanceMore /= iInterval;
-	}
+	riAdvanceMore = 0;
+	DecodeValues( m_numCombos - 1 - m_iComboNumber );
 
 	return true;
 }
 
 bool ComboHandleImpl::NextNotSkipped( uint64_t iTotalCommand ) noexcept
 {
+	if ( m_pEntry->m_pLive )
+		return NextLive( *m_pEntry->m_pLive, iTotalCommand );
+	if ( m_pEntry->m_bResidualSkip )
+		return NextResidual( iTotalCommand );
+
 	// Get the pointers
-	int* const pnValues    = m_arrVarSlots.data();
-	int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
+	int* const pnValues    = m_arrVarSlots;
+	int* const pnValuesEnd = pnValues + m_numVarSlots;
 	int* pSetValues;
 
 	// Defines
@@ -781,76 +2226,135 @@ next_combo_iteration:
 	return false;
 
 have_combo_iteration:
-	if ( m_pEntry->m_pExpr->Evaluate( this ) )
+	if ( m_pEntry->m_pExpr->EvaluateSlots( this, pnValues ) )
 		goto next_combo_iteration;
 
 	return true;
 }
 
-void ComboHandleImpl::FormatCommand( std::span<char> pchBuffer ) const
+// NextNotSkipped through the live combo map: jumps right to the next live command,
+// or to the last one of the shader or the range, where the walk would have stopped
+bool ComboHandleImpl::NextLive( const ILiveCombos& live, uint64_t iTotalCommand ) noexcept
 {
-	// Get the pointers
-	const int* const pnValues    = m_arrVarSlots.data();
-	const int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	const int* pSetValues;
+	if ( m_iTotalCommand + 1 >= iTotalCommand || !m_iComboNumber )
+		return false;
 
-	// Defines
+	const uint64_t iOffset     = m_numCombos - 1 - m_iComboNumber;
+	const uint64_t iLastOffset = std::min( m_numCombos - 1, iOffset + ( iTotalCommand - 1 - m_iTotalCommand ) );
+	const uint64_t iNext       = live.FindNext( iOffset + 1, iLastOffset + 1 );
+
+	uint64_t iAdvance = std::min( iNext, iLastOffset ) - iOffset;
+	AdvanceCommands( iAdvance );
+	return iNext <= iLastOffset;
+}
+
+// NextNotSkipped with the skip program specialized for the current static combo: static
+// combos skipped as a whole are stepped over, the others only evaluate the dynamic part
+bool ComboHandleImpl::NextResidual( uint64_t iTotalCommand ) noexcept
+{
+	int* const pnValues          = m_arrVarSlots;
+	const size_t numDefs         = m_numVarSlots;
 	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
-	const Define* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
-	const Define* pSetDef;
+	const uint64_t numDynamic    = m_pEntry->m_eiInfo.m_numDynamicCombos;
 
-	// ------- OnCombo( nCurrentCombo ); ----------
-	int o = sprintf_s( pchBuffer.data(), pchBuffer.size(), "command" ) + 1;
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "%s", m_pEntry->m_szShaderSrc ) + 1;
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "%s", m_pEntry->m_eiInfo.m_szShaderVersion ) + 1;
+	for ( ;; )
+	{
+		if ( m_iTotalCommand + 1 >= iTotalCommand || !m_iComboNumber )
+			return false;
+
+		--m_iComboNumber;
+		++m_iTotalCommand;
 
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "SHADERCOMBO" ) + 1;
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "%llx", m_iComboNumber ) + 1;
+		size_t i = 0;
+		for ( ; i < numDefs; ++i )
+		{
+			if ( --pnValues[i] >= pDefVars[i].Min() )
+				break;
+			pnValues[i] = pDefVars[i].Max();
+		}
+		if ( i == numDefs )
+			return false;
 
-	char version[20];
-	strcpy_s( version, m_pEntry->m_eiInfo.m_szShaderVersion );
-	_strupr_s( version );
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "SHADER_MODEL_%s", version ) + 1;
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "1" ) + 1;
+		const uint64_t iOffset = m_numCombos - 1 - m_iComboNumber;
+		const uint64_t iStatic = iOffset / numDynamic;
+		if ( iStatic != m_iResidualStatic )
+		{
+			m_pEntry->m_pExpr->EmitResidual( pnValues, m_pEntry->m_pCg->StaticSlots(), m_residual );
+			m_iResidualStatic = iStatic;
+		}
 
-	for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValuesEnd && pDefVars < pDefVarsEnd; ++pSetValues, ++pSetDef )
+		int value;
+		if ( !m_residual.IsConstant( value ) )
+		{
+			if ( !m_residual.Evaluate( pnValues ) )
+				return true;
+		}
+		else if ( !value )
+			return true;
+		else
+		{
+			// Skipped as a whole, go to its last dynamic combo or where the range ends
+			uint64_t iAdvance = std::min( ( iStatic + 1 ) * numDynamic - 1 - iOffset, iTotalCommand - 1 - m_iTotalCommand );
+			AdvanceCommands( iAdvance );
+		}
+	}
+}
+
+const CmdSink::CompileCommand& ComboHandleImpl::BuildCommand( CfgProcessor::ComboCommand& rCommand ) const
+{
+	constexpr size_t nValueSize = CfgEntry::MACRO_VALUE_SIZE;
+
+	// ------- OnCombo( nCurrentCombo ); ----------
+	if ( rCommand.m_pTemplate != m_pEntry )
 	{
-		o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "%s", pSetDef->Name() ) + 1;
-		o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, "%d", *pSetValues ) + 1;
+		// New shader, take over its template and point the value slots into our own storage
+		rCommand.m_pTemplate = m_pEntry;
+		rCommand.m_arrMacros.assign( m_pEntry->m_arrMacros.begin(), m_pEntry->m_arrMacros.end() );
+		rCommand.m_arrValues.resize( ( 1 + m_numVarSlots ) * nValueSize );
+
+		rCommand.m_arrMacros[CfgEntry::MACRO_SHADERCOMBO].Definition = rCommand.m_arrValues.data();
+		for ( size_t i = 0; i < m_numVarSlots; ++i )
+			rCommand.m_arrMacros[CfgEntry::MACRO_FIRST_DEFINE + i].Definition = rCommand.m_arrValues.data() + ( 1 + i ) * nValueSize;
+
+		rCommand.m_command.m_szFileName    = m_pEntry->m_szShaderSrc;
+		rCommand.m_command.m_szShaderModel = m_pEntry->m_eiInfo.m_szShaderVersion;
+		rCommand.m_command.m_macros        = rCommand.m_arrMacros;
 	}
 
-	pchBuffer[o] = '\0';
-	pchBuffer[o + 1LL] = '\0';
+	char* pValue = rCommand.m_arrValues.data();
+	*std::to_chars( pValue, pValue + nValueSize - 1, m_iComboNumber, 16 ).ptr = '\0';
+
+	for ( const int iValue : std::span( m_arrVarSlots, m_numVarSlots ) )
+	{
+		pValue += nValueSize;
+		*std::to_chars( pValue, pValue + nValueSize - 1, iValue ).ptr = '\0';
+	}
 	// ------- end of OnCombo ---------------------
+
+	return rCommand.m_command;
 }
 
-void ComboHandleImpl::FormatCommandHumanReadable( std::span<char> pchBuffer ) const
+std::string ComboHandleImpl::FormatCommandHumanReadable() const
 {
-	// Get the pointers
-	const int* const pnValues    = m_arrVarSlots.data();
-	const int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	const int* pSetValues;
-
 	// Defines
 	const Define* const pDefVars    = m_pEntry->m_pCg->GetDefinesBase();
 	const Define* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
-	const Define* pSetDef;
 
 	// ------- OnCombo( nCurrentCombo ); ----------
-	char version[20];
-	strcpy_s( version, m_pEntry->m_eiInfo.m_szShaderVersion );
-	_strupr_s( version );
-	int o = sprintf_s( pchBuffer.data(), pchBuffer.size(),
-		"fxc.exe /DCENTROIDMASK=%d /DSHADERCOMBO=%llx /DSHADER_MODEL_%s=1 /T%s /Emain",
-		m_pEntry->m_eiInfo.m_nCentroidMask, m_iComboNumber, version, m_pEntry->m_eiInfo.m_szShaderVersion );
+	char szComboNumber[20];
+	*std::to_chars( szComboNumber, szComboNumber + sizeof( szComboNumber ) - 1, m_iComboNumber, 16 ).ptr = '\0';
+
+	std::string command = "fxc.exe /DCENTROIDMASK=" + std::to_string( m_pEntry->m_eiInfo.m_nCentroidMask ) + " /DSHADERCOMBO=" + szComboNumber
+		+ " /D" + m_pEntry->m_arrMacros[CfgEntry::MACRO_SHADER_MODEL].Name + "=1 /T" + m_pEntry->m_eiInfo.m_szShaderVersion + " /Emain";
 
-	for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValuesEnd && pDefVars < pDefVarsEnd; ++pSetValues, ++pSetDef )
-		o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, " /D%s=%d", pSetDef->Name(), *pSetValues );
+	const int* pSetValue = m_arrVarSlots;
+	for ( const Define* pSetDef = pDefVars; pSetDef < pDefVarsEnd; ++pSetDef, ++pSetValue )
+		command.append( " /D" ).append( pSetDef->Name() ).append( "=" ).append( std::to_string( *pSetValue ) );
 
-	o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, " %s", m_pEntry->m_szShaderSrc );
+	command.append( " " ).append( m_pEntry->m_szShaderSrc );
 	// ------- end of OnCombo ---------------------
 
-	pchBuffer[o] = '\0';
+	return command;
 }
 
 static struct CAutoDestroyEntries
@@ -923,6 +2427,81 @@ static char const* V_stristr( char const* pStr, char const* pSearch )
 	return nullptr;
 }
 
+// Establishes the command mapping over all the entries added so far,
+// must be called once after the last entry has been set up
+void FinalizeConfiguration()
+{
+	s_arrCommandStarts.clear();
+	s_arrCommandEntries.clear();
+
+	uint64_t nCurrentCommand = 0;
+	for ( auto it = s_setEntries.rbegin(), itEnd = s_setEntries.rend(); it != itEnd; ++it )
+	{
+		CfgEntry& e = const_cast<CfgEntry&>( *it );
+		delete e.m_pLive;
+		e.m_pLive = nullptr;
+		e.m_eiInfo.m_numLiveCombos = 0;
+
+		const CSkipProgram* pProgram = e.m_pExpr->CompiledProgram();
+		if ( s_bLiveCombos && pProgram && e.m_pCg->NumCombos() <= CLiveCombos::MAX_COMBOS )
+		{
+			CLiveCombos* pLive = new CLiveCombos;
+			pLive->Build( *e.m_pCg, *e.m_pExpr, *pProgram );
+			e.m_pLive = pLive;
+		}
+		else if ( s_bComboDiagram )
+		{
+			CComboDiagram* pDiagram = new CComboDiagram;
+			if ( pDiagram->Build( *e.m_pCg, *e.m_pExpr ) )
+				e.m_pLive = pDiagram;
+			else
+				delete pDiagram;
+		}
+		if ( e.m_pLive )
+			e.m_eiInfo.m_numLiveCombos = e.m_pLive->Count( 0, e.m_pCg->NumCombos() );
+		e.m_bResidualSkip = !e.m_pLive && s_bResidualSkip && pProgram && e.m_pCg->NumCombos( true ) > 1 && e.m_pCg->NumCombos( false ) >= MIN_RESIDUAL_DYNAMIC_COMBOS;
+
+		// Any command of the entry gets decoded straight from its offset
+		e.m_arrIntervals.clear();
+		for ( const Define* pDef = e.m_pCg->GetDefinesBase(); pDef < e.m_pCg->GetDefinesEnd(); ++pDef )
+			e.m_arrIntervals.emplace_back( static_cast<uint64_t>( pDef->Max() ) - pDef->Min() + 1 );
+
+		s_arrCommandStarts.emplace_back( nCurrentCommand );
+		s_arrCommandEntries.emplace_back( &e );
+		nCurrentCommand += e.m_pCg->NumCombos();
+	}
+
+	// Establish the last command terminator
+	{
+		static CfgEntry s_term;
+		s_term.m_eiInfo.m_iCommandStart = s_term.m_eiInfo.m_iCommandEnd = nCurrentCommand;
+		s_term.m_eiInfo.m_numCombos = s_term.m_eiInfo.m_numStaticCombos = s_term.m_eiInfo.m_numDynamicCombos = 1;
+		s_term.m_eiInfo.m_szName = s_term.m_eiInfo.m_szShaderFileName = "";
+		s_arrCommandStarts.emplace_back( nCurrentCommand );
+		s_arrCommandEntries.emplace_back( &s_term );
+	}
+}
+
+// SKIP lines that are true for every combo or for none are most likely mistakes. Goes to
+// stderr, stdout may carry a dry run report.
+static void CheckSkipClauses( const CfgEntry& cfg )
+{
+	const uint64_t numCombos = cfg.m_pCg->NumCombos();
+	for ( size_t i = 0; i < cfg.m_pExpr->NumClauses(); ++i )
+	{
+		CComboDiagram diagram;
+		if ( !diagram.Build( *cfg.m_pCg, *cfg.m_pExpr->Clause( i ) ) )
+			continue;
+
+		const uint64_t nLive = diagram.Count( 0, numCombos );
+		if ( nLive && nLive != numCombos )
+			continue;
+
+		std::cerr << clr::pinkish << cfg.m_szName << ": SKIP line \"" << clr::red << cfg.m_pExpr->ClauseText( i ) << clr::pinkish << "\" "
+				  << ( nLive ? "is never true" : "skips every combo" ) << clr::reset << std::endl;
+	}
+}
+
 void SetupConfigurationDirect( const std::string& name, const std::string& version, uint32_t centroidMask,
 								const std::vector<Parser::Combo>& static_c, const std::vector<Parser::Combo>& dynamic_c,
 								const std::vector<std::string>& skip, const std::vector<std::string>& includes )
@@ -944,7 +2523,9 @@ void SetupConfigurationDirect( const std::string& name, const std::string& versi
 
 	AddCombos( cg, dynamic_c, false );
 	AddCombos( cg, static_c, true );
-	exprSkip.Parse( ( std::accumulate( skip.begin(), skip.end(), "("s, []( const std::string& s, const std::string& sk ) { return s + sk + ")||("; } ) + "0)" ).c_str() );
+	exprSkip.Parse( skip );
+	exprSkip.OrderClauses( cg );
+	CheckSkipClauses( cfg );
 
 	CfgProcessor::CfgEntryInfo& info = cfg.m_eiInfo;
 	info.m_szName = cfg.m_szName;
@@ -954,8 +2535,7 @@ void SetupConfigurationDirect( const std::string& name, const std::string& versi
 	info.m_numDynamicCombos = cg.NumCombos( false );
 	info.m_numStaticCombos = cg.NumCombos( true );
 	info.m_nCentroidMask = centroidMask;
-
-	s_setEntries.insert( std::move( cfg ) );
+	BuildMacroTemplate( cfg );
 
 	char filename[1024];
 	for ( const std::string& file : includes )
@@ -990,38 +2570,8 @@ void SetupConfigurationDirect( const std::string& name, const std::string& versi
 		fileCache.Add( justFilename, std::move( data ) );
 	}
 
-	uint64_t nCurrentCommand = 0;
-	for ( auto it = s_setEntries.rbegin(), itEnd = s_setEntries.rend(); it != itEnd; ++it )
-	{
-		// We establish a command mapping for the beginning of the entry
-		ComboHandleImpl chi;
-		chi.Initialize( nCurrentCommand, &*it );
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
-
-		// We also establish mapping by either splitting the
-		// combos into 500 intervals or stepping by every 1000 combos.
-		const uint64_t iPartStep = std::max<uint64_t>( 1000, chi.m_numCombos / 500 );
-		for ( uint64_t iRecord = nCurrentCommand + iPartStep; iRecord < nCurrentCommand + chi.m_numCombos; iRecord += iPartStep )
-		{
-			uint64_t iAdvance = iPartStep;
-			chi.AdvanceCommands( iAdvance );
-			s_mapComboCommands.emplace( iRecord, chi );
-		}
-
-		nCurrentCommand += chi.m_numCombos;
-	}
-
-	// Establish the last command terminator
-	{
-		static CfgEntry s_term;
-		s_term.m_eiInfo.m_iCommandStart = s_term.m_eiInfo.m_iCommandEnd = nCurrentCommand;
-		s_term.m_eiInfo.m_numCombos = s_term.m_eiInfo.m_numStaticCombos = s_term.m_eiInfo.m_numDynamicCombos = 1;
-		s_term.m_eiInfo.m_szName = s_term.m_eiInfo.m_szShaderFileName = "";
-		ComboHandleImpl chi;
-		chi.m_iTotalCommand = nCurrentCommand;
-		chi.m_pEntry = &s_term;
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
-	}
+	HashSourceFiles( info, includes );
+	s_setEntries.insert( std::move( cfg ) );
 }
 
 static void ProcessConfiguration( const char* pConfigFile )
@@ -1059,7 +2609,9 @@ static void ProcessConfiguration( const char* pConfigFile )
 
 			AddCombos( cg, dynamicCombos, false );
 			AddCombos( cg, staticCombos, true );
-			exprSkip.Parse( curShader["skip"].asCString() );
+			const std::string skip = curShader["skip"].asString();
+			exprSkip.Parse( skip.empty() ? std::vector<std::string>() : std::vector<std::string> { skip } );
+			CheckSkipClauses( cfg );
 
 			CfgProcessor::CfgEntryInfo& info = cfg.m_eiInfo;
 			info.m_szName = cfg.m_szName;
@@ -1069,6 +2621,7 @@ static void ProcessConfiguration( const char* pConfigFile )
 			info.m_numDynamicCombos = cg.NumCombos( false );
 			info.m_numStaticCombos = cg.NumCombos( true );
 			info.m_nCentroidMask = curShader["centroid"].asInt();
+			BuildMacroTemplate( cfg );
 
 			s_setEntries.insert( std::move( cfg ) );
 
@@ -1108,40 +2661,20 @@ static void ProcessConfiguration( const char* pConfigFile )
 
 			fileCache.Add( justFilename, std::move( data ) );
 		}
-	}
-
-	uint64_t nCurrentCommand = 0;
-	for ( auto it = s_setEntries.rbegin(), itEnd = s_setEntries.rend(); it != itEnd; ++it )
-	{
-		// We establish a command mapping for the beginning of the entry
-		ComboHandleImpl chi;
-		chi.Initialize( nCurrentCommand, &*it );
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
 
-		// We also establish mapping by either splitting the
-		// combos into 500 intervals or stepping by every 1000 combos.
-		const uint64_t iPartStep = std::max<uint64_t>( 1000, chi.m_numCombos / 500 );
-		for ( uint64_t iRecord = nCurrentCommand + iPartStep; iRecord < nCurrentCommand + chi.m_numCombos; iRecord += iPartStep )
+		for ( const CfgEntry& e : s_setEntries )
 		{
-			uint64_t iAdvance = iPartStep;
-			chi.AdvanceCommands( iAdvance );
-			s_mapComboCommands.emplace( iRecord, chi );
-		}
+			if ( !configFile.isMember( e.m_szName ) )
+				continue;
 
-		nCurrentCommand += chi.m_numCombos;
+			std::vector<std::string> files;
+			for ( const Json::Value& f : configFile[e.m_szName]["files"] )
+				files.emplace_back( f.asString() );
+			HashSourceFiles( const_cast<CfgProcessor::CfgEntryInfo&>( e.m_eiInfo ), files );
+		}
 	}
 
-	// Establish the last command terminator
-	{
-		static CfgEntry s_term;
-		s_term.m_eiInfo.m_iCommandStart = s_term.m_eiInfo.m_iCommandEnd = nCurrentCommand;
-		s_term.m_eiInfo.m_numCombos = s_term.m_eiInfo.m_numStaticCombos = s_term.m_eiInfo.m_numDynamicCombos = 1;
-		s_term.m_eiInfo.m_szName = s_term.m_eiInfo.m_szShaderFileName = "";
-		ComboHandleImpl chi;
-		chi.m_iTotalCommand = nCurrentCommand;
-		chi.m_pEntry        = &s_term;
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
-	}
+	FinalizeConfiguration();
 }
 
 }; // namespace ConfigurationProcessing
@@ -1158,11 +2691,59 @@ static ComboHandle AsHandle( CPCHI_t* pImpl ) noexcept
 	return reinterpret_cast<ComboHandle>( pImpl );
 }
 
+// Freed handles wait here for the next allocation on the same thread. The worker threads
+// all allocate and free as they go, so a few handles per thread cover it.
+class CHandlePool
+{
+public:
+	static constexpr size_t MAX_POOLED = 32;
+
+	CHandlePool() { m_arrFree.reserve( MAX_POOLED ); }
+	~CHandlePool()
+	{
+		for ( CPCHI_t* pImpl : m_arrFree )
+			delete pImpl;
+	}
+
+	[[nodiscard]] CPCHI_t* Get() noexcept
+	{
+		if ( m_arrFree.empty() )
+			return new( std::nothrow ) CPCHI_t;
+
+		CPCHI_t* pImpl = m_arrFree.back();
+		m_arrFree.pop_back();
+		pImpl->Reset();
+		return pImpl;
+	}
+
+	void Put( CPCHI_t* pImpl ) noexcept
+	{
+		if ( !pImpl )
+			return;
+		if ( m_arrFree.size() < MAX_POOLED )
+			m_arrFree.emplace_back( pImpl );
+		else
+			delete pImpl;
+	}
+
+private:
+	std::vector<CPCHI_t*> m_arrFree;
+};
+static thread_local CHandlePool s_handlePool;
+
 void ReadConfiguration( const char* configFile )
 {
 	ConfigurationProcessing::ProcessConfiguration( configFile );
 }
 
+void SetSkipEvaluation( SkipEvaluation eMode ) noexcept
+{
+	CComplexExpression::s_bCompiledSkip       = eMode != SkipEvaluation::Tree;
+	ConfigurationProcessing::s_bResidualSkip  = eMode == SkipEvaluation::Residual || eMode == SkipEvaluation::LiveMap || eMode == SkipEvaluation::Diagram;
+	ConfigurationProcessing::s_bLiveCombos    = eMode == SkipEvaluation::LiveMap;
+	ConfigurationProcessing::s_bComboDiagram  = eMode == SkipEvaluation::LiveMap || eMode == SkipEvaluation::Diagram;
+}
+
 void DescribeConfiguration( std::unique_ptr<CfgEntryInfo[]>& rarrEntries )
 {
 	rarrEntries = std::make_unique<CfgEntryInfo[]>( ConfigurationProcessing::s_setEntries.size() + 1 );
@@ -1192,44 +2773,186 @@ void DescribeConfiguration( std::unique_ptr<CfgEntryInfo[]>& rarrEntries )
 	pInfo->m_iCommandEnd   = nCurrentCommand;
 }
 
-static const CPCHI_t& GetLessOrEq( uint64_t& k, const CPCHI_t& v )
+// Points the handle at iCommandNumber, or at the terminator past the last entry
+static bool DecodeCommand( CPCHI_t& chi, uint64_t iCommandNumber ) noexcept
+{
+	if ( ConfigurationProcessing::s_arrCommandStarts.empty() )
+		return false;
+
+	const size_t iEntry    = ConfigurationProcessing::FindCommandEntry( iCommandNumber );
+	const uint64_t iStart  = ConfigurationProcessing::s_arrCommandStarts[iEntry];
+	const auto* pEntry     = ConfigurationProcessing::s_arrCommandEntries[iEntry];
+	if ( !pEntry->m_pCg )
+		return chi.Initialize( iStart, pEntry );
+	return chi.Initialize( iCommandNumber, pEntry, iCommandNumber - iStart );
+}
+
+uint64_t Combo_CountLive( uint64_t iCommandStart, uint64_t iCommandEnd )
 {
-	auto it = ConfigurationProcessing::s_mapComboCommands.lower_bound( k );
-	if ( ConfigurationProcessing::s_mapComboCommands.end() == it )
+	// Called once per static combo when packaging gets set up, so start right at the first entry
+	uint64_t nLive = 0;
+	for ( size_t iEntry = ConfigurationProcessing::FindCommandEntry( iCommandStart ); iEntry < ConfigurationProcessing::s_arrCommandEntries.size(); ++iEntry )
 	{
-		if ( ConfigurationProcessing::s_mapComboCommands.empty() )
-			return v;
-		--it;
+		const auto* pEntry             = ConfigurationProcessing::s_arrCommandEntries[iEntry];
+		const uint64_t nCurrentCommand = ConfigurationProcessing::s_arrCommandStarts[iEntry];
+		if ( !pEntry->m_pCg || nCurrentCommand >= iCommandEnd )
+			break;
+
+		const uint64_t iBegin = std::max( iCommandStart, nCurrentCommand );
+		const uint64_t iEnd   = std::min( iCommandEnd, nCurrentCommand + pEntry->m_pCg->NumCombos() );
+		if ( iBegin < iEnd )
+			nLive += pEntry->m_pLive ? pEntry->m_pLive->Count( iBegin - nCurrentCommand, iEnd - nCurrentCommand ) : iEnd - iBegin;
 	}
+	return nLive;
+}
+
+uint64_t Combo_SkipLive( uint64_t iCommand, uint64_t nLive, uint64_t iCommandEnd )
+{
+	if ( ConfigurationProcessing::s_arrCommandStarts.empty() )
+		return std::min( iCommand + nLive, iCommandEnd );
 
-	if ( k < it->first )
+	const size_t iEntry    = ConfigurationProcessing::FindCommandEntry( iCommand );
+	const auto* pEntry     = ConfigurationProcessing::s_arrCommandEntries[iEntry];
+	if ( !pEntry->m_pLive )
+		return std::min( iCommand + nLive, iCommandEnd );
+
+	const uint64_t iShaderStart = ConfigurationProcessing::s_arrCommandStarts[iEntry];
+	const uint64_t iEnd         = std::min( iCommandEnd, iShaderStart + pEntry->m_pCg->NumCombos() );
+	return iShaderStart + pEntry->m_pLive->Skip( iCommand - iShaderStart, nLive, iEnd - iShaderStart );
+}
+
+void Combo_CountLiveDynamic( const CfgEntryInfo* pInfo, uint64_t iStaticFirst, uint64_t iStaticEnd, std::map<uint64_t, uint64_t>& rHistogram )
+{
+	const uint64_t numDynamic = pInfo->m_numDynamicCombos;
+	const auto* pEntry        = ConfigurationProcessing::s_arrCommandEntries[ConfigurationProcessing::FindCommandEntry( pInfo->m_iCommandStart )];
+	if ( pEntry->m_pLive )
+	{
+		for ( uint64_t iStatic = iStaticFirst; iStatic < iStaticEnd; ++iStatic )
+			++rHistogram[pEntry->m_pLive->Count( iStatic * numDynamic, ( iStatic + 1 ) * numDynamic )];
+		return;
+	}
+
+	// Walk the live combos, a static combo is done once one of the next one shows up
+	uint64_t numCounted = 0;
+	uint64_t iStatic = iStaticFirst, nLive = 0;
+	ComboHandle hCombo = nullptr;
+	uint64_t iCommand = pInfo->m_iCommandStart + iStaticFirst * numDynamic;
+	const uint64_t iCommandEnd = pInfo->m_iCommandStart + iStaticEnd * numDynamic;
+	for ( Combo_GetNext( iCommand, hCombo, iCommandEnd ); hCombo; Combo_GetNext( iCommand, hCombo, iCommandEnd ) )
 	{
-		if ( ConfigurationProcessing::s_mapComboCommands.begin() == it )
-			return v;
-		--it;
+		const uint64_t iComboStatic = ( iCommand - pInfo->m_iCommandStart ) / numDynamic;
+		if ( iComboStatic != iStatic && nLive )
+		{
+			++rHistogram[nLive];
+			++numCounted;
+			nLive = 0;
+		}
+		iStatic = iComboStatic;
+		++nLive;
 	}
+	Combo_Free( hCombo );
 
-	k = it->first;
-	return it->second;
+	if ( nLive )
+	{
+		++rHistogram[nLive];
+		++numCounted;
+	}
+	if ( numCounted < iStaticEnd - iStaticFirst )
+		rHistogram[0] += iStaticEnd - iStaticFirst - numCounted;
 }
 
-ComboHandle Combo_GetCombo( uint64_t iCommandNumber )
+void Combo_CountSkipClauses( const CfgEntryInfo* pInfo, uint64_t iComboFirst, uint64_t iComboEnd, std::vector<SkipClauseStats>& rarrStats )
 {
-	// Find earlier command
-	uint64_t iCommandFound = iCommandNumber;
-	const CPCHI_t emptyCPCHI;
-	CPCHI_t const& chiFound = GetLessOrEq( iCommandFound, emptyCPCHI );
+	const auto* pEntry               = ConfigurationProcessing::s_arrCommandEntries[ConfigurationProcessing::FindCommandEntry( pInfo->m_iCommandStart )];
+	const CComplexExpression& expr   = *pEntry->m_pExpr;
+	const ComboGenerator& cg         = *pEntry->m_pCg;
+	const size_t numClauses          = expr.NumClauses();
+	if ( rarrStats.empty() )
+	{
+		rarrStats.resize( numClauses );
+		for ( size_t i = 0; i < numClauses; ++i )
+			rarrStats[i] = SkipClauseStats { expr.ClauseText( i ), 0, 0, 0, 0, 0 };
+		for ( size_t i = 0; i < numClauses; ++i )
+			rarrStats[expr.ClauseOrder()[i]].m_nOrder = gsl::narrow_cast<uint32_t>( i );
+	}
 
-	if ( chiFound.m_iTotalCommand < 0 || chiFound.m_iTotalCommand > iCommandNumber )
-		return nullptr;
+	// A chunk of combos at a time: the define values first, then one clause after
+	// the other over all of them, which keeps the timing apart from the rest
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	const Define* const pDefs = cg.GetDefinesBase();
+	const size_t numDefs      = cg.GetDefinesEnd() - pDefs;
+	std::vector<int> arrValues( CHUNK_SIZE * numDefs );
+	std::vector<uint64_t> arrSkipped( numClauses * CHUNK_SIZE / 64 );
+	for ( uint64_t iChunk = iComboFirst; iChunk < iComboEnd; iChunk += CHUNK_SIZE )
+	{
+		const size_t numCombos = gsl::narrow_cast<size_t>( std::min( CHUNK_SIZE, iComboEnd - iChunk ) );
+		cg.ValuesAt( iChunk, arrValues.data() );
+		for ( size_t i = 1; i < numCombos; ++i )
+		{
+			int* const pValues = &arrValues[i * numDefs];
+			std::copy_n( pValues - numDefs, numDefs, pValues );
+			for ( size_t j = 0; j < numDefs; ++j )
+			{
+				if ( --pValues[j] >= pDefs[j].Min() )
+					break;
+				pValues[j] = pDefs[j].Max();
+			}
+		}
 
-	// Advance the handle as needed
-	CPCHI_t* pImpl = new CPCHI_t( chiFound );
+		std::fill( arrSkipped.begin(), arrSkipped.end(), 0 );
+		for ( size_t c = 0; c < numClauses; ++c )
+		{
+			uint64_t* const pSkipped = &arrSkipped[c * CHUNK_SIZE / 64];
+			const auto tStart = std::chrono::steady_clock::now();
+			for ( size_t i = 0; i < numCombos; ++i )
+			{
+				const int* const pValues = &arrValues[i * numDefs];
+				const CSlotValues ctx( cg, pValues );
+				if ( expr.EvaluateClause( c, &ctx, pValues ) )
+					pSkipped[i >> 6] |= 1ULL << ( i & 63 );
+			}
+			rarrStats[c].m_nEvalNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - tStart ).count();
+		}
 
-	uint64_t iCommandFoundAdvance = iCommandNumber - iCommandFound;
-	pImpl->AdvanceCommands( iCommandFoundAdvance );
+		for ( size_t i = 0; i < numCombos; ++i )
+		{
+			const uint64_t nBit = 1ULL << ( i & 63 );
+			size_t numTrue = 0;
+			for ( size_t c = 0; c < numClauses; ++c )
+				numTrue += ( arrSkipped[c * CHUNK_SIZE / 64 + ( i >> 6 )] & nBit ) != 0;
 
-	return AsHandle( pImpl );
+			bool bEarlier = false;
+			for ( size_t c = 0; c < numClauses && numTrue; ++c )
+			{
+				if ( !( arrSkipped[c * CHUNK_SIZE / 64 + ( i >> 6 )] & nBit ) )
+					continue;
+				++rarrStats[c].m_numSkipped;
+				rarrStats[c].m_numUnique += numTrue == 1;
+				rarrStats[c].m_numRedundant += bEarlier;
+				bEarlier = true;
+			}
+		}
+	}
+}
+
+ComboHandle Combo_GetCombo( uint64_t iCommandNumber )
+{
+	ComboHandle hCombo = nullptr;
+	Combo_SetCombo( iCommandNumber, hCombo );
+	return hCombo;
+}
+
+bool Combo_SetCombo( uint64_t iCommandNumber, ComboHandle& rhCombo )
+{
+	if ( !rhCombo )
+		rhCombo = AsHandle( s_handlePool.Get() );
+
+	if ( !rhCombo || !DecodeCommand( *FromHandle( rhCombo ), iCommandNumber ) )
+	{
+		Combo_Free( rhCombo );
+		return false;
+	}
+	return true;
 }
 
 ComboHandle Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iCommandEnd )
@@ -1240,22 +2963,14 @@ ComboHandle Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint
 	if ( !rhCombo )
 	{
 		// We don't have a combo handle that corresponds to the command
-
-		// Find earlier command
-		uint64_t iCommandFound = riCommandNumber;
-		const CPCHI_t emptyCPCHI;
-		const CPCHI_t& chiFound = GetLessOrEq( iCommandFound, emptyCPCHI );
-
-		if ( !chiFound.m_pEntry || !chiFound.m_pEntry->m_pCg || !chiFound.m_pEntry->m_pExpr || chiFound.m_iTotalCommand < 0 || chiFound.m_iTotalCommand > riCommandNumber )
+		pImpl = s_handlePool.Get();
+		if ( !pImpl || !DecodeCommand( *pImpl, riCommandNumber ) || !pImpl->m_pEntry->m_pCg || !pImpl->m_pEntry->m_pExpr )
+		{
+			s_handlePool.Put( pImpl );
 			return nullptr;
-
-		// Advance the handle as needed
-		pImpl   = new CPCHI_t( chiFound );
+		}
 		rhCombo = AsHandle( pImpl );
 
-		uint64_t iCommandFoundAdvance = riCommandNumber - iCommandFound;
-		pImpl->AdvanceCommands( iCommandFoundAdvance );
-
 		if ( !pImpl->IsSkipped() )
 			return rhCombo;
 	}
@@ -1272,44 +2987,32 @@ ComboHandle Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint
 		// We failed to get the next combo command (out of range)
 		if ( pImpl->m_iTotalCommand + 1 >= iCommandEnd )
 		{
-			delete pImpl;
+			s_handlePool.Put( pImpl );
 			rhCombo         = nullptr;
 			riCommandNumber = iCommandEnd;
 			return nullptr;
 		}
 
-		// Otherwise we just have to obtain the next combo handle
+		// Otherwise the handle moves on to the first combo of the next entry
 		riCommandNumber = pImpl->m_iTotalCommand + 1;
-
-		// Delete the old combo handle
-		delete pImpl;
-		rhCombo = nullptr;
-
-		// Retrieve the next combo handle data
-		uint64_t iCommandLookup = riCommandNumber;
-		CPCHI_t emptyCPCHI;
-		const CPCHI_t& chiNext = GetLessOrEq( iCommandLookup, emptyCPCHI );
-		Assert( iCommandLookup == riCommandNumber && ( chiNext.m_pEntry ) );
-
-		// Set up the new combo handle
-		pImpl   = new CPCHI_t( chiNext );
-		rhCombo = AsHandle( pImpl );
+		DecodeCommand( *pImpl, riCommandNumber );
+		Assert( pImpl->m_iTotalCommand == riCommandNumber && pImpl->m_pEntry->m_pCg );
 
 		if ( !pImpl->IsSkipped() )
 			return rhCombo;
 	}
 }
 
-void Combo_FormatCommand( ComboHandle hCombo, std::span<char> pchBuffer )
+const CmdSink::CompileCommand& Combo_BuildCommand( ComboHandle hCombo, ComboCommand& rCommand )
 {
 	const auto pImpl = FromHandle( hCombo );
-	pImpl->FormatCommand( pchBuffer );
+	return pImpl->BuildCommand( rCommand );
 }
 
-void Combo_FormatCommandHumanReadable( ComboHandle hCombo, std::span<char> pchBuffer )
+std::string Combo_FormatCommandHumanReadable( ComboHandle hCombo )
 {
 	const auto pImpl = FromHandle( hCombo );
-	pImpl->FormatCommandHumanReadable( pchBuffer );
+	return pImpl->FormatCommandHumanReadable();
 }
 
 uint64_t Combo_GetCommandNum( ComboHandle hCombo ) noexcept
@@ -1335,9 +3038,10 @@ const CfgEntryInfo* Combo_GetEntryInfo( ComboHandle hCombo ) noexcept
 
 ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom ) noexcept
 {
-	if ( hComboCopyFrom )
-		return AsHandle( new CPCHI_t( *FromHandle( hComboCopyFrom ) ) );
-	return AsHandle( new( std::nothrow ) CPCHI_t );
+	CPCHI_t* pImpl = s_handlePool.Get();
+	if ( pImpl && hComboCopyFrom )
+		*pImpl = *FromHandle( hComboCopyFrom );
+	return AsHandle( pImpl );
 }
 
 void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc )
@@ -1348,7 +3052,7 @@ void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc )
 
 void Combo_Free( ComboHandle& rhComboFree ) noexcept
 {
-	delete FromHandle( rhComboFree );
+	s_handlePool.Put( FromHandle( rhComboFree ) );
 	rhComboFree = nullptr;
 }
 }; // namespace CfgProcessor
\ No newline at end of file
@@ -13,8 +13,12 @@
 #endif
 
 #include "basetypes.h"
+#include "cmdsink.h"
+#include <map>
 #include <span>
 #include <memory>
+#include <string>
+#include <vector>
 
 /*
 
@@ -36,6 +40,10 @@ GetNextCombo( 29, -1, 36 ) -> shader3.fxc : ( riCommandNumber = 31, rhCombo =  "
 
 namespace CfgProcessor
 {
+// Static and dynamic defines a shader can have, combos are counted in 64 bits
+// so more than this could not all take two values anyway
+constexpr size_t MAX_DEFINES = 64;
+
 // Working with configuration
 void ReadConfiguration( const char* configFile );
 
@@ -50,10 +58,24 @@ struct CfgEntryInfo
 	uint64_t	m_iCommandStart;			// Start command, e.g. 0
 	uint64_t	m_iCommandEnd;			// End command, e.g. 1024
 	int			m_nCentroidMask;			// Mask of centroid samplers
+	uint8_t		m_sourceHash[32];		// SHA-256 of the src file and its includes
+	uint64_t	m_numLiveCombos;			// Combos left after SKIP, 0 if they were not counted up front
 };
 
 void DescribeConfiguration( std::unique_ptr<CfgEntryInfo[]>& rarrEntries );
 
+// How skip expressions get evaluated, only changed for benchmarking
+enum class SkipEvaluation
+{
+	Tree,     // Walks the expression trees
+	Compiled, // Runs the flattened programs combo by combo
+	Residual, // Specializes them for every static combo, then runs what is left combo by combo
+	LiveMap,  // Runs them over blocks of combos up front, into a map of live combos (default), Diagram for shaders too big for a map
+	Diagram,  // Builds a decision diagram of the live combos, Residual if it gets too big
+};
+// The live combo maps and diagrams come and go with the next FinalizeConfiguration
+void SetSkipEvaluation( SkipEvaluation eMode ) noexcept;
+
 // Working with combos
 struct __ComboHandle
 {
@@ -61,10 +83,47 @@ struct __ComboHandle
 };
 using ComboHandle = __ComboHandle*;
 
+// Caller-owned storage for compile commands. Keep one around and build all the commands
+// into it, the macro list is only copied when the shader changes, then just the values get patched.
+struct ComboCommand
+{
+	CmdSink::CompileCommand m_command;
+	std::vector<CmdSink::ShaderMacro> m_arrMacros;
+	std::vector<char> m_arrValues;
+	const void* m_pTemplate = nullptr;
+};
+
+// Commands in the range that are not skipped, commands of shaders without a live combo map or diagram all count
+uint64_t Combo_CountLive( uint64_t iCommandStart, uint64_t iCommandEnd );
+// The command right after the nLive-th live one from iCommand, at most iCommandEnd or the end of the shader if it has a live combo map or diagram
+uint64_t Combo_SkipLive( uint64_t iCommand, uint64_t nLive, uint64_t iCommandEnd );
+// For every static combo of the entry in [iStaticFirst, iStaticEnd), in command order, counts its live
+// dynamic combos into rHistogram[count]. Can run on several threads at once for different ranges.
+void Combo_CountLiveDynamic( const CfgEntryInfo* pInfo, uint64_t iStaticFirst, uint64_t iStaticEnd, std::map<uint64_t, uint64_t>& rHistogram );
+
+// What one SKIP line of a shader does, for -skip-report
+struct SkipClauseStats
+{
+	std::string	m_szClause;				// As written in the SKIP line
+	uint32_t	m_nOrder;				// Position in the evaluation order, by selectivity over cost
+	uint64_t	m_numSkipped;			// Combos the clause is true for
+	uint64_t	m_numUnique;			// Combos no other clause skips
+	uint64_t	m_numRedundant;			// Combos an earlier SKIP line skips already
+	uint64_t	m_nEvalNanoseconds;		// Time spent evaluating the clause on its own
+};
+// Evaluates every SKIP line of the entry on its own over the combos in [iComboFirst, iComboEnd), counted from the
+// start of the entry, and adds up the results in rarrStats, which gets set up first if it is empty. Can run on
+// several threads at once for different ranges.
+void Combo_CountSkipClauses( const CfgEntryInfo* pInfo, uint64_t iComboFirst, uint64_t iComboEnd, std::vector<SkipClauseStats>& rarrStats );
+
+// Handles come from a per-thread pool and go back there when freed, after the first few
+// nothing here touches the heap. Combo_GetNext keeps using the handle it was given.
 ComboHandle Combo_GetCombo( uint64_t iCommandNumber );
+// Points a caller-owned handle at the command, allocating it first if it is null
+bool Combo_SetCombo( uint64_t iCommandNumber, ComboHandle& rhCombo );
 ComboHandle Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iCommandEnd );
-void Combo_FormatCommand( ComboHandle hCombo, std::span<char> pchBuffer );
-void Combo_FormatCommandHumanReadable( ComboHandle hCombo, std::span<char> pchBuffer );
+const CmdSink::CompileCommand& Combo_BuildCommand( ComboHandle hCombo, ComboCommand& rCommand );
+std::string Combo_FormatCommandHumanReadable( ComboHandle hCombo );
 uint64_t Combo_GetCommandNum( ComboHandle hCombo ) noexcept;
 uint64_t Combo_GetComboNum( ComboHandle hCombo ) noexcept;
 const CfgEntryInfo* Combo_GetEntryInfo( ComboHandle hCombo ) noexcept;
@@ -12,9 +12,26 @@
 	#pragma once
 #endif
 
+#include <span>
+
 namespace CmdSink
 {
 
+// Layout-compatible with D3D_SHADER_MACRO, so backends can forward it as is
+struct ShaderMacro
+{
+	const char* Name;
+	const char* Definition;
+};
+
+// One combo to compile, all the strings are owned by the caller
+struct CompileCommand
+{
+	const char* m_szFileName;			// Name of the src file, e.g. "shader_psxx.fxc"
+	const char* m_szShaderModel;		// Shader model, e.g. "ps_3_0"
+	std::span<const ShaderMacro> m_macros;	// Defines, null-terminated
+};
+
 /*
 
 struct IResponse
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cmdsink.h"
+
+namespace InterceptFxc
+{
+	//
+	// Compiler backend. Turns one combo command and the D3DCOMPILE flags into a response.
+	// Must be safe to call from several threads at once.
+	//
+	class ICompilerBackend
+	{
+	public:
+		virtual ~ICompilerBackend() = default;
+
+		[[nodiscard]] virtual const char* Name() const noexcept = 0;
+		virtual void Compile( const CmdSink::CompileCommand& command, unsigned long flags, CmdSink::IResponse** ppResponse ) = 0;
+
+		// Runs just the preprocessor over the combo. Returns false if the backend can't do that
+		// or preprocessing failed, the combo then has to go through Compile.
+		virtual bool Preprocess( const CmdSink::CompileCommand& command, std::string& rText ) { return false; }
+		// Compiles the text Preprocess produced for the command
+		virtual void CompilePreprocessed( const CmdSink::CompileCommand& command, const std::string& text, unsigned long flags, CmdSink::IResponse** ppResponse ) { Compile( command, flags, ppResponse ); }
+	};
+
+	// Backends register themselves during static initialization
+	void RegisterBackend( ICompilerBackend* pBackend );
+	[[nodiscard]] bool SetActiveBackend( const char* szName );
+	[[nodiscard]] ICompilerBackend* GetActiveBackend() noexcept;
+	[[nodiscard]] std::vector<const char*> GetBackendNames();
+
+	struct CBackendRegistrar
+	{
+		explicit CBackendRegistrar( ICompilerBackend* pBackend ) { RegisterBackend( pBackend ); }
+	};
+
+	// Synthetic backend defaults, used for combos that do not define SYNTHETIC_SIZE/SYNTHETIC_LATENCY themselves
+	void SetSyntheticDefaults( size_t nByteCodeSize, uint32_t nLatencyMicroseconds );
+} // namespace InterceptFxc
@@ -10,10 +10,13 @@
 
 #include "basetypes.h"
 #include "cmdsink.h"
+#include "compilerbackend.h"
 #include "d3dcompiler.h"
 #include "gsl/gsl_narrow"
+#include <cstddef>
 #include <span>
 #include <malloc.h>
+#include <string>
 #include <vector>
 
 #pragma comment( lib, "D3DCompiler" )
@@ -50,9 +53,50 @@ FileCache fileCache;
 
 namespace InterceptFxc
 {
-// The command that is intercepted by this namespace routines
-static constexpr const char s_pszCommand[] = "command";
-static constexpr size_t s_uCommandLen      = ARRAYSIZE( s_pszCommand );
+static_assert( sizeof( CmdSink::ShaderMacro ) == sizeof( D3D_SHADER_MACRO ) );
+static_assert( offsetof( CmdSink::ShaderMacro, Name ) == offsetof( D3D_SHADER_MACRO, Name ) );
+static_assert( offsetof( CmdSink::ShaderMacro, Definition ) == offsetof( D3D_SHADER_MACRO, Definition ) );
+
+//
+// Backend registry
+//
+static std::vector<ICompilerBackend*>& Backends()
+{
+	static std::vector<ICompilerBackend*> s_backends;
+	return s_backends;
+}
+static ICompilerBackend* s_pActiveBackend = nullptr;
+
+void RegisterBackend( ICompilerBackend* pBackend )
+{
+	Backends().emplace_back( pBackend );
+}
+
+bool SetActiveBackend( const char* szName )
+{
+	for ( ICompilerBackend* pBackend : Backends() )
+	{
+		if ( !strcmp( pBackend->Name(), szName ) )
+		{
+			s_pActiveBackend = pBackend;
+			return true;
+		}
+	}
+	return false;
+}
+
+ICompilerBackend* GetActiveBackend() noexcept
+{
+	return s_pActiveBackend;
+}
+
+std::vector<const char*> GetBackendNames()
+{
+	std::vector<const char*> names;
+	for ( const ICompilerBackend* pBackend : Backends() )
+		names.emplace_back( pBackend->Name() );
+	return names;
+}
 
 namespace Private
 {
@@ -115,6 +159,20 @@ namespace Private
 			m_pListing->Release();
 	}
 
+	static void MakeResponse( ID3DBlob* pShader, ID3DBlob* pErrorMessages, HRESULT hr, CmdSink::IResponse** ppResponse )
+	{
+		if ( ppResponse )
+			*ppResponse = new( std::nothrow ) CResponse( pShader, pErrorMessages, hr );
+		else
+		{
+			if ( pShader )
+				pShader->Release();
+
+			if ( pErrorMessages )
+				pErrorMessages->Release();
+		}
+	}
+
 	//
 	// Perform a fast shader file compilation.
 	//
@@ -138,54 +196,75 @@ namespace Private
 			s_incDxImpl.Close( lpcvData );
 		}
 
-		if ( ppResponse )
-			*ppResponse = new( std::nothrow ) CResponse( pShader, pErrorMessages, hr );
-		else
+		MakeResponse( pShader, pErrorMessages, hr, ppResponse );
+	}
+
+	//
+	// Compiles the output of D3DPreprocess, everything got expanded and included already
+	//
+	void PreprocessedShaderCompile( const char* pszFilename, const std::string& text, const char* pszModel, CmdSink::IResponse** ppResponse, DWORD flags )
+	{
+		ID3DBlob* pShader        = nullptr; // NOTE: Must release the COM interface later
+		ID3DBlob* pErrorMessages = nullptr; // NOTE: Must release COM interface later
+
+		const HRESULT hr = D3DCompile( text.data(), text.size(), pszFilename, nullptr, nullptr, "main", pszModel, flags, 0, &pShader, &pErrorMessages );
+
+		MakeResponse( pShader, pErrorMessages, hr, ppResponse );
+	}
+
+	//
+	// Default backend, compiles with D3DCompile
+	//
+	class CD3DCompilerBackend final : public ICompilerBackend
+	{
+	public:
+		const char* Name() const noexcept override { return "d3dcompiler"; }
+		void Compile( const CmdSink::CompileCommand& command, unsigned long flags, CmdSink::IResponse** ppResponse ) override
 		{
-			if ( pShader )
-				pShader->Release();
+			const std::span<const D3D_SHADER_MACRO> d3dMacros( reinterpret_cast<const D3D_SHADER_MACRO*>( command.m_macros.data() ), command.m_macros.size() );
+			FastShaderCompile( command.m_szFileName, d3dMacros, command.m_szShaderModel, ppResponse, flags );
+		}
+
+		bool Preprocess( const CmdSink::CompileCommand& command, std::string& rText ) override
+		{
+			LPCVOID lpcvData = nullptr;
+			UINT numBytes    = 0;
+			if ( FAILED( s_incDxImpl.Open( D3D_INCLUDE_LOCAL, command.m_szFileName, nullptr, &lpcvData, &numBytes ) ) )
+				return false;
+
+			ID3DBlob* pText          = nullptr; // NOTE: Must release the COM interface later
+			ID3DBlob* pErrorMessages = nullptr; // NOTE: Must release COM interface later
+			const HRESULT hr = D3DPreprocess( lpcvData, numBytes, command.m_szFileName, reinterpret_cast<const D3D_SHADER_MACRO*>( command.m_macros.data() ), &s_incDxImpl, &pText, &pErrorMessages );
+			s_incDxImpl.Close( lpcvData );
 
 			if ( pErrorMessages )
 				pErrorMessages->Release();
+
+			const bool bSucceeded = !FAILED( hr ) && pText;
+			if ( bSucceeded )
+				rText.assign( static_cast<const char*>( pText->GetBufferPointer() ), pText->GetBufferSize() );
+
+			if ( pText )
+				pText->Release();
+
+			return bSucceeded;
 		}
-	}
+
+		void CompilePreprocessed( const CmdSink::CompileCommand& command, const std::string& text, unsigned long flags, CmdSink::IResponse** ppResponse ) override
+		{
+			PreprocessedShaderCompile( command.m_szFileName, text, command.m_szShaderModel, ppResponse, flags );
+		}
+	};
+	static CD3DCompilerBackend s_d3dBackend;
+	static CBackendRegistrar s_d3dBackendReg( &s_d3dBackend );
 } // namespace Private
 
 //
-// Completely mimic the behaviour of "fxc.exe" in the specific cases related
-// to shader compilations.
-//
-// @param pCommand       the command in form
-//		"fxc.exe /DSHADERCOMBO=1 /DTOTALSHADERCOMBOS=4 /DCENTROIDMASK=0 /DNUMDYNAMICCOMBOS=4 /DFLAGS=0x0 /DNUM_BONES=1 /Dmain=main /Emain /Tvs_2_0 /DSHADER_MODEL_VS_2_0=1 /D_X360=1 /nologo /Foshader.o debugdrawenvmapmask_vs20.fxc>output.txt 2>&1"
+// Hands the combo command over to the active backend. The macro list is built
+// by the combo handle and goes to the compiler without any reparsing.
 //
-void ExecuteCommand( const char* pCommand, CmdSink::IResponse** ppResponse, unsigned long flags )
+void ExecuteCommand( const CmdSink::CompileCommand& command, CmdSink::IResponse** ppResponse, unsigned long flags )
 {
-	// Expect that the command passed is exactly "fxc.exe"
-	Assert( !strncmp( pCommand, s_pszCommand, s_uCommandLen ) );
-	pCommand += s_uCommandLen;
-
-	// Macros to be defined for D3DX
-	std::vector<D3D_SHADER_MACRO> macros;
-
-	const char* curIter = pCommand;
-	char const* pszFilename = curIter;
-	curIter += strlen( curIter ) + 1;
-	char const* szShaderModel = curIter;
-	curIter += strlen( curIter ) + 1;
-	while ( *curIter )
-	{
-		D3D_SHADER_MACRO macro;
-		macro.Name = curIter;
-		curIter += strlen( curIter ) + 1;
-		macro.Definition = curIter;
-		curIter += strlen( curIter ) + 1;
-		macros.emplace_back( std::move( macro ) );
-	}
-
-	// Add a NULL-terminator
-	macros.emplace_back( D3D_SHADER_MACRO { nullptr, nullptr } );
-
-	// Compile the stuff
-	Private::FastShaderCompile( pszFilename, macros, szShaderModel, ppResponse, flags );
+	GetActiveBackend()->Compile( command, flags, ppResponse );
 }
-} // namespace InterceptFxc
\ No newline at end of file
+} // namespace InterceptFxc
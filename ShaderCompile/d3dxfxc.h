@@ -49,7 +49,8 @@ extern FileCache fileCache;
 
 namespace InterceptFxc
 {
-	void ExecuteCommand( const char* pCommand, CmdSink::IResponse** ppResponse, unsigned long flags );
+	// Hands the command to the active compiler backend (see compilerbackend.h)
+	void ExecuteCommand( const CmdSink::CompileCommand& command, CmdSink::IResponse** ppResponse, unsigned long flags );
 }; // namespace InterceptFxc
 
 #endif // #ifndef D3DXFXC_H
\ No newline at end of file
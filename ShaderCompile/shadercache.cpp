@@ -0,0 +1,292 @@
+//
+// Purpose: Persistent bytecode cache, see shadercache.h.
+//
+
+#include "shadercache.h"
+
+#include "basetypes.h"
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "gsl/gsl_narrow"
+#include "CRC32.hpp"
+
+extern "C" {
+#include "C/7zTypes.h"
+#include "C/Sha256.c"
+}
+
+namespace fs = std::filesystem;
+
+namespace ShaderCache
+{
+static_assert( sizeof( CSha256 ) <= sizeof( uint64_t[13] ) && alignof( CSha256 ) <= alignof( uint64_t ) );
+
+CHasher::CHasher() noexcept
+{
+	Sha256_Init( reinterpret_cast<CSha256*>( m_state ) );
+}
+
+void CHasher::Update( const void* pData, size_t nSize ) noexcept
+{
+	Sha256_Update( reinterpret_cast<CSha256*>( m_state ), static_cast<const Byte*>( pData ), nSize );
+}
+
+Digest CHasher::Final() noexcept
+{
+	Digest digest;
+	Sha256_Final( reinterpret_cast<CSha256*>( m_state ), digest.data() );
+	return digest;
+}
+
+// Bump when the key or the entry layout changes, old entries then just age out
+static constexpr const char* CACHE_KEY_VERSION = "shadercache 1";
+static constexpr uint32_t CACHE_ID             = 0x31434353; // "SCC1"
+
+struct cache_header_t
+{
+	uint32_t id;
+	uint32_t codeSize;
+	uint32_t listingSize; // including the terminator, zero if there was no listing
+	uint32_t crc;         // of the bytecode followed by the listing
+};
+
+static fs::path s_dir;
+static uint64_t s_nMaxSize = 0;
+static bool s_bEnabled     = false;
+
+static std::atomic<uint64_t> s_nHits { 0 };
+static std::atomic<uint64_t> s_nMisses { 0 };
+static std::atomic<uint64_t> s_nStored { 0 };
+static std::atomic<uint64_t> s_nBytesRead { 0 };
+static std::atomic<uint64_t> s_nBytesWritten { 0 };
+static std::atomic<uint64_t> s_nEvicted { 0 };
+
+static constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+// <dir>/ab/abcdef..., the first byte spreads the entries over 256 directories
+static fs::path EntryPath( const Digest& key )
+{
+	char name[sizeof( Digest ) * 2 + 1];
+	for ( size_t i = 0; i < key.size(); ++i )
+	{
+		name[i * 2]     = HEX_DIGITS[key[i] >> 4];
+		name[i * 2 + 1] = HEX_DIGITS[key[i] & 0xF];
+	}
+	name[sizeof( name ) - 1] = '\0';
+
+	return s_dir / std::string_view( name, 2 ) / name;
+}
+
+//
+// Response served from the cache
+//
+class CResponse final : public CmdSink::IResponse
+{
+public:
+	CResponse( std::vector<char>&& data, size_t nCodeSize ) noexcept : m_data( std::move( data ) ), m_nCodeSize( nCodeSize ) {}
+
+	bool Succeeded() noexcept override { return true; }
+	size_t GetResultBufferLen() override { return m_nCodeSize; }
+	const void* GetResultBuffer() override { return m_data.data(); }
+	const char* GetListing() override { return m_data.size() > m_nCodeSize ? m_data.data() + m_nCodeSize : nullptr; }
+
+private:
+	std::vector<char> m_data;
+	size_t m_nCodeSize;
+};
+
+bool Init( const std::string& dir, uint64_t nMaxSize )
+{
+	s_dir      = dir;
+	s_nMaxSize = nMaxSize;
+
+	std::error_code ec;
+	fs::create_directories( s_dir, ec );
+	if ( ec )
+		return false;
+
+	// Create all the buckets up front, so storing never has to check
+	for ( uint32_t i = 0; i < 256; ++i )
+	{
+		const char bucket[] = { HEX_DIGITS[i >> 4], HEX_DIGITS[i & 0xF], '\0' };
+		fs::create_directory( s_dir / bucket, ec );
+		if ( ec )
+			return false;
+	}
+
+	s_bEnabled = true;
+	return true;
+}
+
+bool IsEnabled() noexcept
+{
+	return s_bEnabled;
+}
+
+Digest MakeKey( const uint8_t ( &sourceHash )[32], const CmdSink::CompileCommand& command, unsigned long flags, const char* szBackend )
+{
+	CHasher hasher;
+	hasher.Update( CACHE_KEY_VERSION );
+	hasher.Update( szBackend );
+	hasher.Update( sourceHash, sizeof( sourceHash ) );
+	hasher.Update( command.m_szFileName );
+	hasher.Update( command.m_szShaderModel );
+
+	const uint32_t nFlags = static_cast<uint32_t>( flags );
+	hasher.Update( &nFlags, sizeof( nFlags ) );
+
+	for ( const CmdSink::ShaderMacro& macro : command.m_macros )
+	{
+		if ( !macro.Name )
+			break;
+		hasher.Update( macro.Name );
+		hasher.Update( macro.Definition ? macro.Definition : "" );
+	}
+
+	return hasher.Final();
+}
+
+CmdSink::IResponse* Lookup( const Digest& key )
+{
+	const fs::path path = EntryPath( key );
+
+	std::ifstream file( path, std::ios::binary | std::ios::ate );
+	if ( !file )
+	{
+		++s_nMisses;
+		return nullptr;
+	}
+
+	const uint64_t nFileSize = file.tellg();
+	file.seekg( 0, std::ios::beg );
+
+	cache_header_t header;
+	if ( nFileSize < sizeof( header ) || !file.read( reinterpret_cast<char*>( &header ), sizeof( header ) )
+		 || header.id != CACHE_ID || static_cast<uint64_t>( header.codeSize ) + header.listingSize != nFileSize - sizeof( header ) )
+	{
+		++s_nMisses;
+		return nullptr;
+	}
+
+	std::vector<char> data( static_cast<size_t>( header.codeSize ) + header.listingSize );
+	if ( !file.read( data.data(), data.size() ) || CRC32::ProcessSingleBuffer( data.data(), data.size() ) != header.crc
+		 || ( header.listingSize && data.back() != '\0' ) )
+	{
+		++s_nMisses;
+		return nullptr;
+	}
+	file.close();
+
+	// Recently used entries survive trimming
+	std::error_code ec;
+	fs::last_write_time( path, fs::file_time_type::clock::now(), ec );
+
+	++s_nHits;
+	s_nBytesRead += data.size();
+	return new( std::nothrow ) CResponse( std::move( data ), header.codeSize );
+}
+
+void Store( const Digest& key, CmdSink::IResponse* pResponse )
+{
+	const char* pCode         = static_cast<const char*>( pResponse->GetResultBuffer() );
+	const size_t nCodeSize    = pResponse->GetResultBufferLen();
+	const char* szListing     = pResponse->GetListing();
+	const size_t nListingSize = szListing ? strlen( szListing ) + 1 : 0;
+
+	CRC32::CRC32_t crc;
+	CRC32::Init( crc );
+	CRC32::ProcessBuffer( crc, pCode, nCodeSize );
+	if ( nListingSize )
+		CRC32::ProcessBuffer( crc, szListing, nListingSize );
+	CRC32::Final( crc );
+
+	const cache_header_t header { CACHE_ID, static_cast<uint32_t>( nCodeSize ), static_cast<uint32_t>( nListingSize ), crc };
+
+	// Write to a file of our own and move it in place, so readers never see half an entry
+	const fs::path path = EntryPath( key );
+	fs::path tmpPath    = path;
+	tmpPath += ".tmp" + std::to_string( std::hash<std::thread::id>()( std::this_thread::get_id() ) );
+
+	std::error_code ec;
+	{
+		std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+		if ( !file )
+			return;
+
+		file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+		file.write( pCode, nCodeSize );
+		if ( nListingSize )
+			file.write( szListing, nListingSize );
+		if ( !file )
+		{
+			file.close();
+			fs::remove( tmpPath, ec );
+			return;
+		}
+	}
+
+	fs::rename( tmpPath, path, ec );
+	if ( ec )
+	{
+		fs::remove( tmpPath, ec );
+		return;
+	}
+
+	++s_nStored;
+	s_nBytesWritten += sizeof( header ) + nCodeSize + nListingSize;
+}
+
+void Shutdown()
+{
+	if ( !s_bEnabled )
+		return;
+
+	struct Entry
+	{
+		fs::path path;
+		uint64_t size;
+		fs::file_time_type time;
+	};
+	std::vector<Entry> entries;
+	uint64_t nTotalSize = 0;
+
+	std::error_code ec;
+	for ( fs::recursive_directory_iterator it( s_dir, ec ), itEnd; !ec && it != itEnd; it.increment( ec ) )
+	{
+		if ( !it->is_regular_file( ec ) )
+			continue;
+
+		Entry& e = entries.emplace_back( Entry { it->path(), it->file_size( ec ), it->last_write_time( ec ) } );
+		nTotalSize += e.size;
+	}
+
+	if ( nTotalSize <= s_nMaxSize )
+		return;
+
+	// Least recently used first
+	std::sort( entries.begin(), entries.end(), []( const Entry& a, const Entry& b ) { return a.time < b.time; } );
+	for ( const Entry& e : entries )
+	{
+		if ( nTotalSize <= s_nMaxSize )
+			break;
+		if ( fs::remove( e.path, ec ) )
+		{
+			nTotalSize -= e.size;
+			++s_nEvicted;
+		}
+	}
+}
+
+Stats GetStats() noexcept
+{
+	return Stats { s_nHits, s_nMisses, s_nStored, s_nBytesRead, s_nBytesWritten, s_nEvicted };
+}
+} // namespace ShaderCache
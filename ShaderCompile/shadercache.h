@@ -0,0 +1,74 @@
+//
+// Purpose: Persistent bytecode cache.
+//
+// Content-addressed store of compiled combos that survives between runs,
+// enabled with "-cache <dir>". A combo is keyed by a SHA-256 over the shader
+// source and all of its includes, the full macro set, the target profile,
+// the D3DCOMPILE flags and the compiler backend, so any change to one of
+// those simply misses. Only combos that compiled successfully get stored.
+//
+// Every entry is a file named after its key. Hits refresh the file time,
+// and the cache is trimmed back to "-cache-size" at the end of the run,
+// least recently used entries first.
+//
+
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "cmdsink.h"
+
+namespace ShaderCache
+{
+	using Digest = std::array<uint8_t, 32>;
+
+	// Incremental SHA-256
+	class CHasher
+	{
+	public:
+		CHasher() noexcept;
+
+		void Update( const void* pData, size_t nSize ) noexcept;
+		// Includes the terminator, so "ab"+"c" and "a"+"bc" hash differently
+		void Update( const char* sz ) noexcept { Update( sz, strlen( sz ) + 1 ); }
+
+		[[nodiscard]] Digest Final() noexcept;
+
+	private:
+		uint64_t m_state[13]; // CSha256, kept opaque so the 7-zip headers stay out of here
+	};
+
+	struct Stats
+	{
+		uint64_t m_nHits;
+		uint64_t m_nMisses;
+		uint64_t m_nStored;
+		uint64_t m_nBytesRead;
+		uint64_t m_nBytesWritten;
+		uint64_t m_nEvicted;
+	};
+
+	// Returns false if the directory can't be created
+	bool Init( const std::string& dir, uint64_t nMaxSize );
+	[[nodiscard]] bool IsEnabled() noexcept;
+
+	[[nodiscard]] Digest MakeKey( const uint8_t ( &sourceHash )[32], const CmdSink::CompileCommand& command, unsigned long flags, const char* szBackend );
+
+	// Returns a response with the cached bytecode and listing, or nullptr on a miss
+	[[nodiscard]] CmdSink::IResponse* Lookup( const Digest& key );
+	// Stores a successful response, failures to write are ignored
+	void Store( const Digest& key, CmdSink::IResponse* pResponse );
+
+	// Trims the cache down to the size limit
+	void Shutdown();
+	[[nodiscard]] Stats GetStats() noexcept;
+} // namespace ShaderCache
+
+#endif // #ifndef SHADERCACHE_H
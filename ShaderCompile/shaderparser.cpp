@@ -14,6 +14,7 @@
 #include <cctype>
 
 #include "shaderparser.h"
+#include "shadercache.h"
 #include "termcolor/style.hpp"
 #include "termcolors.hpp"
 #include "re2/re2.h"
@@ -79,12 +80,40 @@ std::string Parser::ConstructName( const std::string& baseName, const std::strin
 	return name + ver;
 }
 
+//
+// Dependency manifest, kept next to the vcs as <name>.vcs.deps. Lists every file the
+// shader was built from with its size, write time and content hash, plus the crc the
+// files add up to. As long as the vcs carries that crc and no file changed, the crc
+// is known without reading and lexing the whole include tree again.
+//
+struct Dependency
+{
+	fs::path path;
+	uintmax_t size;
+	int64_t time;
+	std::string hash;
+};
+
+// Stamps the file, returns false if it is gone
+static bool StatFile( Dependency& dep )
+{
+	std::error_code ec;
+	dep.size = fs::file_size( dep.path, ec );
+	if ( ec )
+		return false;
+	dep.time = fs::last_write_time( dep.path, ec ).time_since_epoch().count();
+	return !ec;
+}
+
 template <typename T>
-static bool ReadFile( const fs::path& name, std::vector<std::string>& includes, T& func )
+static bool ReadFile( const fs::path& name, std::vector<std::string>& includes, T& func, std::vector<Dependency>* pDeps = nullptr )
 {
 	const auto rawName = name.filename().string();
 	const auto parent = name.parent_path();
 	includes.emplace_back( rawName );
+	// Stamped before reading, so a change while we are at it shows up next time
+	if ( pDeps )
+		StatFile( pDeps->emplace_back( Dependency { name } ) );
 	std::ifstream file( name );
 	if ( file.fail() )
 	{
@@ -117,7 +146,7 @@ static bool ReadFile( const fs::path& name, std::vector<std::string>& includes,
 		if ( re2::RE2::PartialMatch( reducedLine.empty() ? line : reducedLine, r::inc, &incl ) && !( reducedLine.empty() ? line : reducedLine ).starts_with( "//"sv ) )
 		{
 			reducedLine.clear();
-			if ( !ReadFile( parent / incl, includes, func ) )
+			if ( !ReadFile( parent / incl, includes, func, pDeps ) )
 				return false;
 			continue;
 		}
@@ -310,11 +339,103 @@ void Parser::WriteInclude( const std::string& fileName, const std::string& name,
 	fs::permissions( fileName, fs::perms::owner_read );
 }
 
+static constexpr std::string_view DEPS_HEADER = "ShaderCompile deps 1"sv;
+
+static std::string HashFile( const fs::path& path )
+{
+	std::ifstream file( path, std::ios::binary );
+	if ( !file )
+		return {};
+
+	ShaderCache::CHasher hasher;
+	char buffer[16384];
+	while ( file.read( buffer, sizeof( buffer ) ) || file.gcount() )
+		hasher.Update( buffer, gsl::narrow<size_t>( file.gcount() ) );
+
+	std::string hash;
+	for ( const uint8_t b : hasher.Final() )
+	{
+		hash += "0123456789abcdef"[b >> 4];
+		hash += "0123456789abcdef"[b & 0xF];
+	}
+	return hash;
+}
+
+static bool ReadDeps( const fs::path& depsPath, uint32_t& crc32, std::vector<Dependency>& deps )
+{
+	std::ifstream file( depsPath );
+	std::string line;
+	if ( !std::getline( file, line ) || line != DEPS_HEADER || !( file >> std::hex >> crc32 >> std::dec ) )
+		return false;
+
+	for ( Dependency dep; file >> dep.size >> dep.time >> dep.hash && std::getline( file >> std::ws, line ); )
+	{
+		dep.path = line;
+		deps.emplace_back( std::move( dep ) );
+	}
+	return !deps.empty() && file.eof();
+}
+
+static void WriteDeps( const fs::path& depsPath, uint32_t crc32, const std::vector<Dependency>& deps )
+{
+	// Written aside and moved in place, so a torn manifest never gets read
+	std::error_code ec;
+	fs::path tmpPath = depsPath;
+	tmpPath += ".tmp"sv;
+	{
+		std::ofstream file( tmpPath, std::ios::trunc );
+		if ( !file )
+			return;
+
+		file << DEPS_HEADER << "\n"sv << std::hex << crc32 << std::dec << "\n"sv;
+		for ( const Dependency& dep : deps )
+			file << dep.size << " "sv << dep.time << " "sv << dep.hash << " "sv << dep.path.string() << "\n"sv;
+		if ( !file )
+		{
+			file.close();
+			fs::remove( tmpPath, ec );
+			return;
+		}
+	}
+	fs::rename( tmpPath, depsPath, ec );
+}
+
+// Fast path: every file still has its stamps, or at least its content
+static bool CheckDeps( const fs::path& depsPath, uint32_t binCrc )
+{
+	uint32_t crc32 = 0;
+	std::vector<Dependency> deps;
+	if ( !ReadDeps( depsPath, crc32, deps ) || crc32 != binCrc )
+		return false;
+
+	bool bRestamped = false;
+	for ( Dependency& dep : deps )
+	{
+		Dependency current { dep.path };
+		if ( !StatFile( current ) )
+			return false;
+		if ( current.size == dep.size && current.time == dep.time )
+			continue;
+
+		// Touched, see whether anything actually changed
+		if ( current.size != dep.size || HashFile( dep.path ) != dep.hash )
+			return false;
+
+		dep.time   = current.time;
+		bRestamped = true;
+	}
+
+	if ( bRestamped )
+		WriteDeps( depsPath, crc32, deps );
+	return true;
+}
+
 bool Parser::CheckCrc( const std::string& sourceFile, const std::string& name, uint32_t& crc32 )
 {
 	uint32_t binCrc = 0;
+	const auto fxcPath = fs::path( sourceFile ).parent_path() / "shaders"sv / "fxc"sv;
 	{
-		const auto filePath = fs::path( sourceFile ).parent_path() / "shaders"sv / "fxc"sv / ( name + ".vcs" );
+		const auto filePath = fxcPath / ( name + ".vcs" );
 		std::ifstream file( filePath, std::ios::binary );
 		if ( file )
 		{
@@ -323,15 +444,39 @@ bool Parser::CheckCrc( const std::string& sourceFile, const std::string& name, u
 		}
 	}
 
+	const auto depsPath = fxcPath / ( name + ".vcs.deps" );
+	if ( binCrc && CheckDeps( depsPath, binCrc ) )
+	{
+		crc32 = binCrc;
+		return true;
+	}
+
 	std::string file;
 	std::vector<std::string> includes;
+	std::vector<Dependency> deps;
 	const auto& read = [&file]( const std::string& line )
 	{
 		file += line + "\n";
 	};
-	if ( !ReadFile( sourceFile, includes, read ) )
+	if ( !ReadFile( sourceFile, includes, read, &deps ) )
 		return false;
 
 	crc32 = CRC32::ProcessSingleBuffer( file.c_str(), file.size() );
+
+	// Only record files that held still while we read and hashed them
+	std::error_code ec;
+	if ( fs::is_directory( fxcPath, ec ) )
+	{
+		bool bStable = true;
+		for ( Dependency& dep : deps )
+		{
+			dep.hash = HashFile( dep.path );
+			Dependency current { dep.path };
+			bStable &= StatFile( current ) && current.size == dep.size && current.time == dep.time;
+		}
+		if ( bStable )
+			WriteDeps( depsPath, crc32, deps );
+	}
+
 	return crc32 == binCrc;
-}
\ No newline at end of file
+}
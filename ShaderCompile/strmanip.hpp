@@ -12,7 +12,7 @@ static inline std::string PrettyPrintNumber( uint64_t k )
 		( j && !( j % 3 ) ) ? ( *pchPrint-- = ',' ) : 0;
 		*pchPrint-- = '0' + char( k % 10 );
 	}
-	*++pchPrint ? 0 : *pchPrint = 0;
+	*++pchPrint ? 0 : *pchPrint = '0';
 	return pchPrint;
 }
 
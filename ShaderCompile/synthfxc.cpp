@@ -0,0 +1,281 @@
+//
+// Purpose: Synthetic compiler backend.
+//
+// Produces deterministic pseudo-bytecode instead of calling D3DCompile, so the
+// combo enumeration, packing, compression and vcs writing can be profiled
+// without the D3D compiler. Selected with "-backend synthetic".
+//
+// Macros understood by the backend (all optional):
+//   SYNTHETIC_SIZE       bytecode size, in units of 64 bytes
+//   SYNTHETIC_LATENCY    compile latency, in units of 100 microseconds (busy wait, like a real compile)
+//   SYNTHETIC_WARN       non-zero reports a warning in the listing
+//   SYNTHETIC_FAIL       non-zero makes the combo fail with an error
+// Combos that do not define SYNTHETIC_SIZE/SYNTHETIC_LATENCY use the -synth-size/-synth-latency defaults.
+// Preprocess keeps only the defines the shader and its includes mention, which is
+// enough to model -preprocess-dedup.
+//
+
+#include "compilerbackend.h"
+
+#include "basetypes.h"
+#include "d3dxfxc.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
+#include <string_view>
+
+namespace InterceptFxc
+{
+namespace Synthetic
+{
+	static std::atomic<size_t> s_nDefaultSize { 2048 };
+	static std::atomic<uint32_t> s_nDefaultLatency { 0 };
+
+	// FNV-1a, good enough to spread the combos
+	static constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+	static uint64_t Hash( uint64_t h, const char* sz ) noexcept
+	{
+		for ( ; *sz; ++sz )
+			h = ( h ^ static_cast<uint8_t>( *sz ) ) * 0x100000001b3ULL;
+		return ( h ^ 0xff ) * 0x100000001b3ULL; // terminator, so "ab"+"c" != "a"+"bc"
+	}
+
+	static uint64_t XorShift( uint64_t& state ) noexcept
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	class CResponse final : public CmdSink::IResponse
+	{
+	public:
+		CResponse( std::unique_ptr<uint8_t[]> pCode, size_t nCodeSize, std::string sListing, bool bSucceeded ) noexcept
+			: m_pCode( std::move( pCode ) ), m_nCodeSize( nCodeSize ), m_sListing( std::move( sListing ) ), m_bSucceeded( bSucceeded )
+		{
+		}
+
+		bool Succeeded() noexcept override { return m_bSucceeded; }
+		size_t GetResultBufferLen() override { return m_bSucceeded ? m_nCodeSize : 0; }
+		const void* GetResultBuffer() override { return m_bSucceeded ? m_pCode.get() : nullptr; }
+		const char* GetListing() override { return m_sListing.empty() ? nullptr : m_sListing.c_str(); }
+
+	private:
+		std::unique_ptr<uint8_t[]> m_pCode;
+		size_t m_nCodeSize;
+		std::string m_sListing;
+		bool m_bSucceeded;
+	};
+
+	class CSyntheticBackend final : public ICompilerBackend
+	{
+	public:
+		const char* Name() const noexcept override { return "synthetic"; }
+		void Compile( const CmdSink::CompileCommand& command, unsigned long flags, CmdSink::IResponse** ppResponse ) override;
+		bool Preprocess( const CmdSink::CompileCommand& command, std::string& rText ) override;
+		void CompilePreprocessed( const CmdSink::CompileCommand& command, const std::string& text, unsigned long flags, CmdSink::IResponse** ppResponse ) override;
+
+	private:
+		static void Generate( const CmdSink::CompileCommand& command, uint64_t nShaderHash, uint64_t nComboHash, CmdSink::IResponse** ppResponse );
+	};
+
+	// The shader hash drives the instruction dictionary, shared by all combos of the shader,
+	// the combo hash drives the instruction stream
+	static uint64_t ShaderHash( const CmdSink::CompileCommand& command, unsigned long flags ) noexcept
+	{
+		return Hash( Hash( FNV_OFFSET, command.m_szFileName ), command.m_szShaderModel ) ^ flags;
+	}
+
+	void CSyntheticBackend::Compile( const CmdSink::CompileCommand& command, unsigned long flags, CmdSink::IResponse** ppResponse )
+	{
+		const uint64_t nShaderHash = ShaderHash( command, flags );
+		uint64_t nComboHash        = nShaderHash;
+		for ( const CmdSink::ShaderMacro& macro : command.m_macros )
+		{
+			if ( !macro.Name )
+				break;
+			nComboHash = Hash( Hash( nComboHash, macro.Name ), macro.Definition );
+		}
+
+		Generate( command, nShaderHash, nComboHash, ppResponse );
+	}
+
+	// Identifiers of a file and of everything it includes, comments left out. That is all
+	// a define needs to have a chance of making a difference after preprocessing.
+	static void CollectIdentifiers( const std::string& fileName, std::set<std::string>& identifiers, std::set<std::string>& visited )
+	{
+		if ( !visited.emplace( fileName ).second )
+			return;
+
+		const CSharedFile* pFile = fileCache.Get( fileName );
+		if ( !pFile )
+			return;
+
+		const char* p          = static_cast<const char*>( pFile->Data() );
+		const char* const pEnd = p + pFile->Size();
+		bool bInclude          = false;
+		while ( p < pEnd )
+		{
+			if ( *p == '/' && p + 1 < pEnd && p[1] == '/' )
+				p = std::find( p, pEnd, '\n' );
+			else if ( *p == '/' && p + 1 < pEnd && p[1] == '*' )
+			{
+				constexpr char szEnd[] = "*/";
+				p = std::search( p + 2, pEnd, szEnd, szEnd + 2 );
+				p = std::min( p + 2, pEnd );
+			}
+			else if ( *p == '"' )
+			{
+				const char* const pClose = std::find( p + 1, pEnd, '"' );
+				if ( bInclude )
+				{
+					const std::string include( p + 1, pClose );
+					const size_t nSlash = include.find_last_of( "/\\" );
+					CollectIdentifiers( nSlash == std::string::npos ? include : include.substr( nSlash + 1 ), identifiers, visited );
+				}
+				p = std::min( pClose + 1, pEnd );
+			}
+			else if ( isalpha( static_cast<uint8_t>( *p ) ) || *p == '_' )
+			{
+				const char* const pStart = p;
+				while ( p < pEnd && ( isalnum( static_cast<uint8_t>( *p ) ) || *p == '_' ) )
+					++p;
+				bInclude = std::string_view( pStart, p - pStart ) == "include";
+				identifiers.emplace( pStart, p );
+				continue;
+			}
+			else
+				++p;
+
+			bInclude = false;
+		}
+	}
+
+	// Fake preprocessor: the text consists of the defines the shader mentions,
+	// so combos that only differ in unused defines come out the same
+	bool CSyntheticBackend::Preprocess( const CmdSink::CompileCommand& command, std::string& rText )
+	{
+		static std::mutex s_mtx;
+		static std::map<std::string, std::set<std::string>, std::less<>> s_identifiers;
+
+		const std::set<std::string>* pIdentifiers;
+		{
+			std::lock_guard lock( s_mtx );
+			auto it = s_identifiers.find( command.m_szFileName );
+			if ( it == s_identifiers.end() )
+			{
+				if ( !fileCache.Get( command.m_szFileName ) )
+					return false;
+
+				std::set<std::string> visited;
+				it = s_identifiers.emplace( command.m_szFileName, std::set<std::string>() ).first;
+				CollectIdentifiers( command.m_szFileName, it->second, visited );
+			}
+			pIdentifiers = &it->second;
+		}
+
+		rText.assign( "#line 1 \"" ).append( command.m_szFileName ).append( "\"\n" );
+		for ( const CmdSink::ShaderMacro& macro : command.m_macros )
+		{
+			if ( !macro.Name )
+				break;
+
+			// The SYNTHETIC_* knobs always count, they drive the output
+			if ( !strncmp( macro.Name, "SYNTHETIC_", 10 ) || pIdentifiers->contains( macro.Name ) )
+				rText.append( "#define " ).append( macro.Name ).append( " " ).append( macro.Definition ).append( "\n" );
+		}
+		return true;
+	}
+
+	void CSyntheticBackend::CompilePreprocessed( const CmdSink::CompileCommand& command, const std::string& text, unsigned long flags, CmdSink::IResponse** ppResponse )
+	{
+		const uint64_t nShaderHash = ShaderHash( command, flags );
+		Generate( command, nShaderHash, Hash( nShaderHash, text.c_str() ), ppResponse );
+	}
+
+	void CSyntheticBackend::Generate( const CmdSink::CompileCommand& command, uint64_t nShaderHash, uint64_t nComboHash, CmdSink::IResponse** ppResponse )
+	{
+		const char* const pszFilename = command.m_szFileName;
+
+		size_t nSize       = s_nDefaultSize;
+		uint64_t nLatency  = s_nDefaultLatency;
+		bool bWarn = false, bFail = false;
+
+		for ( const CmdSink::ShaderMacro& macro : command.m_macros )
+		{
+			if ( !macro.Name )
+				break;
+
+			if ( !strcmp( macro.Name, "SYNTHETIC_SIZE" ) )
+				nSize = static_cast<size_t>( strtoul( macro.Definition, nullptr, 10 ) ) * 64;
+			else if ( !strcmp( macro.Name, "SYNTHETIC_LATENCY" ) )
+				nLatency = strtoul( macro.Definition, nullptr, 10 ) * 100;
+			else if ( !strcmp( macro.Name, "SYNTHETIC_WARN" ) )
+				bWarn = strtoul( macro.Definition, nullptr, 10 ) != 0;
+			else if ( !strcmp( macro.Name, "SYNTHETIC_FAIL" ) )
+				bFail = strtoul( macro.Definition, nullptr, 10 ) != 0;
+		}
+
+		// Busy wait: a real compile keeps the core busy as well
+		if ( nLatency )
+		{
+			const auto end = std::chrono::steady_clock::now() + std::chrono::microseconds( nLatency );
+			while ( std::chrono::steady_clock::now() < end )
+				continue;
+		}
+
+		std::string sListing;
+		if ( bFail )
+			sListing += std::string( pszFilename ) + "(1,1): error X0000: synthetic failure\n";
+		else if ( bWarn )
+			sListing += std::string( pszFilename ) + "(1,1): warning X0000: synthetic warning\n";
+
+		std::unique_ptr<uint8_t[]> pCode;
+		if ( !bFail )
+		{
+			// Vary the size a bit per combo, real bytecode is never uniform
+			nSize = ( nSize + ( nComboHash % ( nSize / 8 + 1 ) ) ) & ~size_t( 3 );
+			nSize = std::max<size_t>( nSize, 8 );
+			pCode.reset( new uint8_t[nSize] );
+
+			// Shader bytecode is a stream of 4-byte tokens drawn from a small vocabulary,
+			// which is what makes it compress well. Mimic that.
+			uint32_t dictionary[64];
+			uint64_t dictState = nShaderHash | 1;
+			for ( uint32_t& token : dictionary )
+				token = static_cast<uint32_t>( XorShift( dictState ) );
+
+			uint32_t* pTokens = reinterpret_cast<uint32_t*>( pCode.get() );
+			pTokens[0] = 0xFFFF0300; // version token
+			uint64_t streamState = nComboHash | 1;
+			for ( size_t i = 1, numTokens = nSize / 4; i < numTokens; ++i )
+			{
+				const uint64_t r = XorShift( streamState );
+				pTokens[i] = dictionary[r & 63] ^ static_cast<uint32_t>( ( r >> 6 ) & ( ( r >> 12 ) & 1 ? 0xF : 0 ) );
+			}
+		}
+
+		if ( ppResponse )
+			*ppResponse = new( std::nothrow ) CResponse( std::move( pCode ), bFail ? 0 : nSize, std::move( sListing ), !bFail );
+	}
+
+	static CSyntheticBackend s_backend;
+	static CBackendRegistrar s_backendReg( &s_backend );
+} // namespace Synthetic
+
+void SetSyntheticDefaults( size_t nByteCodeSize, uint32_t nLatencyMicroseconds )
+{
+	Synthetic::s_nDefaultSize    = nByteCodeSize;
+	Synthetic::s_nDefaultLatency = nLatencyMicroseconds;
+}
+} // namespace InterceptFxc
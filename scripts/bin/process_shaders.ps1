@@ -10,22 +10,17 @@ if ($Version -notin @("20b", "30", "40", "41", "50", "51")) {
 	return
 }
 
-$fileList = $File.OpenText()
-while ($null -ne ($line = $fileList.ReadLine())) {
-	if ($line -match '^\s*$' -or $line -match '^\s*//') {
-		continue
-	}
+# The whole list is handled by a single ShaderCompile run, so all the shaders share one worker pool
+$arguments = @("-ver", $Version, "-shaderpath", $File.DirectoryName, "-shaderlist", $File.FullName)
 
-	if ($Dynamic) {
-		& "$PSScriptRoot\ShaderCompile" "-dynamic" "-ver" $Version "-shaderpath" $File.DirectoryName $line
-		continue
-	}
-
-	if ($Threads -ne 0) {
-		& "$PSScriptRoot\ShaderCompile" "-threads" $Threads "-ver" $Version "-shaderpath" $File.DirectoryName $line
-		continue
-	}
+if ($Dynamic) {
+	& "$PSScriptRoot\ShaderCompile" "-dynamic" @arguments
+	return
+}
 
-	& "$PSScriptRoot\ShaderCompile" "-ver" $Version "-shaderpath" $File.DirectoryName $line
+if ($Threads -ne 0) {
+	& "$PSScriptRoot\ShaderCompile" "-threads" $Threads @arguments
+	return
 }
-$fileList.Close()
+
+& "$PSScriptRoot\ShaderCompile" @arguments